@@ -7,8 +7,116 @@
 #include <pybind11/stl.h>
 #include <pybind11/stl_bind.h>
 
+#include <sstream>
+
 namespace py = pybind11;
 
+// Batched kNN: returns (ids, dists), two arrays of shape (num_queries, k);
+// missing neighbours have id -1 and distance inf
+template <typename T>
+py::tuple search_knn_batch(const T &tree,
+                           const Eigen::Ref<const typename T::points_t> &Q,
+                           std::size_t k, int num_threads, bool reorder) {
+  py::array_t<typename T::id_t> ids({std::size_t(Q.cols()), k});
+  py::array_t<typename T::scalar_t> dists({std::size_t(Q.cols()), k});
+  tree.searchKnnBatch(Q, k, ids.mutable_data(), dists.mutable_data(),
+                      num_threads, reorder);
+  return py::make_tuple(ids, dists);
+}
+
+// Batched radius search: returns (offsets, ids, dists) in CSR layout
+template <typename T>
+py::tuple search_ball_batch(const T &tree,
+                            const Eigen::Ref<const typename T::points_t> &Q,
+                            typename T::scalar_t radius, int num_threads,
+                            bool reorder) {
+  std::vector<std::size_t> offsets;
+  std::vector<typename T::id_t> ids;
+  std::vector<typename T::scalar_t> dists;
+  tree.searchBallBatch(Q, radius, offsets, ids, dists, num_threads, reorder);
+  return py::make_tuple(py::array(offsets.size(), offsets.data()),
+                        py::array(ids.size(), ids.data()),
+                        py::array(dists.size(), dists.data()));
+}
+
+// Coordinates of the point with the given id, or None
+template <typename T>
+py::object get_point(const T &tree, const typename T::id_t &id) {
+  typename T::point_t x;
+  if (!tree.getPoint(id, x)) {
+    return py::none();
+  }
+  return py::cast(x);
+}
+
+// searchKnn is overloaded (predicate)
+template <typename T>
+std::vector<typename T::DistanceId>
+search_knn(const T &tree, const typename T::point_t &x, std::size_t k,
+           typename T::scalar_t eps) {
+  return tree.searchKnn(x, k, eps);
+}
+
+template <typename T>
+std::vector<typename T::id_t> search_box(const T &tree,
+                                         const typename T::point_t &lb,
+                                         const typename T::point_t &ub) {
+  return tree.searchBox(lb, ub);
+}
+
+// Closest pair between two trees: returns (distance, id in a, id in b)
+template <typename T> py::tuple closest_pair(const T &a, const T &b) {
+  auto pair = a.closestPair(b);
+  return py::make_tuple(pair.distance, pair.first, pair.second);
+}
+
+// Roadmap in CSR layout: returns (ids, offsets, neighbours, dists)
+template <typename T> py::tuple graph_arrays(const typename T::Graph &graph) {
+  return py::make_tuple(
+      py::array(graph.ids.size(), graph.ids.data()),
+      py::array(graph.offsets.size(), graph.offsets.data()),
+      py::array(graph.neighbours.size(), graph.neighbours.data()),
+      py::array(graph.distances.size(), graph.distances.data()));
+}
+
+template <typename T>
+py::tuple build_radius_graph(const T &tree, typename T::scalar_t radius,
+                             int num_threads) {
+  return graph_arrays<T>(tree.buildRadiusGraph(radius, num_threads));
+}
+
+template <typename T>
+py::tuple build_knn_graph(const T &tree, std::size_t k, int num_threads) {
+  return graph_arrays<T>(tree.buildKnnGraph(k, num_threads));
+}
+
+// Memory breakdown in bytes, as a dict
+template <typename T> py::dict memory_usage(const T &tree) {
+  auto usage = tree.memoryUsage();
+  py::dict out;
+  out["nodes"] = usage.nodes;
+  out["bounds"] = usage.bounds;
+  out["buckets"] = usage.buckets;
+  out["index"] = usage.index;
+  out["slack"] = usage.slack;
+  out["total"] = usage.total();
+  return out;
+}
+
+// Pickling uses the binary format of KDTree::save
+template <typename T> py::bytes get_state(const T &tree) {
+  std::ostringstream out;
+  tree.save(out);
+  return py::bytes(out.str());
+}
+
+template <typename T> T set_state(const py::bytes &state) {
+  std::string data = state;
+  T tree;
+  tree.load(data.data(), data.size());
+  return tree;
+}
+
 template <typename T>
 void declare_tree(py::module &m, const std::string &name) {
   py::class_<typename T::DistanceId>(m, (name + "dp").c_str())
@@ -21,11 +129,45 @@ void declare_tree(py::module &m, const std::string &name) {
       .def("init_tree", &T::init_tree, py::arg("runtime_dimension") = -1,
            py::arg("t_state_space") = typename T::state_space_t())
       .def("addPoint", &T::addPoint)
-      .def("search", &T::search)
-      .def("searchKnn", &T::searchKnn)
+      .def("removePoint", &T::removePoint)
+      .def("updatePoint", &T::updatePoint)
+      .def("getPoint", &get_point<T>)
+      .def("setIdIndex", &T::setIdIndex, py::arg("enabled") = true)
+      .def("setBalanceFactor", &T::setBalanceFactor, py::arg("alpha"))
+      .def("build", &T::build, py::arg("X"), py::arg("ids"),
+           py::arg("num_threads") = 1)
+      .def("search", &T::search, py::arg("x"), py::arg("eps") = 0)
+      .def("searchKnn", &search_knn<T>, py::arg("x"), py::arg("k"),
+           py::arg("eps") = 0)
       .def("searchBall", &T::searchBall)
+      .def("anyWithin", &T::anyWithin, py::arg("x"), py::arg("radius"))
+      .def("countWithin", &T::countWithin, py::arg("x"), py::arg("radius"))
+      .def("searchBox", &search_box<T>, py::arg("lb"), py::arg("ub"))
+      .def("allKnn", &T::allKnn, py::arg("other"), py::arg("k"),
+           py::arg("num_threads") = 1)
+      .def("closestPair", &closest_pair<T>, py::arg("other"))
+      .def("buildRadiusGraph", &build_radius_graph<T>, py::arg("radius"),
+           py::arg("num_threads") = 1)
+      .def("buildKnnGraph", &build_knn_graph<T>, py::arg("k"),
+           py::arg("num_threads") = 1)
+      .def("searchKnnBatch", &search_knn_batch<T>, py::arg("queries"),
+           py::arg("k"), py::arg("num_threads") = 1, py::arg("reorder") = false)
+      .def("searchBallBatch", &search_ball_batch<T>, py::arg("queries"),
+           py::arg("radius"), py::arg("num_threads") = 1,
+           py::arg("reorder") = false)
       .def("getStateSpace", &T::getStateSpace)
-      .def("splitOutstanding", &T::splitOutstanding);
+      .def("splitOutstanding", &T::splitOutstanding,
+           py::arg("num_threads") = 1)
+      .def("setIncrementalBounds", &T::setIncrementalBounds,
+           py::arg("incremental") = true)
+      .def("incrementalBounds", &T::incrementalBounds)
+      .def("save", py::overload_cast<const std::string &>(&T::save, py::const_),
+           py::arg("path"))
+      .def("load", py::overload_cast<const std::string &>(&T::load),
+           py::arg("path"))
+      .def("memoryUsage", &memory_usage<T>)
+      .def("compact", &T::compact)
+      .def(py::pickle(&get_state<T>, &set_state<T>));
 }
 
 template <typename T>
@@ -40,11 +182,45 @@ void declare_treex(py::module &m, const std::string &name) {
       .def(py::init<>())
       .def("init_tree", &T::init_tree) // init tree
       .def("addPoint", &T::addPoint)   // add point
-      .def("search", &T::search)       // search
-      .def("searchKnn", &T::searchKnn) // search
+      .def("removePoint", &T::removePoint)
+      .def("updatePoint", &T::updatePoint)
+      .def("getPoint", &get_point<T>)
+      .def("setIdIndex", &T::setIdIndex, py::arg("enabled") = true)
+      .def("setBalanceFactor", &T::setBalanceFactor, py::arg("alpha"))
+      .def("build", &T::build, py::arg("X"), py::arg("ids"),
+           py::arg("num_threads") = 1) // bulk build
+      .def("search", &T::search, py::arg("x"), py::arg("eps") = 0)
+      .def("searchKnn", &search_knn<T>, py::arg("x"), py::arg("k"),
+           py::arg("eps") = 0)
       .def("searchBall", &T::searchBall)
+      .def("anyWithin", &T::anyWithin, py::arg("x"), py::arg("radius"))
+      .def("countWithin", &T::countWithin, py::arg("x"), py::arg("radius"))
+      .def("searchBox", &search_box<T>, py::arg("lb"), py::arg("ub"))
+      .def("allKnn", &T::allKnn, py::arg("other"), py::arg("k"),
+           py::arg("num_threads") = 1)
+      .def("closestPair", &closest_pair<T>, py::arg("other"))
+      .def("buildRadiusGraph", &build_radius_graph<T>, py::arg("radius"),
+           py::arg("num_threads") = 1)
+      .def("buildKnnGraph", &build_knn_graph<T>, py::arg("k"),
+           py::arg("num_threads") = 1)
+      .def("searchKnnBatch", &search_knn_batch<T>, py::arg("queries"),
+           py::arg("k"), py::arg("num_threads") = 1, py::arg("reorder") = false)
+      .def("searchBallBatch", &search_ball_batch<T>, py::arg("queries"),
+           py::arg("radius"), py::arg("num_threads") = 1,
+           py::arg("reorder") = false)
       .def("getStateSpace", &T::getStateSpace)
-      .def("splitOutstanding", &T::splitOutstanding);
+      .def("splitOutstanding", &T::splitOutstanding,
+           py::arg("num_threads") = 1)
+      .def("setIncrementalBounds", &T::setIncrementalBounds,
+           py::arg("incremental") = true)
+      .def("incrementalBounds", &T::incrementalBounds)
+      .def("save", py::overload_cast<const std::string &>(&T::save, py::const_),
+           py::arg("path"))
+      .def("load", py::overload_cast<const std::string &>(&T::load),
+           py::arg("path"))
+      .def("memoryUsage", &memory_usage<T>)
+      .def("compact", &T::compact)
+      .def(py::pickle(&get_state<T>, &set_state<T>));
 
   //
   //
@@ -126,6 +302,11 @@ PYBIND11_MODULE(pydynotree, m) {
   using TreeSO2 = dynotree::KDTree<int, 1, bucket_size, double, SO2>;
   using TreeR3SO3 = dynotree::KDTree<int, 7, bucket_size, double, R3SO3>;
   using TreeX = dynotree::KDTree<int, -1, bucket_size, double, Combined>;
+  // compressed leaves; results are rescored against exact coordinates
+  using TreeRX_f32 = dynotree::KDTree<int, -1, bucket_size, double, RX,
+                                      dynotree::LeafLayout::Float32>;
+  using TreeRX_i16 = dynotree::KDTree<int, -1, bucket_size, double, RX,
+                                      dynotree::LeafLayout::Int16>;
 
   declare_tree<TreeRX>(m, "TreeRX");
   declare_tree<TreeR2>(m, "TreeR2");
@@ -136,6 +317,8 @@ PYBIND11_MODULE(pydynotree, m) {
   declare_tree<TreeSO2>(m, "TreeSO2");
   declare_tree<TreeR3SO3>(m, "TreeR3SO3");
   declare_treex<TreeX>(m, "TreeX");
+  declare_tree<TreeRX_f32>(m, "TreeRX_f32");
+  declare_tree<TreeRX_i16>(m, "TreeRX_i16");
 
   m.def("srand", [](int seed) { srand(seed); });
   m.def("rand", []() { return rand(); });
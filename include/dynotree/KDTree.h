@@ -1,28 +1,75 @@
 #pragma once
 
 #include <algorithm>
+#include <array>
 #include <cmath>
+#include <cstdint>
 #include <cwchar>
+#include <deque>
 #include <limits>
+#include <mutex>
 #include <queue>
 #include <set>
+#include <type_traits>
+#include <unordered_map>
 #include <vector>
 
 #include <eigen3/Eigen/Core>
 #include <eigen3/Eigen/Dense>
 
 #include "StateSpace.h"
+#include "dynotree/bucket.h"
 #include "dynotree/dynotree_macros.h"
+#include "dynotree/serialization.h"
+#include "dynotree/thread_pool.h"
 
 namespace dynotree {
 
+// Order in which a Searcher visits the nodes of a KDTree.
+enum class Traversal {
+  DepthFirst, /// stack, the child on the side of the query first
+  BestFirst   /// min-heap of pending nodes keyed by their box distance
+};
+
+// The k best candidates of a query so far, in a max-heap on distance.
+template <typename DistanceId>
+using CandidateQueue =
+    std::priority_queue<DistanceId, std::vector<DistanceId>>;
+
+// Adds a candidate if the queue holds fewer than k, or if it beats the
+// worst one.
+template <typename DistanceId>
+inline void offerCandidate(CandidateQueue<DistanceId> &queue, std::size_t k,
+                           const DistanceId &candidate) {
+  if (queue.size() < k) {
+    queue.push(candidate);
+  } else if (candidate.distance < queue.top().distance) {
+    queue.pop();
+    queue.push(candidate);
+  }
+}
+
+// Empties the queue into `results`, sorted by increasing distance.
+template <typename DistanceId>
+void drainCandidates(CandidateQueue<DistanceId> &queue,
+                     std::vector<DistanceId> &results) {
+  results.reserve(results.size() + queue.size());
+  auto first = results.end() - results.begin();
+  while (queue.size() > 0) {
+    results.push_back(queue.top());
+    queue.pop();
+  }
+  std::reverse(results.begin() + first, results.end());
+}
+
 template <class Id, int Dimensions, std::size_t BucketSize = 32,
           typename Scalar = double,
-          typename StateSpace = Rn<Scalar, Dimensions>>
+          typename StateSpace = Rn<Scalar, Dimensions>,
+          LeafLayout Layout = LeafLayout::AoS>
 class KDTree {
 private:
   struct Node;
-  std::vector<Node> m_nodes;
+  class NodeArena;
   std::set<std::size_t> waitingForSplit;
   StateSpace state_space;
 
@@ -30,12 +77,15 @@ public:
   using scalar_t = Scalar;
   using id_t = Id;
   using point_t = Eigen::Matrix<Scalar, Dimensions, 1>;
+  using points_t = Eigen::Matrix<Scalar, Dimensions, Eigen::Dynamic>;
   using cref_t = const Eigen::Ref<const Eigen::Matrix<Scalar, Dimensions, 1>> &;
   using ref_t = Eigen::Ref<Eigen::Matrix<Scalar, Dimensions, 1>>;
   using state_space_t = StateSpace;
   int m_dimensions = Dimensions;
   static const std::size_t bucketSize = BucketSize;
-  using tree_t = KDTree<Id, Dimensions, BucketSize, Scalar, StateSpace>;
+  static const LeafLayout leafLayout = Layout;
+  using tree_t =
+      KDTree<Id, Dimensions, BucketSize, Scalar, StateSpace, Layout>;
 
   StateSpace &getStateSpace() { return state_space; }
 
@@ -47,40 +97,348 @@ public:
     if constexpr (Dimensions == Eigen::Dynamic) {
       assert(runtime_dimension > 0);
       m_dimensions = runtime_dimension;
-      m_nodes.emplace_back(BucketSize, m_dimensions);
-    } else {
-      m_nodes.emplace_back(BucketSize, -1);
     }
+    m_nodes.setDimensions(m_dimensions);
+    m_nodes.emplace_back(BucketSize, m_dimensions);
   }
 
   size_t size() const { return m_nodes[0].m_entries; }
 
   void addPoint(const point_t &x, const Id &id, bool autosplit = true) {
     std::size_t addNode = 0;
+    std::size_t depth = 0;
 
     assert(m_dimensions > 0);
     while (m_nodes[addNode].m_splitDimension != m_dimensions) {
-      m_nodes[addNode].expandBounds(x);
+      m_nodes.expandBounds(addNode, x);
       if (x[m_nodes[addNode].m_splitDimension] <
           m_nodes[addNode].m_splitValue) {
         addNode = m_nodes[addNode].m_children.first;
       } else {
         addNode = m_nodes[addNode].m_children.second;
       }
+      depth++;
     }
-    m_nodes[addNode].add(PointId{x, id});
+    addToLeaf(addNode, PointId{x, id});
 
     if (m_nodes[addNode].shouldSplit() &&
         m_nodes[addNode].m_entries % BucketSize == 0) {
       if (autosplit) {
-        split(addNode);
+        depth += split(addNode);
       } else {
         waitingForSplit.insert(addNode);
       }
     }
+
+    if (m_balance > 0 && autosplit && depth > maxBalancedDepth()) {
+      rebalance(x);
+    }
+  }
+
+  // Enables scapegoat rebuilds with balance factor alpha in (0.5, 1); 0
+  // disables them (the default). When an insertion lands deeper than
+  // log(size / BucketSize) / log(1 / alpha) + 1, the lowest node on its path
+  // with a child holding more than alpha of its points is rebuilt in place
+  // by median splits, as in build(). Smaller alpha keeps the tree closer to
+  // balance at the price of more frequent rebuilds; the cost per insertion
+  // is amortised O(log^2 n).
+  void setBalanceFactor(double alpha) {
+    CHECK_PRETTY_DYNOTREE(alpha == 0 || (alpha > 0.5 && alpha < 1),
+                          "alpha must be 0 or in (0.5, 1)");
+    m_balance = alpha;
+  }
+
+  double balanceFactor() const { return m_balance; }
+
+  struct DepthStats {
+    std::size_t leaves = 0;   /// number of non-empty leaves
+    std::size_t maxDepth = 0; /// of the deepest non-empty leaf (root is 0)
+    double meanDepth = 0;     /// average depth of the points
+  };
+
+  DepthStats depthStats() const {
+    DepthStats stats;
+    if (m_nodes.size() == 0 || size() == 0) {
+      return stats;
+    }
+    std::vector<std::pair<std::size_t, std::size_t>> searchStack{{0, 0}};
+    while (searchStack.size() > 0) {
+      auto [index, depth] = searchStack.back();
+      searchStack.pop_back();
+      const Node &node = m_nodes[index];
+      if (node.m_splitDimension != m_dimensions) {
+        searchStack.emplace_back(node.m_children.first, depth + 1);
+        searchStack.emplace_back(node.m_children.second, depth + 1);
+      } else if (node.m_entries > 0) {
+        stats.leaves++;
+        stats.maxDepth = std::max(stats.maxDepth, depth);
+        stats.meanDepth += double(depth) * node.m_entries;
+      }
+    }
+    stats.meanDepth /= size();
+    return stats;
+  }
+
+  // Bytes held by the tree. Capacity that is allocated but holds nothing
+  // (spare room of the arrays, freed nodes, bucket reservations beyond
+  // their points, the recycled bucket) is counted as slack only.
+  struct MemoryUsage {
+    std::size_t nodes = 0;   /// node records in use
+    std::size_t bounds = 0;  /// bounding boxes of the nodes in use
+    std::size_t buckets = 0; /// points, ids and flags held by the leaves
+    std::size_t index = 0;   /// id index, estimated (see setIdIndex)
+    std::size_t slack = 0;
+
+    std::size_t total() const {
+      return nodes + bounds + buckets + index + slack;
+    }
+  };
+
+  MemoryUsage memoryUsage() const {
+    MemoryUsage usage;
+    std::size_t numNodes = m_nodes.size() - m_nodes.numFree();
+    std::size_t boundBytes = 2 * m_dimensions * sizeof(Scalar);
+    usage.nodes = numNodes * sizeof(Node);
+    usage.bounds = numNodes * boundBytes;
+    usage.slack = (m_nodes.capacity() - numNodes) * sizeof(Node) +
+                  m_nodes.boundsCapacity() * sizeof(Scalar) - usage.bounds +
+                  m_bucketRecycle.allocatedBytes();
+    for (std::size_t i = 0; i < m_nodes.size(); i++) {
+      const bucket_t &bucket = m_nodes[i].m_locationId;
+      usage.buckets += bucket.usedBytes();
+      usage.slack += bucket.allocatedBytes() - bucket.usedBytes();
+    }
+    usage.index =
+        m_idIndex.bucket_count() * sizeof(void *) +
+        m_idIndex.size() * (sizeof(std::pair<const Id, Location>) +
+                            2 * sizeof(void *));
+    return usage;
+  }
+
+  // Releases the slack counted by memoryUsage() and renumbers the nodes in
+  // depth-first order (a node, its first subtree, then its second), so that
+  // a descent reads the node array forwards. Returns the bytes freed.
+  // Buckets filled later grow again as needed. Does nothing before
+  // init_tree.
+  std::size_t compact() {
+    if (m_nodes.size() == 0) {
+      return 0;
+    }
+    std::size_t before = memoryUsage().total();
+    const std::size_t freed = std::numeric_limits<std::size_t>::max();
+    std::vector<std::size_t> newIndex(m_nodes.size(), freed);
+    NodeArena nodes;
+    nodes.setDimensions(m_dimensions);
+    nodes.reserve(m_nodes.size() - m_nodes.numFree());
+
+    std::vector<std::size_t> searchStack{0};
+    while (searchStack.size() > 0) {
+      std::size_t index = searchStack.back();
+      searchStack.pop_back();
+      newIndex[index] = nodes.size();
+      nodes.emplace_back();
+      nodes.assign(nodes.size() - 1, m_nodes, index);
+      Node &node = nodes.back();
+      if (node.m_splitDimension != m_dimensions) {
+        node.m_locationId = bucket_t();
+        searchStack.push_back(node.m_children.second);
+        searchStack.push_back(node.m_children.first);
+      } else {
+        node.m_locationId.shrink();
+      }
+    }
+    for (std::size_t i = 0; i < nodes.size(); i++) {
+      Node &node = nodes[i];
+      if (node.m_splitDimension != m_dimensions) {
+        node.m_children = std::make_pair(newIndex[node.m_children.first],
+                                         newIndex[node.m_children.second]);
+      }
+    }
+    m_nodes = std::move(nodes);
+    m_bucketRecycle = bucket_t();
+
+    std::set<std::size_t> waiting;
+    for (std::size_t index : waitingForSplit) {
+      if (newIndex[index] != freed) {
+        waiting.insert(newIndex[index]);
+      }
+    }
+    std::swap(waitingForSplit, waiting);
+    for (auto &entry : m_idIndex) {
+      entry.second.leaf = newIndex[entry.second.leaf];
+    }
+    return before - memoryUsage().total();
+  }
+
+  // Keeps a hash index from id to the leaf and slot of each point, so that
+  // removePoint, updatePoint and getPoint find points in constant time.
+  // Those methods throw while the index is off, which is the default: it
+  // costs memory and time in every insertion. Once on, it is kept up to
+  // date, also through build, splitOutstanding and load. Ids must be
+  // unique.
+  void setIdIndex(bool enabled = true) {
+    if (!enabled) {
+      dropIdIndex();
+    } else if (!m_indexed) {
+      m_indexed = true;
+      if (m_nodes.size() > 0) {
+        buildIdIndex();
+      }
+    }
+  }
+
+  bool idIndex() const { return m_indexed; }
+
+  // Writes the coordinates of the point with the given id to x and returns
+  // true, or returns false if there is none.
+  bool getPoint(const Id &id, point_t &x) const {
+    const Location *location = findLocation(id);
+    if (!location) {
+      return false;
+    }
+    x = m_nodes[location->leaf].m_locationId.point(location->slot);
+    return true;
+  }
+
+  // Removes the point with the given id from the tree and returns true, or
+  // returns false if there is none. Counts and boxes along its path are
+  // updated, and sibling leaves holding together fewer than BucketSize / 2
+  // points are merged into their parent.
+  bool removePoint(const Id &id) {
+    const Location *location = findLocation(id);
+    if (!location) {
+      return false;
+    }
+    std::size_t leaf = location->leaf;
+    std::size_t slot = location->slot;
+    m_idIndex.erase(id);
+
+    bucket_t &bucket = m_nodes[leaf].m_locationId;
+    point_t x = bucket.point(slot);
+    std::vector<std::size_t> path;
+    pathTo(x, leaf, path);
+
+    bool boundary = onBoundary(x, leaf);
+    if (!bucket.active(slot)) {
+      m_numInactive--;
+    }
+    bucket.erase(slot);
+    if (slot < bucket.size()) {
+      m_idIndex[bucket.id(slot)].slot = slot;
+    }
+    m_nodes[leaf].m_entries--;
+    for (std::size_t index : path) {
+      m_nodes[index].m_entries--;
+    }
+    if (boundary) {
+      refitLeaf(leaf);
+    }
+
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+      Node &node = m_nodes[*it];
+      std::size_t left = node.m_children.first;
+      std::size_t right = node.m_children.second;
+      if (boundary) {
+        m_nodes.resetBounds(*it);
+        m_nodes.includeBounds(*it, left);
+        m_nodes.includeBounds(*it, right);
+      }
+      bool merge = m_nodes[left].m_splitDimension == m_dimensions &&
+                   m_nodes[right].m_splitDimension == m_dimensions &&
+                   2 * node.m_entries < BucketSize;
+      if (merge) {
+        mergeChildren(*it);
+      } else if (!boundary) {
+        break;
+      }
+    }
+    return true;
+  }
+
+  // Moves the point with the given id to x and returns true, or returns
+  // false if there is none. If x falls in the region of the same leaf, the
+  // point is overwritten in place and only the boxes on its path change;
+  // otherwise it is removed and inserted again, inactive if it was.
+  bool updatePoint(const Id &id, const point_t &x) {
+    const Location *location = findLocation(id);
+    if (!location) {
+      return false;
+    }
+    std::size_t leaf = location->leaf;
+    std::size_t slot = location->slot;
+
+    std::vector<std::size_t> path;
+    std::size_t index = 0;
+    while (m_nodes[index].m_splitDimension != m_dimensions) {
+      const Node &node = m_nodes[index];
+      path.push_back(index);
+      index = x[node.m_splitDimension] < node.m_splitValue
+                  ? node.m_children.first
+                  : node.m_children.second;
+    }
+    bucket_t &bucket = m_nodes[leaf].m_locationId;
+    if (index != leaf) {
+      bool active = bucket.active(slot);
+      removePoint(id);
+      addPoint(x, id);
+      if (!active) {
+        const Location &moved = m_idIndex.at(id);
+        m_nodes[moved.leaf].m_locationId.setActive(moved.slot, false);
+        m_numInactive++;
+      }
+      return true;
+    }
+
+    bool boundary = onBoundary(bucket.point(slot), leaf);
+    bucket.setPoint(slot, x);
+    if (boundary) {
+      // the old position may have defined some boxes: refit the path
+      refitLeaf(leaf);
+      for (auto it = path.rbegin(); it != path.rend(); ++it) {
+        m_nodes.resetBounds(*it);
+        m_nodes.includeBounds(*it, m_nodes[*it].m_children.first);
+        m_nodes.includeBounds(*it, m_nodes[*it].m_children.second);
+      }
+    } else {
+      m_nodes.includePoint(leaf, x);
+      for (std::size_t index : path) {
+        m_nodes.includePoint(index, x);
+      }
+    }
+    return true;
   }
 
-  void splitOutstanding() {
+  // Splits the leaves filled with addPoint(x, id, false). With more than one
+  // thread, every waiting leaf is split into a full subtree by the workers
+  // of a work-stealing pool.
+  void splitOutstanding(int num_threads = 1) {
+    if (num_threads > 1) {
+      WorkStealingPool pool(num_threads);
+      BuildContext ctx{&pool};
+      for (std::size_t index : waitingForSplit) {
+        Node &node = m_nodes[index];
+        if (node.m_splitDimension != m_dimensions || !node.shouldSplit()) {
+          continue;
+        }
+        std::size_t blockIndex;
+        BuildBlock *block = ctx.newBlock(0, index, 0, m_dimensions, blockIndex);
+        node.m_locationId.takePoints(block->points);
+        pool.submit([this, &ctx, block, blockIndex] {
+          block->keys.resize(block->points.size());
+          buildSubtree(block->nodes, block->points.begin(),
+                       block->points.end(), block->keys.data(), 0, &ctx,
+                       blockIndex);
+        });
+      }
+      waitingForSplit.clear();
+      pool.wait();
+      spliceBlocks(ctx.blocks);
+      if (m_indexed) {
+        buildIdIndex();
+      }
+      return;
+    }
+
     std::vector<std::size_t> searchStack(waitingForSplit.begin(),
                                          waitingForSplit.end());
     waitingForSplit.clear();
@@ -95,6 +453,98 @@ public:
     }
   }
 
+  // Builds the tree from scratch, one point per column of X. The points are
+  // partitioned top-down by median, so the result is balanced. Previous
+  // content is discarded; the tree stays dynamic (addPoint can be used
+  // afterwards). With more than one thread, subtrees are built in parallel.
+  void build(const Eigen::Ref<const points_t> &X, const std::vector<Id> &ids,
+             int num_threads = 1) {
+    CHECK_PRETTY_DYNOTREE(m_nodes.size(), "call init_tree before build");
+    CHECK_PRETTY_DYNOTREE(X.rows() == m_dimensions, "wrong point dimension");
+    CHECK_PRETTY_DYNOTREE(std::size_t(X.cols()) == ids.size(),
+                          "one id per point is required");
+
+    std::vector<PointId> points;
+    points.reserve(ids.size());
+    for (std::size_t i = 0; i < ids.size(); i++) {
+      points.push_back(PointId{X.col(i), ids[i]});
+    }
+    std::vector<Scalar> keys(points.size());
+
+    bool indexed = m_indexed;
+    m_nodes.clear();
+    waitingForSplit.clear();
+    dropIdIndex();
+    m_numInactive = 0;
+    m_nodes.reserve(1 + 4 * points.size() / BucketSize);
+    m_nodes.emplace_back(BucketSize, m_dimensions);
+
+    if (num_threads > 1) {
+      WorkStealingPool pool(num_threads);
+      BuildContext ctx{&pool};
+      buildSubtree(m_nodes, points.begin(), points.end(), keys.data(), 0, &ctx,
+                   0);
+      pool.wait();
+      spliceBlocks(ctx.blocks);
+    } else {
+      buildSubtree(m_nodes, points.begin(), points.end(), keys.data(), 0);
+    }
+    if (indexed) {
+      buildIdIndex();
+    }
+  }
+
+  // Writes the tree to a versioned binary format (see serialization.h):
+  // the nodes with their split planes and bounding boxes, the leaf contents
+  // and the state space parameters. Byte order is the native one.
+  void save(std::ostream &out) const {
+    BinaryWriter ar(out);
+    ar(fileMagic, fileVersion, fileTag());
+    ar(m_dimensions, state_space, m_nodes, waitingForSplit,
+       m_incrementalBounds, m_numInactive, m_balance);
+  }
+
+  void save(const std::string &path) const {
+    std::ofstream out(path, std::ios::binary);
+    CHECK_PRETTY_DYNOTREE(out.is_open(), "cannot open " + path);
+    save(out);
+  }
+
+  // Replaces the content of the tree with a tree written by save(). This is
+  // a deserialization pass: nodes, boxes and buckets are copied into the
+  // tree's own storage, one array at a time, but no point is inserted or
+  // split again. The id index is not saved, and is rebuilt if it is on.
+  // Throws if the data was written by a tree of another type or is
+  // truncated, leaving the tree unchanged.
+  void load(const char *data, std::size_t size) {
+    BinaryReader ar(data, size);
+    std::uint64_t magic = 0;
+    std::uint32_t version = 0;
+    std::vector<std::int64_t> tag;
+    ar(magic, version);
+    CHECK_PRETTY_DYNOTREE(magic == fileMagic, "not a dynotree file");
+    CHECK_PRETTY_DYNOTREE(version == fileVersion, "unsupported file version");
+    ar(tag);
+    CHECK_PRETTY_DYNOTREE(tag == fileTag(),
+                          "file written by a tree of another type");
+
+    tree_t tree;
+    ar(tree.m_dimensions, tree.state_space, tree.m_nodes, tree.waitingForSplit,
+       tree.m_incrementalBounds, tree.m_numInactive, tree.m_balance);
+    tree.checkLoaded();
+    bool indexed = m_indexed;
+    *this = std::move(tree);
+    if (indexed) {
+      buildIdIndex();
+    }
+  }
+
+  // Loads a file written by save(path).
+  void load(const std::string &path) {
+    std::string data = readFile(path);
+    load(data.data(), data.size());
+  }
+
   struct DistanceId {
     Scalar distance;
     Id id;
@@ -103,49 +553,530 @@ public:
     }
   };
 
-  std::vector<DistanceId> searchKnn(const point_t &x,
-                                    std::size_t maxPoints) const {
-    return searcher().search(x, std::numeric_limits<Scalar>::max(), maxPoints,
-                             state_space);
+  // k nearest neighbours, sorted by distance. With eps > 0 the i-th result
+  // is within a factor (1 + eps) of the exact i-th neighbour.
+  std::vector<DistanceId> searchKnn(const point_t &x, std::size_t maxPoints,
+                                    Scalar eps = 0) const {
+    return searchWith(threadScratch(), x, std::numeric_limits<Scalar>::max(),
+                      maxPoints, state_space, ActivePoints(),
+                      Traversal::DepthFirst, eps);
   }
 
   std::vector<DistanceId> searchBall(const point_t &x, Scalar maxRadius) const {
-    return searcher().search(
-        x, maxRadius, std::numeric_limits<std::size_t>::max(), state_space);
+    return searchWith(threadScratch(), x, maxRadius,
+                      std::numeric_limits<std::size_t>::max(), state_space,
+                      ActivePoints());
   }
 
   std::vector<DistanceId>
   searchCapacityLimitedBall(const point_t &x, Scalar maxRadius,
                             std::size_t maxPoints) const {
-    return searcher().search(x, maxRadius, maxPoints, state_space);
+    return searchWith(threadScratch(), x, maxRadius, maxPoints, state_space,
+                      ActivePoints());
   }
 
-  DistanceId search(const point_t &x) const {
-    DistanceId result;
-    result.distance = std::numeric_limits<Scalar>::infinity();
+  // k nearest neighbours among the points whose id satisfies pred(id). The
+  // predicate is tested in the leaf scans, before a point enters the result
+  // queue, so the k results are exact and nothing is over-fetched.
+  template <typename Pred, typename = std::enable_if_t<
+                               std::is_invocable_r_v<bool, Pred, const Id &>>>
+  std::vector<DistanceId> searchKnn(const point_t &x, std::size_t maxPoints,
+                                    const Pred &pred, Scalar eps = 0) const {
+    return searchWith(threadScratch(), x, std::numeric_limits<Scalar>::max(),
+                      maxPoints, state_space, ActivePointsIf<Pred>{pred},
+                      Traversal::DepthFirst, eps);
+  }
 
-    if (m_nodes[0].m_entries > 0) {
-      std::vector<std::size_t> searchStack;
-      searchStack.reserve(
-          1 +
-          std::size_t(1.5 * std::log2(1 + m_nodes[0].m_entries / BucketSize)));
+  // Variants that write to memory owned by the caller, for real-time loops.
+  // They use per-thread scratch space: once a thread has run a query with
+  // as many results, they do not allocate. With Eigen::Dynamic dimensions,
+  // pass a point_t, since other expressions are converted to a temporary.
+
+  // Writes the k nearest neighbours, sorted by distance, to out[0, n) and
+  // returns n <= k. `out` must hold k entries.
+  std::size_t searchKnnInto(const point_t &x, std::size_t k, DistanceId *out,
+                            Scalar eps = 0) const {
+    const auto &results =
+        searchWith(threadScratch(), x, std::numeric_limits<Scalar>::max(), k,
+                   state_space, ActivePoints(), Traversal::DepthFirst, eps);
+    std::copy(results.begin(), results.end(), out);
+    return results.size();
+  }
+
+  // As above, limited to the ball of radius maxRadius.
+  std::size_t searchCapacityLimitedBallInto(const point_t &x,
+                                            Scalar maxRadius,
+                                            std::size_t maxPoints,
+                                            DistanceId *out) const {
+    const auto &results =
+        searchWith(threadScratch(), x, maxRadius, maxPoints, state_space,
+                   ActivePoints());
+    std::copy(results.begin(), results.end(), out);
+    return results.size();
+  }
+
+  // As above, with approximation eps, replacing the content of `out`.
+  void searchCapacityLimitedBallInto(const point_t &x, Scalar maxRadius,
+                                     std::size_t maxPoints,
+                                     std::vector<DistanceId> &out,
+                                     Scalar eps = 0) const {
+    const auto &results =
+        searchWith(threadScratch(), x, maxRadius, maxPoints, state_space,
+                   ActivePoints(), Traversal::DepthFirst, eps);
+    out.assign(results.begin(), results.end());
+  }
+
+  // Replaces the content of `out`, which only allocates if its capacity is
+  // exceeded.
+  void searchBallInto(const point_t &x, Scalar maxRadius,
+                      std::vector<DistanceId> &out) const {
+    const auto &results =
+        searchWith(threadScratch(), x, maxRadius,
+                   std::numeric_limits<std::size_t>::max(), state_space,
+                   ActivePoints());
+    out.assign(results.begin(), results.end());
+  }
+
+  // True if some point lies within maxRadius of x. Stops at the first hit.
+  bool anyWithin(const point_t &x, Scalar maxRadius) const {
+    bool found = false;
+    withinRadius(x, maxRadius, [&](std::size_t) {
+      found = true;
+      return false;
+    });
+    return found;
+  }
+
+  // Number of points within maxRadius of x. Subtrees whose box lies inside
+  // the ball are counted without visiting their points.
+  std::size_t countWithin(const point_t &x, Scalar maxRadius) const {
+    std::size_t count = 0;
+    withinRadius(x, maxRadius, [&](std::size_t n) {
+      count += n;
+      return true;
+    });
+    return count;
+  }
+
+  // Calls fn(id) for every point x with lb <= x <= ub in every coordinate,
+  // whatever the state space. Pass -/+infinity to leave a dimension free.
+  // Subtrees whose box lies inside the query are reported without testing
+  // their points. fn may run other queries on the tree.
+  template <typename Fn>
+  void searchBox(const point_t &lb, const point_t &ub, Fn &&fn) const {
+    if (m_nodes[0].m_entries == 0) {
+      return;
+    }
+    std::vector<std::pair<std::size_t, bool>> searchStack{{0, false}};
+    while (searchStack.size() > 0) {
+      auto [nodeIndex, inside] = searchStack.back();
+      searchStack.pop_back();
+      const Node &node = m_nodes[nodeIndex];
+      if (node.m_entries == 0) {
+        continue;
+      }
+      if (!inside) {
+        auto nodeLb = m_nodes.lb(nodeIndex).array();
+        auto nodeUb = m_nodes.ub(nodeIndex).array();
+        if ((nodeUb < lb.array()).any() || (nodeLb > ub.array()).any()) {
+          continue;
+        }
+        inside = (nodeLb >= lb.array()).all() && (nodeUb <= ub.array()).all();
+      }
+
+      if (node.m_splitDimension == m_dimensions) {
+        const bucket_t &bucket = node.m_locationId;
+        for (std::size_t i = 0; i < bucket.size(); i++) {
+          bool hit = bucket.active(i);
+          for (int d = 0; hit && !inside && d < m_dimensions; d++) {
+            Scalar c = bucket.coord(i, d);
+            hit = c >= lb[d] && c <= ub[d];
+          }
+          if (hit) {
+            fn(bucket.id(i));
+          }
+        }
+      } else {
+        searchStack.emplace_back(node.m_children.first, inside);
+        searchStack.emplace_back(node.m_children.second, inside);
+      }
+    }
+  }
+
+  std::vector<Id> searchBox(const point_t &lb, const point_t &ub) const {
+    std::vector<Id> ids;
+    searchBox(lb, ub, [&](const Id &id) { ids.push_back(id); });
+    return ids;
+  }
+
+  // All k nearest neighbours: the k nearest neighbours in `other` of every
+  // active point of this tree, as (id, neighbours sorted by distance), in
+  // tree order. Each leaf of this tree searches `other` once for all its
+  // points: a node of `other` is pruned when its box-to-box lower bound to
+  // the leaf exceeds the largest k-th distance found so far in the leaf.
+  // This needs a separable state space (see separableBounds); other spaces
+  // fall back to one searchKnn per point. With more than one thread,
+  // subtrees of this tree are searched in parallel.
+  std::vector<std::pair<Id, std::vector<DistanceId>>>
+  allKnn(const tree_t &other, std::size_t k, int num_threads = 1) const {
+    CHECK_PRETTY_DYNOTREE(other.m_dimensions == m_dimensions,
+                          "trees of different dimensions");
+    std::vector<std::size_t> leaves = leafIndices();
+    AllKnnState state{other, k};
+    std::size_t numSlots = leafSlots(leaves, state.first);
+    state.best.resize(numSlots * k);
+    state.counts.assign(numSlots, 0);
+
+    auto run = [&](auto &&join) {
+      if (num_threads > 1) {
+        WorkStealingPool pool(num_threads);
+        state.pool = &pool;
+        state.sums.resize(pool.size());
+        join();
+        pool.wait();
+        state.pool = nullptr;
+      } else {
+        join();
+      }
+    };
+    bool empty = k == 0 || size() == 0 || other.size() == 0;
+    if (!empty && !separableBounds()) {
+      run([&] {
+        for (std::size_t leaf : leaves) {
+          auto task = [this, &state, leaf] {
+            const bucket_t &bucket = m_nodes[leaf].m_locationId;
+            for (std::size_t i = 0; i < bucket.size(); i++) {
+              if (bucket.active(i)) {
+                std::size_t slot = state.first[leaf] + i;
+                auto found = state.other.searchKnn(bucket.point(i), state.k);
+                std::copy(found.begin(), found.end(),
+                          state.best.begin() + slot * state.k);
+                state.counts[slot] = found.size();
+              }
+            }
+          };
+          if (state.pool) {
+            state.pool->submit(task);
+          } else {
+            task();
+          }
+        }
+      });
+    } else if (!empty) {
+      state.bound.assign(m_nodes.size(), std::numeric_limits<Scalar>::max());
+      run([&] { allKnnNodes(0, 0, state); });
+    }
+
+    std::vector<std::pair<Id, std::vector<DistanceId>>> out;
+    out.reserve(size());
+    for (std::size_t leaf : leaves) {
+      const bucket_t &bucket = m_nodes[leaf].m_locationId;
+      for (std::size_t i = 0; i < bucket.size(); i++) {
+        if (bucket.active(i)) {
+          std::size_t slot = state.first[leaf] + i;
+          auto begin = state.best.begin() + slot * k;
+          out.emplace_back(bucket.id(i),
+                           std::vector<DistanceId>(
+                               begin, begin + state.counts[slot]));
+        }
+      }
+    }
+    return out;
+  }
+
+  struct IdPair {
+    Scalar distance;
+    Id first;  /// in this tree
+    Id second; /// in the other tree
+  };
+
+  // Closest pair of active points between this tree and `other`. Both
+  // trees are descended together, and a pair of nodes is pruned when their
+  // box-to-box lower bound exceeds the best distance so far; as in allKnn,
+  // other state spaces fall back to one search per point. The distance is
+  // infinity if a tree is empty.
+  IdPair closestPair(const tree_t &other) const {
+    CHECK_PRETTY_DYNOTREE(other.m_dimensions == m_dimensions,
+                          "trees of different dimensions");
+    IdPair best;
+    best.distance = std::numeric_limits<Scalar>::infinity();
+    if (!separableBounds()) {
+      for (std::size_t leaf : leafIndices()) {
+        const bucket_t &bucket = m_nodes[leaf].m_locationId;
+        for (std::size_t i = 0; i < bucket.size(); i++) {
+          if (bucket.active(i)) {
+            DistanceId nn = other.search(bucket.point(i));
+            if (nn.distance < best.distance) {
+              best = IdPair{nn.distance, bucket.id(i), nn.id};
+            }
+          }
+        }
+      }
+    } else if (size() > 0 && other.size() > 0) {
+      std::vector<Scalar> sums;
+      closestPairNodes(0, other, 0, best, sums);
+    }
+    return best;
+  }
+
+  // Undirected graph on the active points, in CSR form. Vertex v is the
+  // point ids[v] (tree order); its edges go to neighbours[j], at distance
+  // distances[j], for offsets[v] <= j < offsets[v + 1], sorted by distance.
+  // Every edge {u, v} is stored once, in the row of min(u, v).
+  struct Graph {
+    std::vector<Id> ids;
+    std::vector<std::size_t> offsets; /// ids.size() + 1 entries
+    std::vector<Id> neighbours;
+    std::vector<Scalar> distances;
+  };
+
+  // Roadmap joining every two active points closer than maxRadius, e.g. for
+  // PRM. The tree is joined with itself, so every pair of points is
+  // considered once: the points of a leaf among themselves, then the two
+  // subtrees of every inner node against each other, skipping pairs of
+  // nodes farther apart than maxRadius (separable spaces). With more than
+  // one thread, subtrees are joined in parallel.
+  Graph buildRadiusGraph(Scalar maxRadius, int num_threads = 1) const {
+    GraphState state;
+    std::vector<std::size_t> leaves = leafIndices();
+    state.vertex.resize(leafSlots(leaves, state.first));
+    for (std::size_t leaf : leaves) {
+      const bucket_t &bucket = m_nodes[leaf].m_locationId;
+      for (std::size_t i = 0; i < bucket.size(); i++) {
+        if (bucket.active(i)) {
+          state.vertex[state.first[leaf] + i] = state.ids.size();
+          state.ids.push_back(bucket.id(i));
+        }
+      }
+    }
+
+    if (size() > 0 && num_threads > 1) {
+      WorkStealingPool pool(num_threads);
+      state.pool = &pool;
+      state.workers.resize(pool.size());
+      selfJoin(0, maxRadius, state);
+      pool.wait();
+      state.pool = nullptr;
+    } else if (size() > 0) {
+      selfJoin(0, maxRadius, state);
+    }
+    return toGraph(state);
+  }
+
+  // Roadmap joining every active point to its k nearest neighbours (an edge
+  // if either end is among the k nearest of the other), from an allKnn of
+  // the tree with itself. Ids must be unique.
+  Graph buildKnnGraph(std::size_t k, int num_threads = 1) const {
+    GraphState state;
+    auto knn = allKnn(*this, k + 1, num_threads);
+    std::unordered_map<Id, std::size_t> vertices;
+    vertices.reserve(knn.size());
+    for (const auto &[id, neighbours] : knn) {
+      vertices.emplace(id, state.ids.size());
+      state.ids.push_back(id);
+    }
+    std::vector<GraphEdge> &edges = state.workers[0].edges;
+    for (std::size_t v = 0; v < knn.size(); v++) {
+      std::size_t count = 0;
+      for (const DistanceId &dp : knn[v].second) {
+        if (count == k) {
+          break;
+        } else if (dp.id == state.ids[v]) {
+          continue;
+        }
+        std::size_t u = vertices.at(dp.id);
+        edges.push_back(GraphEdge{std::min(u, v), std::max(u, v), dp.distance});
+        count++;
+      }
+    }
+    return toGraph(state, true);
+  }
+
+  // Id of the empty slots of searchKnnBatch: -1 for arithmetic ids, Id{}
+  // otherwise.
+  static Id noId() {
+    if constexpr (std::is_arithmetic_v<Id>) {
+      return Id(-1);
+    } else {
+      return Id{};
+    }
+  }
+
+  // Batched k nearest neighbours, one query per column of `queries`. The
+  // neighbours of query i are written, sorted by distance, to
+  // ids_out[i * k + j] and dists_out[i * k + j]; slots without a neighbour
+  // (the tree holds fewer than k points) get noId() and distance infinity.
+  // Both arrays are owned by the caller and must hold queries.cols() * k
+  // entries. If `reorder` is set, queries are processed in tree order, so
+  // that consecutive queries touch the same nodes.
+  void searchKnnBatch(const Eigen::Ref<const points_t> &queries, std::size_t k,
+                      Id *ids_out, Scalar *dists_out, int num_threads = 1,
+                      bool reorder = false) const {
+    CHECK_PRETTY_DYNOTREE(queries.rows() == m_dimensions,
+                          "wrong query dimension");
+    runBatch(queries, num_threads, reorder,
+             [&](Searcher &searcher, const point_t &x, std::size_t q,
+                 std::size_t) {
+               const auto &results = searcher.search(
+                   x, std::numeric_limits<Scalar>::max(), k, state_space);
+               for (std::size_t j = 0; j < k; j++) {
+                 if (j < results.size()) {
+                   ids_out[q * k + j] = results[j].id;
+                   dists_out[q * k + j] = results[j].distance;
+                 } else {
+                   ids_out[q * k + j] = noId();
+                   dists_out[q * k + j] =
+                       std::numeric_limits<Scalar>::infinity();
+                 }
+               }
+             });
+  }
+
+  // Batched radius search, one query per column of `queries`. Results use a
+  // CSR layout: the neighbours of query i, sorted by distance, are
+  // ids_out[offsets[i]] ... ids_out[offsets[i + 1] - 1] (same for dists_out).
+  // The output vectors are resized as needed.
+  void searchBallBatch(const Eigen::Ref<const points_t> &queries,
+                       Scalar maxRadius, std::vector<std::size_t> &offsets,
+                       std::vector<Id> &ids_out, std::vector<Scalar> &dists_out,
+                       int num_threads = 1, bool reorder = false) const {
+    CHECK_PRETTY_DYNOTREE(queries.rows() == m_dimensions,
+                          "wrong query dimension");
+    std::size_t numQueries = queries.cols();
+    std::vector<std::size_t> counts(numQueries);
+    std::vector<std::vector<DistanceId>> chunks(
+        (numQueries + batchChunk - 1) / batchChunk);
+
+    std::vector<std::size_t> order = runBatch(
+        queries, num_threads, reorder,
+        [&](Searcher &searcher, const point_t &x, std::size_t q,
+            std::size_t chunk) {
+          const auto &results = searcher.search(
+              x, maxRadius, std::numeric_limits<std::size_t>::max(),
+              state_space);
+          counts[q] = results.size();
+          chunks[chunk].insert(chunks[chunk].end(), results.begin(),
+                               results.end());
+        });
+
+    offsets.resize(numQueries + 1);
+    offsets[0] = 0;
+    for (std::size_t q = 0; q < numQueries; q++) {
+      offsets[q + 1] = offsets[q] + counts[q];
+    }
+    ids_out.resize(offsets.back());
+    dists_out.resize(offsets.back());
+
+    for (std::size_t c = 0; c < chunks.size(); c++) {
+      std::size_t next = 0;
+      std::size_t end = std::min((c + 1) * batchChunk, numQueries);
+      for (std::size_t i = c * batchChunk; i < end; i++) {
+        std::size_t q = order[i];
+        for (std::size_t j = offsets[q]; j < offsets[q + 1]; j++, next++) {
+          ids_out[j] = chunks[c][next].id;
+          dists_out[j] = chunks[c][next].distance;
+        }
+      }
+    }
+  }
+
+  // Prunes searches with incremental lower bounds, in the style of Arya and
+  // Mount: the cell of a node is the root box cut by the split planes above
+  // it, so the bound of a child follows from its parent's by updating the
+  // split dimension only, instead of measuring the distance to the box of
+  // every node over all dimensions. Leaves are still tested against their
+  // box before being scanned. Needs a separable state space: Rn, RnSquared,
+  // RnL1, SO2, SO2Squared, or a Combined space made of them.
+  void setIncrementalBounds(bool incremental = true) {
+    CHECK_PRETTY_DYNOTREE(!incremental || separableStateSpace(),
+                          "incremental bounds need a separable space");
+    m_incrementalBounds = incremental;
+  }
+
+  bool incrementalBounds() const { return m_incrementalBounds; }
+
+  // True if the state space allows setIncrementalBounds(true).
+  bool separableStateSpace() const {
+    if constexpr (!has_separable_bound<StateSpace, Scalar>::value) {
+      return false;
+    } else if constexpr (std::is_same_v<StateSpace, Combined<Scalar>>) {
+      return state_space.separable();
+    } else {
+      return true;
+    }
+  }
+
+  // Result of searchKnnFixed<K>: the K best candidates in an inline array, kept
+  // sorted by insertion. Unused slots hold distance infinity, so the
+  // pruning bound is always the last slot.
+  template <std::size_t K> class KnnArray {
+  public:
+    KnnArray() {
+      for (DistanceId &item : m_items) {
+        item.distance = std::numeric_limits<Scalar>::infinity();
+      }
+    }
+
+    std::size_t size() const { return m_size; }
+    const DistanceId &operator[](std::size_t i) const { return m_items[i]; }
+    const DistanceId *begin() const { return m_items.data(); }
+    const DistanceId *end() const { return m_items.data() + m_size; }
+
+    // Distance a candidate must beat to enter the set.
+    Scalar bound() const { return m_items[K - 1].distance; }
+
+    // Needs distance < bound().
+    void insert(Scalar distance, const Id &id) {
+      std::size_t i = K - 1;
+      for (; i > 0 && m_items[i - 1].distance > distance; i--) {
+        m_items[i] = m_items[i - 1];
+      }
+      m_items[i] = DistanceId{distance, id};
+      m_size += m_size < K;
+    }
+
+  private:
+    std::array<DistanceId, K> m_items;
+    std::size_t m_size = 0;
+  };
+
+  // k nearest neighbours for k known at compile time. Same results as
+  // searchKnn(x, K, eps), without the priority queue or any allocation
+  // after warm-up; meant for small K.
+  template <std::size_t K>
+  KnnArray<K> searchKnnFixed(const point_t &x, Scalar eps = 0) const {
+    static_assert(K > 0, "K must be positive");
+    KnnArray<K> result;
+    Scalar slack = 1 + eps;
+    auto scanLeaf = [&](const Node &node) {
+      const bucket_t &bucket = node.m_locationId;
+      bucket.scan(
+          x, state_space, [&] { return result.bound(); },
+          [&](std::size_t i, Scalar nodeDist) {
+            // Allow to have inactive nodes in the tree
+            if (bucket.active(i) && nodeDist < result.bound()) {
+              result.insert(nodeDist, bucket.id(i));
+            }
+          });
+    };
+
+    SearchScratch &scratch = threadScratch();
+    if (m_incrementalBounds && m_nodes[0].m_entries > 0) {
+      searchIncremental(
+          x, scratch.incremental, [&] { return result.bound() / slack; },
+          scanLeaf, state_space);
+    } else if (m_nodes[0].m_entries > 0) {
+      std::vector<std::size_t> &searchStack = scratch.searchStack;
+      searchStack.clear();
       searchStack.push_back(0);
 
       while (searchStack.size() > 0) {
         std::size_t nodeIndex = searchStack.back();
         searchStack.pop_back();
         const Node &node = m_nodes[nodeIndex];
-        if (result.distance > node.distance_to_rectangle(x, state_space)) {
+        if (result.bound() > slack * distanceToNode(x, nodeIndex)) {
           if (node.m_splitDimension == m_dimensions) {
-            for (const auto &lp : node.m_locationId) {
-              // Allow to have inactive nodes in the tree
-              if (!lp.active)
-                continue;
-              Scalar nodeDist = state_space.distance(x, lp.x);
-              if (nodeDist < result.distance) {
-                result = DistanceId{nodeDist, lp.id};
-              }
-            }
+            scanLeaf(node);
           } else {
             node.queueChildren(x, searchStack);
           }
@@ -155,6 +1086,14 @@ public:
     return result;
   }
 
+  // Nearest neighbour. With eps > 0 the search is approximate: nodes are
+  // pruned once (1 + eps) times their distance reaches the best distance
+  // found, so the result is within a factor (1 + eps) of the exact one.
+  // The distance is infinity if the tree is empty.
+  DistanceId search(const point_t &x, Scalar eps = 0) const {
+    return searchKnnFixed<1>(x, eps)[0];
+  }
+
   void set_inactive(const point_t &x) {
     DistanceId result;
     result.distance = std::numeric_limits<Scalar>::infinity();
@@ -171,18 +1110,20 @@ public:
         std::size_t nodeIndex = searchStack.back();
         searchStack.pop_back();
         Node &node = m_nodes[nodeIndex];
-        if (result.distance > node.distance_to_rectangle(x, state_space)) {
+        if (result.distance > distanceToNode(x, nodeIndex)) {
           if (node.m_splitDimension == m_dimensions) {
-            for (auto &lp : node.m_locationId) {
+            bucket_t &bucket = node.m_locationId;
+            for (std::size_t i = 0; i < bucket.size(); i++) {
               // Allow to have inactive nodes in the tree
-              if (!lp.active)
+              if (!bucket.active(i))
                 continue;
-              Scalar nodeDist = state_space.distance(x, lp.x);
+              Scalar nodeDist = state_space.distance(x, bucket.point(i));
               if (nodeDist < result.distance) {
-                result = DistanceId{nodeDist, lp.id};
+                result = DistanceId{nodeDist, bucket.id(i)};
                 if (result.distance < 1e-8) {
                   found = true;
-                  lp.active = false;
+                  bucket.setActive(i, false);
+                  m_numInactive++;
                   break;
                 }
               }
@@ -197,46 +1138,141 @@ public:
     // return result;
   }
 
+private:
+  // Traversal state of searchIncremental(), reused between queries: the
+  // interval of the current cell, and its bound term, in every dimension.
+  // Entering a node changes one interval; the undo log restores the cell of
+  // the parent before a sibling is visited.
+  struct IncrementalState {
+    struct Frame {
+      std::size_t node;
+      std::size_t undo; /// log size of the parent cell
+      int dim;          /// interval that changes, -1 for none
+      Scalar lo, hi;
+    };
+    struct Undo {
+      int dim;
+      Scalar lo, hi, term, sum;
+    };
+    std::vector<Scalar> lo, hi, term, sums;
+    std::vector<Frame> stack;
+    std::vector<Undo> log;
+  };
+
+  // Pending node of a best-first search, ordered as a min-heap by bound.
+  struct NodeDistance {
+    Scalar distance;
+    std::size_t node;
+    inline bool operator<(const NodeDistance &other) const {
+      return distance > other.distance;
+    }
+  };
+
+  // Working memory of a search. It only grows, so once it has served a
+  // query of a given size, later queries up to that size do not allocate.
+  struct SearchScratch {
+    std::vector<std::size_t> searchStack;
+    CandidateQueue<DistanceId> prioqueue;
+    std::size_t prioqueueCapacity = 0;
+    std::vector<DistanceId> results;
+    IncrementalState incremental;
+    std::vector<NodeDistance> nodeQueue;
+    std::vector<Scalar> sums; /// per group, see maxDistanceToNode()
+  };
+
+  // Scratch of the queries that do not take a Searcher. Shared by all the
+  // trees of this type used by a thread.
+  static SearchScratch &threadScratch() {
+    static thread_local SearchScratch scratch;
+    return scratch;
+  }
+
+  // Runs a search with the scratch space of a Searcher, or of the thread.
+  // Only the points accepted by accept(bucket, i) are returned.
+  template <typename Accept>
+  const std::vector<DistanceId> &
+  searchWith(SearchScratch &scratch, const point_t &x, Scalar maxRadius,
+             std::size_t maxPoints, const StateSpace &state_space,
+             const Accept &accept, Traversal traversal = Traversal::DepthFirst,
+             Scalar eps = 0, std::size_t *visited = nullptr) const {
+    // clear results from last time, and the stack left by an early exit
+    scratch.results.clear();
+    scratch.searchStack.clear();
+    std::size_t visitedNodes = 0;
+
+    // reserve capacities
+    scratch.searchStack.reserve(
+        1 + std::size_t(1.5 * std::log2(1 + m_nodes[0].m_entries /
+                                                BucketSize)));
+    if (scratch.prioqueueCapacity < maxPoints &&
+        maxPoints < m_nodes[0].m_entries) {
+      std::vector<DistanceId> container;
+      container.reserve(maxPoints);
+      scratch.prioqueue = CandidateQueue<DistanceId>(std::less<DistanceId>(),
+                                                      std::move(container));
+      scratch.prioqueueCapacity = maxPoints;
+    }
+
+    if (traversal == Traversal::BestFirst) {
+      searchBestFirst(x, maxRadius, maxPoints, scratch.nodeQueue,
+                      scratch.prioqueue, scratch.results, state_space, accept,
+                      visitedNodes, eps);
+    } else {
+      searchCapacityLimitedBall(x, maxRadius, maxPoints, scratch.searchStack,
+                                scratch.prioqueue, scratch.results,
+                                state_space, accept, &scratch.incremental,
+                                &visitedNodes, eps);
+    }
+
+    if (visited) {
+      *visited = visitedNodes;
+    }
+    scratch.prioqueueCapacity =
+        std::max(scratch.prioqueueCapacity, scratch.results.size());
+    return scratch.results;
+  }
+
+public:
   class Searcher {
   public:
     Searcher(const tree_t &tree) : m_tree(tree) {}
-    Searcher(const Searcher &searcher) : m_tree(searcher.m_tree) {}
+    Searcher(const Searcher &searcher)
+        : m_tree(searcher.m_tree), m_traversal(searcher.m_traversal) {}
+
+    // Traversal used by search() when none is given. Incremental bounds
+    // (see KDTree::setIncrementalBounds) only apply to depth-first search.
+    void setTraversal(Traversal traversal) { m_traversal = traversal; }
+    Traversal traversal() const { return m_traversal; }
+
+    // Nodes that passed the pruning test during the last search.
+    std::size_t visitedNodes() const { return m_visited; }
 
     // NB! this method is not const. Do not call this on same instance from
     // different threads simultaneously.
+    // `eps` > 0 gives approximate results, see KDTree::searchKnn. Points
+    // are never returned beyond maxRadius.
     const std::vector<DistanceId> &search(const point_t &x, Scalar maxRadius,
                                           std::size_t maxPoints,
-                                          const StateSpace &state_space) {
-      // clear results from last time
-      m_results.clear();
+                                          const StateSpace &state_space,
+                                          Scalar eps = 0) {
+      return search(x, maxRadius, maxPoints, state_space, m_traversal, eps);
+    }
 
-      // reserve capacities
-      m_searchStack.reserve(
-          1 + std::size_t(1.5 * std::log2(1 + m_tree.m_nodes[0].m_entries /
-                                                  BucketSize)));
-      if (m_prioqueueCapacity < maxPoints &&
-          maxPoints < m_tree.m_nodes[0].m_entries) {
-        std::vector<DistanceId> container;
-        container.reserve(maxPoints);
-        m_prioqueue = std::priority_queue<DistanceId, std::vector<DistanceId>>(
-            std::less<DistanceId>(), std::move(container));
-        m_prioqueueCapacity = maxPoints;
-      }
-
-      m_tree.searchCapacityLimitedBall(x, maxRadius, maxPoints, m_searchStack,
-                                       m_prioqueue, m_results, state_space);
-
-      m_prioqueueCapacity = std::max(m_prioqueueCapacity, m_results.size());
-      return m_results;
+    const std::vector<DistanceId> &search(const point_t &x, Scalar maxRadius,
+                                          std::size_t maxPoints,
+                                          const StateSpace &state_space,
+                                          Traversal traversal,
+                                          Scalar eps = 0) {
+      return m_tree.searchWith(m_scratch, x, maxRadius, maxPoints,
+                               state_space, ActivePoints(), traversal, eps,
+                               &m_visited);
     }
 
   private:
     const tree_t &m_tree;
-
-    std::vector<std::size_t> m_searchStack;
-    std::priority_queue<DistanceId, std::vector<DistanceId>> m_prioqueue;
-    std::size_t m_prioqueueCapacity = 0;
-    std::vector<DistanceId> m_results;
+    SearchScratch m_scratch;
+    Traversal m_traversal = Traversal::DepthFirst;
+    std::size_t m_visited = 0;
   };
 
   // NB! returned class has no const methods. Get one instance per thread!
@@ -247,40 +1283,299 @@ private:
     point_t x;
     Id id;
     bool active = true;
+
+    template <typename Archive> void serialize(Archive &ar) {
+      ar(x, id, active);
+    }
+  };
+
+  static constexpr std::uint64_t fileMagic = 0x45455254'4f4e5944; // DYNOTREE
+  static constexpr std::uint32_t fileVersion = 1;
+
+  // Template parameters that fix the layout of the file.
+  static std::vector<std::int64_t> fileTag() {
+    return {sizeof(Scalar), sizeof(Id), Dimensions, BucketSize,
+            std::int64_t(Layout)};
+  }
+
+  // Throws unless the arrays read by load() form a well-formed tree, so that
+  // a corrupt file fails here rather than in the first query: the state
+  // space fits the dimension, the sizes of the node, box and bucket arrays
+  // agree, every child, free or waiting index is in range, the nodes
+  // reachable from the root form a tree whose counts add up, the inactive
+  // points match m_numInactive, and the options are valid for the setters.
+  void checkLoaded() const {
+    CHECK_PRETTY_DYNOTREE(
+        m_dimensions > 0 &&
+            (Dimensions == Eigen::Dynamic || m_dimensions == Dimensions) &&
+            m_nodes.dimensions() == m_dimensions,
+        "corrupt file: wrong dimension");
+    CHECK_PRETTY_DYNOTREE(state_space_consistent(state_space, m_dimensions),
+                          "corrupt file: bad state space");
+    CHECK_PRETTY_DYNOTREE(m_nodes.size() > 0 && m_nodes.consistent(),
+                          "corrupt file: bad node array");
+    for (std::size_t index : waitingForSplit) {
+      CHECK_PRETTY_DYNOTREE(index < m_nodes.size(),
+                            "corrupt file: bad waiting node");
+    }
+    for (std::size_t i = 0; i < m_nodes.size(); i++) {
+      CHECK_PRETTY_DYNOTREE(m_nodes[i].m_locationId.consistent(m_dimensions),
+                            "corrupt file: bad bucket");
+    }
+
+    // free slots are marked as seen, so that no tree node can use them
+    std::vector<bool> seen(m_nodes.size());
+    for (std::size_t i : m_nodes.freeSlots()) {
+      CHECK_PRETTY_DYNOTREE(!seen[i], "corrupt file: bad free list");
+      seen[i] = true;
+    }
+    CHECK_PRETTY_DYNOTREE(!seen[0], "corrupt file: free root");
+    seen[0] = true;
+    std::size_t inactive = 0;
+    std::vector<std::size_t> stack{0};
+    while (!stack.empty()) {
+      const Node &node = m_nodes[stack.back()];
+      stack.pop_back();
+      if (node.m_splitDimension == m_dimensions) {
+        const bucket_t &bucket = node.m_locationId;
+        CHECK_PRETTY_DYNOTREE(bucket.size() == node.m_entries,
+                              "corrupt file: bad leaf count");
+        for (std::size_t i = 0; i < bucket.size(); i++) {
+          inactive += !bucket.active(i);
+        }
+        continue;
+      }
+      auto [first, second] = node.m_children;
+      CHECK_PRETTY_DYNOTREE(node.m_splitDimension >= 0 &&
+                                node.m_splitDimension < m_dimensions &&
+                                first < m_nodes.size() &&
+                                second < m_nodes.size() && first != second &&
+                                !seen[first] && !seen[second],
+                            "corrupt file: bad internal node");
+      CHECK_PRETTY_DYNOTREE(m_nodes[first].m_entries +
+                                    m_nodes[second].m_entries ==
+                                node.m_entries,
+                            "corrupt file: bad node count");
+      seen[first] = true;
+      seen[second] = true;
+      stack.push_back(first);
+      stack.push_back(second);
+    }
+    CHECK_PRETTY_DYNOTREE(inactive == m_numInactive,
+                          "corrupt file: bad inactive count");
+    CHECK_PRETTY_DYNOTREE(m_balance == 0 ||
+                              (m_balance > 0.5 && m_balance < 1),
+                          "corrupt file: bad balance factor");
+    CHECK_PRETTY_DYNOTREE(!m_incrementalBounds || separableStateSpace(),
+                          "corrupt file: incremental bounds on a "
+                          "non-separable space");
+  }
+  using bucket_t =
+      typename leaf_bucket<Layout, PointId, Scalar, Dimensions>::type;
+
+  // Point filters of the leaf scans: the active points, optionally only
+  // those whose id satisfies a predicate.
+  struct ActivePoints {
+    bool operator()(const bucket_t &bucket, std::size_t i) const {
+      return bucket.active(i);
+    }
+  };
+
+  template <typename Pred> struct ActivePointsIf {
+    const Pred &pred;
+    bool operator()(const bucket_t &bucket, std::size_t i) const {
+      return bucket.active(i) && pred(bucket.id(i));
+    }
   };
-  std::vector<PointId> m_bucketRecycle;
+  bucket_t m_bucketRecycle;
+  bool m_incrementalBounds = false;
+  std::size_t m_numInactive = 0; /// points hidden by set_inactive
 
+  template <typename Accept>
   void searchCapacityLimitedBall(
       const point_t &x, Scalar maxRadius, std::size_t maxPoints,
       std::vector<std::size_t> &searchStack,
-      std::priority_queue<DistanceId, std::vector<DistanceId>> &prioqueue,
-      std::vector<DistanceId> &results, const StateSpace &state_space) const {
+      CandidateQueue<DistanceId> &prioqueue,
+      std::vector<DistanceId> &results, const StateSpace &state_space,
+      const Accept &accept, IncrementalState *incremental,
+      std::size_t *visited = nullptr, Scalar eps = 0) const {
     std::size_t numSearchPoints = std::min(maxPoints, m_nodes[0].m_entries);
+    std::size_t visitedNodes = 0;
+    Scalar slack = 1 + eps;
 
-    if (numSearchPoints > 0) {
+    if (numSearchPoints > 0 && m_incrementalBounds) {
+      searchIncremental(
+          x, *incremental,
+          [&] {
+            return prioqueue.size() < numSearchPoints
+                       ? maxRadius
+                       : std::min(maxRadius, prioqueue.top().distance / slack);
+          },
+          [&](const Node &node) {
+            node.searchCapacityLimitedBall(x, maxRadius, numSearchPoints,
+                                           prioqueue, state_space, accept);
+          },
+          state_space, &visitedNodes);
+    } else if (numSearchPoints > 0) {
       searchStack.push_back(0);
       while (searchStack.size() > 0) {
         std::size_t nodeIndex = searchStack.back();
         searchStack.pop_back();
         const Node &node = m_nodes[nodeIndex];
-        Scalar minDist = node.distance_to_rectangle(x, state_space);
-        if (maxRadius > minDist && (prioqueue.size() < numSearchPoints ||
-                                    prioqueue.top().distance > minDist)) {
+        Scalar minDist = distanceToNode(x, nodeIndex);
+        if (maxRadius > minDist &&
+            (prioqueue.size() < numSearchPoints ||
+             prioqueue.top().distance > slack * minDist)) {
+          visitedNodes++;
           if (node.m_splitDimension == m_dimensions) {
             node.searchCapacityLimitedBall(x, maxRadius, numSearchPoints,
-                                           prioqueue, state_space);
+                                           prioqueue, state_space, accept);
           } else {
             node.queueChildren(x, searchStack);
           }
         }
       }
+    }
+
+    if (visited) {
+      *visited = visitedNodes;
+    }
+    drainCandidates(prioqueue, results);
+  }
+
+  // As searchCapacityLimitedBall, but nodes are visited in increasing order
+  // of the distance to their box, so the k-th best distance tightens as
+  // early as possible. Stops at the first pending node beyond the bound.
+  template <typename Accept>
+  void searchBestFirst(
+      const point_t &x, Scalar maxRadius, std::size_t maxPoints,
+      std::vector<NodeDistance> &queue,
+      CandidateQueue<DistanceId> &prioqueue,
+      std::vector<DistanceId> &results, const StateSpace &state_space,
+      const Accept &accept, std::size_t &visited, Scalar eps) const {
+    std::size_t numSearchPoints = std::min(maxPoints, m_nodes[0].m_entries);
+    Scalar slack = 1 + eps;
+    auto limit = [&] {
+      return prioqueue.size() < numSearchPoints
+                 ? maxRadius
+                 : std::min(maxRadius, prioqueue.top().distance / slack);
+    };
+    auto push = [&](std::size_t index) {
+      Scalar minDist = distanceToNode(x, index);
+      if (minDist < limit()) {
+        queue.push_back(NodeDistance{minDist, index});
+        std::push_heap(queue.begin(), queue.end());
+      }
+    };
+
+    queue.clear();
+    if (numSearchPoints > 0) {
+      push(0);
+    }
+    while (queue.size() > 0) {
+      NodeDistance next = queue.front();
+      if (!(next.distance < limit())) {
+        break;
+      }
+      std::pop_heap(queue.begin(), queue.end());
+      queue.pop_back();
+      visited++;
+      const Node &node = m_nodes[next.node];
+      if (node.m_splitDimension == m_dimensions) {
+        node.searchCapacityLimitedBall(x, maxRadius, numSearchPoints,
+                                       prioqueue, state_space, accept);
+      } else {
+        push(node.m_children.first);
+        push(node.m_children.second);
+      }
+    }
+
+    drainCandidates(prioqueue, results);
+  }
+
+  // Depth-first search that prunes with the incremental bounds described in
+  // setIncrementalBounds(). Calls leaf(node) for every leaf whose bound is
+  // below limit().
+  template <typename Limit, typename Leaf>
+  void searchIncremental(const point_t &x, IncrementalState &s, Limit &&limit,
+                         Leaf &&leaf, const StateSpace &state_space,
+                         std::size_t *visited = nullptr) const {
+    if constexpr (has_separable_bound<StateSpace, Scalar>::value) {
+      using Frame = typename IncrementalState::Frame;
+      using Undo = typename IncrementalState::Undo;
+      s.lo.resize(m_dimensions);
+      s.hi.resize(m_dimensions);
+      s.term.resize(m_dimensions);
+      s.sums.assign(state_space.rectangle_groups(), Scalar(0));
+      s.stack.clear();
+      s.log.clear();
+
+      // the cell of the root is its box
+      auto lb = m_nodes.lb(0);
+      auto ub = m_nodes.ub(0);
+      for (int d = 0; d < m_dimensions; d++) {
+        s.lo[d] = lb[d];
+        s.hi[d] = ub[d];
+        s.term[d] = state_space.rectangle_term(d, x[d], lb[d], ub[d]);
+        s.sums[state_space.rectangle_group(d)] += s.term[d];
+      }
+
+      s.stack.push_back(Frame{0, 0, -1, 0, 0});
+      while (s.stack.size() > 0) {
+        Frame frame = s.stack.back();
+        s.stack.pop_back();
+        while (s.log.size() > frame.undo) {
+          const Undo &undo = s.log.back();
+          s.lo[undo.dim] = undo.lo;
+          s.hi[undo.dim] = undo.hi;
+          s.term[undo.dim] = undo.term;
+          s.sums[state_space.rectangle_group(undo.dim)] = undo.sum;
+          s.log.pop_back();
+        }
+        if (frame.dim >= 0) {
+          int d = frame.dim;
+          Scalar &sum = s.sums[state_space.rectangle_group(d)];
+          s.log.push_back(Undo{d, s.lo[d], s.hi[d], s.term[d], sum});
+          s.lo[d] = frame.lo;
+          s.hi[d] = frame.hi;
+          Scalar term = state_space.rectangle_term(d, x[d], frame.lo, frame.hi);
+          sum += term - s.term[d];
+          s.term[d] = term;
+        }
+
+        if (!(state_space.rectangle_bound(s.sums.data()) < limit())) {
+          continue;
+        }
+        const Node &node = m_nodes[frame.node];
+        if (node.m_splitDimension == m_dimensions) {
+          if (distanceToNode(x, frame.node) < limit()) {
+            if (visited) {
+              (*visited)++;
+            }
+            leaf(node);
+          }
+          continue;
+        }
+        if (visited) {
+          (*visited)++;
+        }
 
-      results.reserve(prioqueue.size());
-      while (prioqueue.size() > 0) {
-        results.push_back(prioqueue.top());
-        prioqueue.pop();
+        int d = node.m_splitDimension;
+        Scalar value = node.m_splitValue;
+        std::size_t undo = s.log.size();
+        Frame left{node.m_children.first, undo, d, s.lo[d],
+                   std::min(s.hi[d], value)};
+        Frame right{node.m_children.second, undo, d, std::max(s.lo[d], value),
+                    s.hi[d]};
+        // the child on the side of x is popped first
+        if (x[d] < value) {
+          s.stack.push_back(right);
+          s.stack.push_back(left);
+        } else {
+          s.stack.push_back(left);
+          s.stack.push_back(right);
+        }
       }
-      std::reverse(results.begin(), results.end());
     }
   }
 
@@ -291,7 +1586,7 @@ private:
     Node &splitNode = m_nodes[index];
     splitNode.m_splitDimension = m_dimensions;
     Scalar width(0);
-    state_space.choose_split_dimension(splitNode.m_lb, splitNode.m_ub,
+    state_space.choose_split_dimension(m_nodes.lb(index), m_nodes.ub(index),
                                        splitNode.m_splitDimension, width);
 
     if (splitNode.m_splitDimension == m_dimensions) {
@@ -300,8 +1595,9 @@ private:
 
     std::vector<Scalar> splitDimVals;
     splitDimVals.reserve(splitNode.m_entries);
-    for (const auto &lp : splitNode.m_locationId) {
-      splitDimVals.push_back(lp.x[splitNode.m_splitDimension]);
+    for (std::size_t i = 0; i < splitNode.m_locationId.size(); i++) {
+      splitDimVals.push_back(
+          splitNode.m_locationId.coord(i, splitNode.m_splitDimension));
     }
     std::nth_element(splitDimVals.begin(),
                      splitDimVals.begin() + splitDimVals.size() / 2 + 1,
@@ -313,19 +1609,21 @@ private:
                               splitDimVals[splitDimVals.size() / 2 + 1]) /
                              Scalar(2);
 
-    splitNode.m_children = std::make_pair(m_nodes.size(), m_nodes.size() + 1);
     std::size_t entries = splitNode.m_entries;
-    m_nodes.emplace_back(m_bucketRecycle, entries, m_dimensions);
-    Node &leftNode = m_nodes.back();
-    m_nodes.emplace_back(entries, m_dimensions);
-    Node &rightNode = m_nodes.back();
-
-    for (const auto &lp : splitNode.m_locationId) {
-      if (lp.x[splitNode.m_splitDimension] < splitNode.m_splitValue) {
-        leftNode.add(lp);
-      } else {
-        rightNode.add(lp);
-      }
+    std::size_t left = m_nodes.allocate(m_bucketRecycle, entries, m_dimensions);
+    std::size_t right = m_nodes.allocate(entries, m_dimensions);
+    splitNode.m_children = std::make_pair(left, right);
+    Node &leftNode = m_nodes[left];
+    Node &rightNode = m_nodes[right];
+
+    const bucket_t &bucket = splitNode.m_locationId;
+    for (std::size_t i = 0; i < bucket.size(); i++) {
+      std::size_t child =
+          bucket.coord(i, splitNode.m_splitDimension) < splitNode.m_splitValue
+              ? left
+              : right;
+      m_nodes.expandBounds(child, bucket.point(i));
+      m_nodes[child].m_locationId.append(bucket, i);
     }
 
     if (leftNode.m_entries ==
@@ -334,11 +1632,17 @@ private:
       splitNode.m_splitValue = 0;
       splitNode.m_splitDimension = m_dimensions;
       splitNode.m_children = std::pair<std::size_t, std::size_t>(0, 0);
+      // the right node got a copy of every point: empty it before recycling
+      rightNode.m_locationId.clear();
       std::swap(rightNode.m_locationId, m_bucketRecycle);
-      m_nodes.pop_back();
-      m_nodes.pop_back();
+      m_nodes.release(right);
+      m_nodes.release(left);
       return false;
     } else {
+      if (m_indexed) {
+        indexLeaf(left);
+        indexLeaf(right);
+      }
       splitNode.m_locationId.clear();
       // if it was a standard sized bucket, recycle the memory to reduce
       // allocator pressure otherwise clear the memory used by the bucket
@@ -346,19 +1650,262 @@ private:
       if (splitNode.m_locationId.capacity() == BucketSize) {
         std::swap(splitNode.m_locationId, m_bucketRecycle);
       } else {
-        std::vector<PointId> empty;
+        bucket_t empty;
         std::swap(splitNode.m_locationId, empty);
       }
       return true;
     }
   }
 
+  // Queries of a batch are handed to the threads in chunks of this size.
+  static constexpr std::size_t batchChunk = 64;
+
+  // Order in which the queries of a batch are processed: either as given,
+  // or sorted by the root-to-leaf path that each query follows, which
+  // places queries landing in nearby leaves next to each other.
+  std::vector<std::size_t> queryOrder(const Eigen::Ref<const points_t> &queries,
+                                      bool reorder) const {
+    std::vector<std::size_t> order(queries.cols());
+    for (std::size_t q = 0; q < order.size(); q++) {
+      order[q] = q;
+    }
+    if (!reorder) {
+      return order;
+    }
+
+    std::vector<std::uint64_t> paths(order.size(), 0);
+    for (std::size_t q = 0; q < order.size(); q++) {
+      std::size_t index = 0;
+      for (int depth = 0; depth < 64 && m_nodes[index].m_splitDimension !=
+                                            m_dimensions;
+           depth++) {
+        const Node &node = m_nodes[index];
+        if (queries(node.m_splitDimension, q) < node.m_splitValue) {
+          index = node.m_children.first;
+        } else {
+          paths[q] |= std::uint64_t(1) << (63 - depth);
+          index = node.m_children.second;
+        }
+      }
+    }
+    std::stable_sort(order.begin(), order.end(),
+                     [&](std::size_t a, std::size_t b) {
+                       return paths[a] < paths[b];
+                     });
+    return order;
+  }
+
+  // Calls fn(searcher, x, q, chunk) for every query q (column x of
+  // `queries`), spreading chunks of queries over num_threads threads with
+  // one Searcher per thread. Returns the processing order of the queries:
+  // chunk c holds order[c * batchChunk] ... order[(c + 1) * batchChunk - 1].
+  template <typename Fn>
+  std::vector<std::size_t> runBatch(const Eigen::Ref<const points_t> &queries,
+                                    int num_threads, bool reorder,
+                                    Fn &&fn) const {
+    std::vector<std::size_t> order = queryOrder(queries, reorder);
+    std::size_t numChunks = (order.size() + batchChunk - 1) / batchChunk;
+
+    auto runChunk = [&](Searcher &searcher, std::size_t chunk) {
+      std::size_t end = std::min((chunk + 1) * batchChunk, order.size());
+      point_t x = queries.col(order[chunk * batchChunk]);
+      for (std::size_t i = chunk * batchChunk; i < end; i++) {
+        x = queries.col(order[i]);
+        fn(searcher, x, order[i], chunk);
+      }
+    };
+
+    if (num_threads <= 1 || numChunks <= 1) {
+      Searcher searcher(*this);
+      for (std::size_t chunk = 0; chunk < numChunks; chunk++) {
+        runChunk(searcher, chunk);
+      }
+      return order;
+    }
+
+    WorkStealingPool pool(num_threads);
+    std::vector<Searcher> searchers(pool.size(), Searcher(*this));
+    for (std::size_t chunk = 0; chunk < numChunks; chunk++) {
+      pool.submit(
+          [&, chunk] { runChunk(searchers[pool.workerIndex()], chunk); });
+    }
+    pool.wait();
+    return order;
+  }
+
+  using point_iter_t = typename std::vector<PointId>::iterator;
+
+  // Subtrees built by worker threads are written to their own block of
+  // nodes, so that m_nodes is never resized concurrently. Once all the work
+  // is done, spliceBlocks() moves the blocks into m_nodes. The root of a block
+  // either replaces node `parentIndex` of block `parentBlock` (child == 0) or
+  // becomes its first (child == 1) or second (child == 2) child. Block 0 is
+  // m_nodes itself.
+  struct BuildBlock {
+    std::size_t parentBlock = 0;
+    std::size_t parentIndex = 0;
+    int child = 0;
+    NodeArena nodes;
+    std::vector<PointId> points; /// input points, if not owned by the caller
+    std::vector<Scalar> keys;    /// scratch space for `points`
+  };
+
+  struct BuildContext {
+    WorkStealingPool *pool;
+    std::deque<BuildBlock> blocks = std::deque<BuildBlock>(1);
+    std::mutex mutex;
+
+    BuildBlock *newBlock(std::size_t parentBlock, std::size_t parentIndex,
+                         int child, int runtime_dimension,
+                         std::size_t &blockIndex) {
+      std::lock_guard<std::mutex> lock(mutex);
+      blockIndex = blocks.size();
+      blocks.emplace_back();
+      BuildBlock &block = blocks.back();
+      block.parentBlock = parentBlock;
+      block.parentIndex = parentIndex;
+      block.child = child;
+      block.nodes.setDimensions(runtime_dimension);
+      block.nodes.emplace_back(BucketSize, runtime_dimension);
+      return &block;
+    }
+  };
+
+  // Subtrees with fewer points are built by the thread that creates them.
+  static constexpr std::size_t parallelGrain = 4096;
+
+  // Fills the (empty) node nodes[index] with the points in [first, last),
+  // splitting recursively with the same median rule as split(). `keys` is
+  // scratch space with one entry per point, starting at `first`. If `ctx`
+  // is given, large subtrees are handed to its pool as new blocks.
+  void buildSubtree(NodeArena &nodes, point_iter_t first,
+                    point_iter_t last, Scalar *keys, std::size_t index,
+                    BuildContext *ctx = nullptr, std::size_t blockIndex = 0) {
+    std::size_t entries = std::distance(first, last);
+    {
+      auto lb = nodes.lb(index);
+      auto ub = nodes.ub(index);
+      for (auto it = first; it != last; ++it) {
+        lb = lb.cwiseMin(it->x);
+        ub = ub.cwiseMax(it->x);
+      }
+      nodes[index].m_entries = entries;
+    }
+
+    int splitDimension = m_dimensions;
+    if (entries >= BucketSize && entries > 1) {
+      Scalar width(0);
+      state_space.choose_split_dimension(nodes.lb(index), nodes.ub(index),
+                                         splitDimension, width);
+    }
+
+    if (splitDimension != m_dimensions) {
+      for (std::size_t i = 0; i < entries; i++) {
+        keys[i] = first[i].x[splitDimension];
+      }
+      Scalar *upper = keys + entries / 2 + 1;
+      std::nth_element(keys, upper, keys + entries);
+      Scalar splitValue =
+          (*std::max_element(keys, upper) + *upper) / Scalar(2);
+      auto middle = std::partition(first, last, [&](const PointId &lp) {
+        return lp.x[splitDimension] < splitValue;
+      });
+
+      // points with equality to splitValue go right, as in split()
+      if (middle != first) {
+        Node &node = nodes[index];
+        node.m_splitDimension = splitDimension;
+        node.m_splitValue = splitValue;
+        node.m_locationId = bucket_t();
+        Scalar *middleKeys = keys + (middle - first);
+
+        if (ctx && entries >= parallelGrain) {
+          node.m_children = std::make_pair(0, 0);
+          std::size_t leftIndex, rightIndex;
+          BuildBlock *left =
+              ctx->newBlock(blockIndex, index, 1, m_dimensions, leftIndex);
+          BuildBlock *right =
+              ctx->newBlock(blockIndex, index, 2, m_dimensions, rightIndex);
+          ctx->pool->submit([=] {
+            buildSubtree(left->nodes, first, middle, keys, 0, ctx, leftIndex);
+          });
+          ctx->pool->submit([=] {
+            buildSubtree(right->nodes, middle, last, middleKeys, 0, ctx,
+                         rightIndex);
+          });
+          return;
+        }
+
+        std::size_t left = nodes.allocate(BucketSize, m_dimensions);
+        std::size_t right = nodes.allocate(BucketSize, m_dimensions);
+        nodes[index].m_children = std::make_pair(left, right);
+        buildSubtree(nodes, first, middle, keys, left, ctx, blockIndex);
+        buildSubtree(nodes, middle, last, middleKeys, right, ctx, blockIndex);
+        return;
+      }
+    }
+
+    Node &leaf = nodes[index];
+    leaf.m_locationId.reserve(entries);
+    for (auto it = first; it != last; ++it) {
+      leaf.m_locationId.push_back(std::move(*it));
+    }
+  }
+
+  // Moves the nodes of all blocks but the first into m_nodes, translating
+  // local child indices to global ones. Parents always precede children.
+  void spliceBlocks(std::deque<BuildBlock> &blocks) {
+    std::vector<std::size_t> base(blocks.size(), 0);
+    std::vector<std::size_t> root(blocks.size(), 0);
+    auto global = [&](std::size_t b, std::size_t local) -> std::size_t {
+      if (b == 0) {
+        return local;
+      }
+      bool replaces = blocks[b].child == 0;
+      return (replaces && local == 0) ? root[b] : base[b] + local - replaces;
+    };
+
+    std::size_t total = m_nodes.size();
+    for (std::size_t b = 1; b < blocks.size(); b++) {
+      total += blocks[b].nodes.size() - (blocks[b].child == 0);
+    }
+    m_nodes.reserve(total);
+
+    for (std::size_t b = 1; b < blocks.size(); b++) {
+      BuildBlock &block = blocks[b];
+      std::size_t parent = global(block.parentBlock, block.parentIndex);
+      bool replaces = block.child == 0;
+      base[b] = m_nodes.size();
+      root[b] = replaces ? parent : base[b];
+
+      for (std::size_t i = 0; i < block.nodes.size(); i++) {
+        Node &node = block.nodes[i];
+        if (node.m_splitDimension != m_dimensions) {
+          node.m_children.first = global(b, node.m_children.first);
+          node.m_children.second = global(b, node.m_children.second);
+        }
+      }
+
+      if (replaces) {
+        m_nodes.assign(parent, block.nodes, 0);
+      } else if (block.child == 1) {
+        m_nodes[parent].m_children.first = root[b];
+      } else {
+        m_nodes[parent].m_children.second = root[b];
+      }
+      m_nodes.append(block.nodes, replaces);
+      block.nodes = NodeArena();
+    }
+  }
+
   struct Node {
+    Node() = default; // for load()
+
     Node(std::size_t capacity, int runtime_dimension = -1) {
       init(capacity, runtime_dimension);
     }
 
-    Node(std::vector<PointId> &recycle, std::size_t capacity,
+    Node(bucket_t &recycle, std::size_t capacity,
          int runtime_dimension) {
       std::swap(m_locationId, recycle);
       init(capacity, runtime_dimension);
@@ -368,54 +1915,36 @@ private:
 
       if constexpr (Dimensions == Eigen::Dynamic) {
         assert(runtime_dimension > 0);
-        m_lb.resize(runtime_dimension);
-        m_ub.resize(runtime_dimension);
         m_splitDimension = runtime_dimension;
       }
 
-      m_lb.setConstant(std::numeric_limits<Scalar>::max());
-      m_ub.setConstant(std::numeric_limits<Scalar>::lowest());
       m_locationId.reserve(std::max(BucketSize, capacity));
     }
 
-    void expandBounds(const point_t &x) {
-      m_lb = m_lb.cwiseMin(x);
-      m_ub = m_ub.cwiseMax(x);
-      m_entries++;
-    }
+    bool shouldSplit() const { return m_entries >= BucketSize; }
 
-    void add(const PointId &lp) {
-      expandBounds(lp.x);
-      m_locationId.push_back(lp);
+    template <typename Archive> void serialize(Archive &ar) {
+      ar(m_entries, m_splitDimension, m_splitValue, m_children, m_locationId);
     }
 
-    bool shouldSplit() const { return m_entries >= BucketSize; }
-
+    // Adds the points accepted by accept(bucket, i) to `results`.
+    template <typename Accept>
     void searchCapacityLimitedBall(const point_t &x, Scalar maxRadius,
                                    std::size_t K,
-                                   std::priority_queue<DistanceId> &results,
-                                   const StateSpace &state_space) const {
-
-      std::size_t i = 0;
+                                   CandidateQueue<DistanceId> &results,
+                                   const StateSpace &state_space,
+                                   const Accept &accept) const {
 
-      // this fills up the queue if it isn't full yet
-      for (; results.size() < K && i < m_entries; i++) {
-        const auto &lp = m_locationId[i];
-        Scalar distance = state_space.distance(x, lp.x);
-        if (distance < maxRadius) {
-          results.emplace(DistanceId{distance, lp.id});
+      auto limit = [&] {
+        return results.size() < K ? maxRadius
+                                  : std::min(maxRadius, results.top().distance);
+      };
+      m_locationId.scan(x, state_space, limit, [&](std::size_t i,
+                                                   Scalar distance) {
+        if (distance < maxRadius && accept(m_locationId, i)) {
+          offerCandidate(results, K, DistanceId{distance, m_locationId.id(i)});
         }
-      }
-
-      // this adds new things to the queue once it is full
-      for (; i < m_entries; i++) {
-        const auto &lp = m_locationId[i];
-        Scalar distance = state_space.distance(x, lp.x);
-        if (distance < maxRadius && distance < results.top().distance) {
-          results.pop();
-          results.emplace(DistanceId{distance, lp.id});
-        }
-      }
+      });
     }
 
     void queueChildren(const point_t &x,
@@ -429,37 +1958,833 @@ private:
       }
     }
 
-    Scalar distance_to_rectangle(const point_t &x,
-                                 const StateSpace &distance) const {
-      return distance.distance_to_rectangle(x, m_lb, m_ub);
-    }
-
     std::size_t m_entries = 0; /// size of the tree, or subtree
 
     int m_splitDimension = Dimensions; /// split dimension of this node
     Scalar m_splitValue = 0;           /// split value of this node
 
-    // struct Range {
-    //   Scalar min, max;
-    // };
-
-    // std::array<Range, Dimensions> m_bounds; /// bounding box of this node
-    ///
-    ///
-    ///
-    ///
-    ///
-    ///
-    ///
-    ///
-    ///
-    Eigen::Matrix<Scalar, Dimensions, 1> m_lb;
-    Eigen::Matrix<Scalar, Dimensions, 1> m_ub;
+    // the bounding box of node i is kept by NodeArena, see lb(i) and ub(i)
 
     std::pair<std::size_t, std::size_t>
-        m_children;                    /// subtrees of this node (if not a leaf)
-    std::vector<PointId> m_locationId; /// data held in this node (if a leaf)
+        m_children;        /// subtrees of this node (if not a leaf)
+    bucket_t m_locationId; /// data held in this node (if a leaf)
   };
+
+  // The nodes of a tree, with their bounding boxes stored apart in a single
+  // array: node i owns lower corner [2 * i * dims, (2 * i + 1) * dims) and
+  // the upper corner right after it. Trees with a runtime dimension thus
+  // keep all bounds contiguous instead of in two heap vectors per node.
+  class NodeArena {
+  public:
+    using bound_t = Eigen::Map<point_t>;
+    using const_bound_t = Eigen::Map<const point_t>;
+
+    void setDimensions(int dimensions) { m_dims = dimensions; }
+
+    std::size_t size() const { return m_nodes.size(); }
+    std::size_t capacity() const { return m_nodes.capacity(); }
+    std::size_t boundsCapacity() const { return m_bounds.capacity(); }
+    std::size_t numFree() const { return m_free.size(); }
+    void reserve(std::size_t capacity) {
+      m_nodes.reserve(capacity);
+      m_bounds.reserve(2 * m_dims * capacity);
+    }
+    void clear() {
+      m_nodes.clear();
+      m_bounds.clear();
+      m_free.clear();
+    }
+
+    Node &operator[](std::size_t i) { return m_nodes[i]; }
+    const Node &operator[](std::size_t i) const { return m_nodes[i]; }
+    Node &back() { return m_nodes.back(); }
+
+    // Adds a node with an empty (inverted) bounding box.
+    template <typename... Args> Node &emplace_back(Args &&...args) {
+      m_nodes.emplace_back(std::forward<Args>(args)...);
+      m_bounds.resize(m_bounds.size() + m_dims,
+                      std::numeric_limits<Scalar>::max());
+      m_bounds.resize(m_bounds.size() + m_dims,
+                      std::numeric_limits<Scalar>::lowest());
+      return m_nodes.back();
+    }
+
+    void pop_back() {
+      m_nodes.pop_back();
+      m_bounds.resize(m_bounds.size() - 2 * m_dims);
+    }
+
+    // Adds a node, in a slot freed by release() if there is one.
+    template <typename... Args> std::size_t allocate(Args &&...args) {
+      if (m_free.empty()) {
+        emplace_back(std::forward<Args>(args)...);
+        return m_nodes.size() - 1;
+      }
+      std::size_t i = m_free.back();
+      m_free.pop_back();
+      m_nodes[i] = Node(std::forward<Args>(args)...);
+      resetBounds(i);
+      return i;
+    }
+
+    // Frees node i and its points; the slot is reused by allocate().
+    void release(std::size_t i) {
+      m_nodes[i].m_locationId = bucket_t();
+      m_nodes[i].m_entries = 0;
+      m_free.push_back(i);
+    }
+
+    void resetBounds(std::size_t i) {
+      lb(i).setConstant(std::numeric_limits<Scalar>::max());
+      ub(i).setConstant(std::numeric_limits<Scalar>::lowest());
+    }
+
+    // Grows the box of node i to contain the box of node j.
+    void includeBounds(std::size_t i, std::size_t j) {
+      lb(i) = lb(i).cwiseMin(lb(j));
+      ub(i) = ub(i).cwiseMax(ub(j));
+    }
+
+    bound_t lb(std::size_t i) {
+      return bound_t(m_bounds.data() + 2 * m_dims * i, m_dims);
+    }
+    bound_t ub(std::size_t i) {
+      return bound_t(m_bounds.data() + (2 * i + 1) * m_dims, m_dims);
+    }
+    const_bound_t lb(std::size_t i) const {
+      return const_bound_t(m_bounds.data() + 2 * m_dims * i, m_dims);
+    }
+    const_bound_t ub(std::size_t i) const {
+      return const_bound_t(m_bounds.data() + (2 * i + 1) * m_dims, m_dims);
+    }
+
+    // Grows the box of node i to contain x and counts one more entry.
+    template <typename Derived>
+    void expandBounds(std::size_t i, const Eigen::MatrixBase<Derived> &x) {
+      includePoint(i, x);
+      m_nodes[i].m_entries++;
+    }
+
+    template <typename Derived>
+    void includePoint(std::size_t i, const Eigen::MatrixBase<Derived> &x) {
+      Scalar *lb = m_bounds.data() + 2 * m_dims * i;
+      Scalar *ub = lb + m_dims;
+      for (int d = 0; d < m_dims; d++) {
+        lb[d] = std::min(lb[d], x[d]);
+        ub[d] = std::max(ub[d], x[d]);
+      }
+    }
+
+    // Moves node j of `other` (and its box) to slot i.
+    void assign(std::size_t i, NodeArena &other, std::size_t j) {
+      m_nodes[i] = std::move(other.m_nodes[j]);
+      std::copy_n(other.m_bounds.begin() + 2 * m_dims * j, 2 * m_dims,
+                  m_bounds.begin() + 2 * m_dims * i);
+    }
+
+    // Moves the nodes of `other` from index `first` on to the back.
+    void append(NodeArena &other, std::size_t first) {
+      std::move(other.m_nodes.begin() + first, other.m_nodes.end(),
+                std::back_inserter(m_nodes));
+      m_bounds.insert(m_bounds.end(),
+                      other.m_bounds.begin() + 2 * m_dims * first,
+                      other.m_bounds.end());
+    }
+
+    template <typename Archive> void serialize(Archive &ar) {
+      ar(m_dims, m_nodes, m_bounds, m_free);
+    }
+
+    int dimensions() const { return m_dims; }
+    const std::vector<std::size_t> &freeSlots() const { return m_free; }
+
+    // True if there is one box per node and the free slots are in range
+    // (checked after KDTree::load).
+    bool consistent() const {
+      return m_dims > 0 &&
+             m_bounds.size() == 2 * std::size_t(m_dims) * m_nodes.size() &&
+             std::all_of(m_free.begin(), m_free.end(),
+                         [&](std::size_t i) { return i < m_nodes.size(); });
+    }
+
+  private:
+    int m_dims = Dimensions;
+    std::vector<Node> m_nodes;
+    std::vector<Scalar> m_bounds;
+    std::vector<std::size_t> m_free; /// slots of released nodes
+  };
+
+  NodeArena m_nodes;
+
+  double m_balance = 0; /// scapegoat alpha, 0 if disabled
+
+  std::size_t maxBalancedDepth() const {
+    double leaves = std::max<double>(1, double(size()) / BucketSize);
+    return std::size_t(std::log(leaves) / std::log(1 / m_balance)) + 1;
+  }
+
+  // Rebuilds the scapegoat on the path of x, see setBalanceFactor().
+  void rebalance(const point_t &x) {
+    std::vector<std::size_t> path;
+    for (std::size_t index = 0;
+         m_nodes[index].m_splitDimension != m_dimensions;) {
+      const Node &node = m_nodes[index];
+      path.push_back(index);
+      index = x[node.m_splitDimension] < node.m_splitValue
+                  ? node.m_children.first
+                  : node.m_children.second;
+    }
+    for (auto it = path.rbegin(); it != path.rend(); ++it) {
+      const Node &node = m_nodes[*it];
+      std::size_t heavier = std::max(m_nodes[node.m_children.first].m_entries,
+                                     m_nodes[node.m_children.second].m_entries);
+      if (heavier > m_balance * node.m_entries) {
+        rebuildSubtree(*it);
+        return;
+      }
+    }
+  }
+
+  // Rebuilds the subtree rooted at `root` from its points, reusing the node
+  // slots it frees.
+  void rebuildSubtree(std::size_t root) {
+    std::vector<PointId> points, leafPoints;
+    points.reserve(m_nodes[root].m_entries);
+    std::vector<std::size_t> searchStack{root};
+    while (searchStack.size() > 0) {
+      std::size_t index = searchStack.back();
+      searchStack.pop_back();
+      Node &node = m_nodes[index];
+      if (node.m_splitDimension == m_dimensions) {
+        node.m_locationId.takePoints(leafPoints);
+        std::move(leafPoints.begin(), leafPoints.end(),
+                  std::back_inserter(points));
+      } else {
+        searchStack.push_back(node.m_children.first);
+        searchStack.push_back(node.m_children.second);
+      }
+      if (index != root) {
+        waitingForSplit.erase(index);
+        m_nodes.release(index);
+      }
+    }
+
+    Node &node = m_nodes[root];
+    node.m_splitDimension = m_dimensions;
+    node.m_splitValue = 0;
+    node.m_children = std::pair<std::size_t, std::size_t>(0, 0);
+    node.m_locationId = bucket_t();
+    m_nodes.resetBounds(root);
+    std::vector<Scalar> keys(points.size());
+    buildSubtree(m_nodes, points.begin(), points.end(), keys.data(), root);
+
+    if (m_indexed) {
+      searchStack.push_back(root);
+      while (searchStack.size() > 0) {
+        std::size_t index = searchStack.back();
+        searchStack.pop_back();
+        const Node &node = m_nodes[index];
+        if (node.m_splitDimension == m_dimensions) {
+          indexLeaf(index);
+        } else {
+          searchStack.push_back(node.m_children.first);
+          searchStack.push_back(node.m_children.second);
+        }
+      }
+    }
+  }
+
+  void addToLeaf(std::size_t index, const PointId &lp) {
+    m_nodes.expandBounds(index, lp.x);
+    m_nodes[index].m_locationId.push_back(lp);
+    if (m_indexed) {
+      m_idIndex[lp.id] =
+          Location{index, m_nodes[index].m_locationId.size() - 1};
+    }
+  }
+
+  // Position of a point, see setIdIndex(). Kept up to date by addPoint(),
+  // split(), removePoint() and leaf merges.
+  struct Location {
+    std::size_t leaf;
+    std::size_t slot;
+  };
+  std::unordered_map<Id, Location> m_idIndex;
+  bool m_indexed = false;
+
+  void indexLeaf(std::size_t index) {
+    const bucket_t &bucket = m_nodes[index].m_locationId;
+    for (std::size_t i = 0; i < bucket.size(); i++) {
+      m_idIndex[bucket.id(i)] = Location{index, i};
+    }
+  }
+
+  const Location *findLocation(const Id &id) const {
+    CHECK_PRETTY_DYNOTREE(m_indexed, "call setIdIndex() to find points by id");
+    auto found = m_idIndex.find(id);
+    return found == m_idIndex.end() ? nullptr : &found->second;
+  }
+
+  // Internal nodes from the root to `leaf`, following the point x (points
+  // are routed by their coordinates, so the path of a stored point is
+  // unique).
+  template <typename Derived>
+  void pathTo(const Eigen::MatrixBase<Derived> &x, std::size_t leaf,
+              std::vector<std::size_t> &path) const {
+    for (std::size_t index = 0; index != leaf;) {
+      const Node &node = m_nodes[index];
+      CHECK_PRETTY_DYNOTREE(node.m_splitDimension != m_dimensions,
+                            "id index out of date");
+      path.push_back(index);
+      index = x[node.m_splitDimension] < node.m_splitValue
+                  ? node.m_children.first
+                  : node.m_children.second;
+    }
+  }
+
+  // True if x lies on the box of node `index`, i.e. the box may shrink
+  // when x goes away.
+  template <typename Derived>
+  bool onBoundary(const Eigen::MatrixBase<Derived> &x,
+                  std::size_t index) const {
+    return (x.array() == m_nodes.lb(index).array()).any() ||
+           (x.array() == m_nodes.ub(index).array()).any();
+  }
+
+  void refitLeaf(std::size_t leaf) {
+    const bucket_t &bucket = m_nodes[leaf].m_locationId;
+    m_nodes.resetBounds(leaf);
+    for (std::size_t i = 0; i < bucket.size(); i++) {
+      m_nodes.includePoint(leaf, bucket.point(i));
+    }
+  }
+
+  void buildIdIndex() {
+    m_idIndex.clear();
+    m_idIndex.reserve(size());
+    std::vector<std::size_t> searchStack{0};
+    while (searchStack.size() > 0) {
+      std::size_t index = searchStack.back();
+      searchStack.pop_back();
+      const Node &node = m_nodes[index];
+      if (node.m_splitDimension == m_dimensions) {
+        indexLeaf(index);
+      } else {
+        searchStack.push_back(node.m_children.first);
+        searchStack.push_back(node.m_children.second);
+      }
+    }
+    m_indexed = true;
+  }
+
+  void dropIdIndex() {
+    m_idIndex = std::unordered_map<Id, Location>();
+    m_indexed = false;
+  }
+
+  // Turns the internal node `index`, whose children are leaves, into a leaf
+  // holding their points, and frees the children.
+  void mergeChildren(std::size_t index) {
+    Node &node = m_nodes[index];
+    bucket_t merged;
+    merged.reserve(std::max(BucketSize, node.m_entries));
+    for (std::size_t child : {node.m_children.first, node.m_children.second}) {
+      const bucket_t &bucket = m_nodes[child].m_locationId;
+      for (std::size_t i = 0; i < bucket.size(); i++) {
+        merged.append(bucket, i);
+      }
+      waitingForSplit.erase(child);
+      m_nodes.release(child);
+    }
+    std::swap(node.m_locationId, merged);
+    node.m_splitDimension = m_dimensions;
+    node.m_splitValue = 0;
+    node.m_children = std::pair<std::size_t, std::size_t>(0, 0);
+    indexLeaf(index);
+  }
+
+  // max() for nodes emptied by removePoint, whose box is inverted (and
+  // outside the domain of e.g. SO2).
+  Scalar distanceToNode(const point_t &x, std::size_t index) const {
+    if (m_nodes[index].m_entries == 0) {
+      return std::numeric_limits<Scalar>::max();
+    }
+    return state_space.distance_to_rectangle(x, m_nodes.lb(index),
+                                             m_nodes.ub(index));
+  }
+
+  // True if the state space provides the separable bounds (rectangle_term,
+  // rectangle_max_term) used by maxDistanceToNode() and boxDistance().
+  bool separableBounds() const {
+    if constexpr (!has_separable_bound<StateSpace, Scalar>::value) {
+      return false;
+    } else if constexpr (std::is_same_v<StateSpace, Combined<Scalar>>) {
+      return state_space.separable();
+    } else {
+      return true;
+    }
+  }
+
+  // Upper bound on the distance from x to the points of node `index`.
+  // Needs separableBounds(); `sums` is scratch space.
+  Scalar maxDistanceToNode(const point_t &x, std::size_t index,
+                           std::vector<Scalar> &sums) const {
+    if constexpr (has_separable_bound<StateSpace, Scalar>::value) {
+      auto lb = m_nodes.lb(index);
+      auto ub = m_nodes.ub(index);
+      sums.assign(state_space.rectangle_groups(), Scalar(0));
+      for (int d = 0; d < m_dimensions; d++) {
+        sums[state_space.rectangle_group(d)] +=
+            state_space.rectangle_max_term(d, x[d], lb[d], ub[d]);
+      }
+      return state_space.rectangle_bound(sums.data());
+    } else {
+      return std::numeric_limits<Scalar>::infinity();
+    }
+  }
+
+  // Lower bound on the distance between the points of node a and those of
+  // node b of `other`. Per dimension, the gap between the two intervals is
+  // attained at an end of the first one, unless they overlap. Needs
+  // separableBounds(); `sums` is scratch space.
+  Scalar boxDistance(std::size_t a, const tree_t &other, std::size_t b,
+                     std::vector<Scalar> &sums) const {
+    if constexpr (has_separable_bound<StateSpace, Scalar>::value) {
+      auto lbA = m_nodes.lb(a);
+      auto ubA = m_nodes.ub(a);
+      auto lbB = other.m_nodes.lb(b);
+      auto ubB = other.m_nodes.ub(b);
+      sums.assign(state_space.rectangle_groups(), Scalar(0));
+      for (int d = 0; d < m_dimensions; d++) {
+        if (ubA[d] < lbB[d] || ubB[d] < lbA[d]) {
+          sums[state_space.rectangle_group(d)] += std::min(
+              state_space.rectangle_term(d, lbA[d], lbB[d], ubB[d]),
+              state_space.rectangle_term(d, ubA[d], lbB[d], ubB[d]));
+        }
+      }
+      return state_space.rectangle_bound(sums.data());
+    } else {
+      return 0;
+    }
+  }
+
+  std::vector<std::size_t> leafIndices() const {
+    std::vector<std::size_t> leaves;
+    std::vector<std::size_t> searchStack{0};
+    while (searchStack.size() > 0) {
+      std::size_t index = searchStack.back();
+      searchStack.pop_back();
+      const Node &node = m_nodes[index];
+      if (node.m_splitDimension == m_dimensions) {
+        leaves.push_back(index);
+      } else {
+        searchStack.push_back(node.m_children.second);
+        searchStack.push_back(node.m_children.first);
+      }
+    }
+    return leaves;
+  }
+
+  struct GraphEdge {
+    std::size_t from; /// the smaller vertex
+    std::size_t to;
+    Scalar distance;
+  };
+
+  struct GraphWorker {
+    std::vector<GraphEdge> edges;
+    std::vector<Scalar> sums;
+    std::vector<std::size_t> searchStack;
+  };
+
+  // State of the graph builders: the vertex of every slot (see leafSlots)
+  // holding an active point, and the edges found by every worker.
+  struct GraphState {
+    std::vector<std::size_t> first;  /// first slot of every leaf
+    std::vector<std::size_t> vertex; /// of every slot
+    std::vector<Id> ids;             /// of every vertex
+    WorkStealingPool *pool = nullptr;
+    std::vector<GraphWorker> workers = std::vector<GraphWorker>(1);
+
+    GraphWorker &local() { return workers[pool ? pool->workerIndex() : 0]; }
+
+    // Runs fn, as a task of the pool for more than parallelGrain points.
+    template <typename Fn> void spawn(std::size_t points, Fn &&fn) {
+      if (pool && points > parallelGrain) {
+        pool->submit(std::forward<Fn>(fn));
+      } else {
+        fn();
+      }
+    }
+
+    void addEdge(std::size_t slotA, std::size_t slotB, Scalar distance) {
+      std::size_t u = vertex[slotA];
+      std::size_t v = vertex[slotB];
+      local().edges.push_back(
+          GraphEdge{std::min(u, v), std::max(u, v), distance});
+    }
+  };
+
+  // Edges of the points of node a.
+  void selfJoin(std::size_t a, Scalar maxRadius, GraphState &s) const {
+    const Node &node = m_nodes[a];
+    if (node.m_entries < 2) {
+      return;
+    }
+    if (node.m_splitDimension == m_dimensions) {
+      const bucket_t &bucket = node.m_locationId;
+      for (std::size_t i = 0; i < bucket.size(); i++) {
+        if (!bucket.active(i)) {
+          continue;
+        }
+        for (std::size_t j = i + 1; j < bucket.size(); j++) {
+          if (!bucket.active(j)) {
+            continue;
+          }
+          Scalar distance =
+              state_space.distance(bucket.point(i), bucket.point(j));
+          if (distance < maxRadius) {
+            s.addEdge(s.first[a] + i, s.first[a] + j, distance);
+          }
+        }
+      }
+      return;
+    }
+    std::size_t first = node.m_children.first;
+    std::size_t second = node.m_children.second;
+    s.spawn(m_nodes[first].m_entries,
+            [this, first, maxRadius, &s] { selfJoin(first, maxRadius, s); });
+    s.spawn(m_nodes[second].m_entries,
+            [this, second, maxRadius, &s] { selfJoin(second, maxRadius, s); });
+    crossJoin(first, second, maxRadius, s);
+  }
+
+  // Edges between the points of nodes a and b, which are disjoint. Without
+  // separable bounds, node a is split down to its leaves and every point
+  // searches b.
+  void crossJoin(std::size_t a, std::size_t b, Scalar maxRadius,
+                 GraphState &s) const {
+    const Node &nodeA = m_nodes[a];
+    const Node &nodeB = m_nodes[b];
+    if (nodeA.m_entries == 0 || nodeB.m_entries == 0) {
+      return;
+    }
+    bool separable = separableBounds();
+    GraphWorker &worker = s.local();
+    if (separable && boxDistance(a, *this, b, worker.sums) >= maxRadius) {
+      return;
+    }
+    bool leafA = nodeA.m_splitDimension == m_dimensions;
+    bool leafB = nodeB.m_splitDimension == m_dimensions;
+
+    if (leafA && (leafB || !separable)) {
+      const bucket_t &bucketA = nodeA.m_locationId;
+      std::vector<std::size_t> &searchStack = worker.searchStack;
+      for (std::size_t i = 0; i < bucketA.size(); i++) {
+        if (!bucketA.active(i)) {
+          continue;
+        }
+        point_t x = bucketA.point(i);
+        searchStack.assign(1, b);
+        while (searchStack.size() > 0) {
+          std::size_t index = searchStack.back();
+          searchStack.pop_back();
+          const Node &node = m_nodes[index];
+          if (distanceToNode(x, index) >= maxRadius) {
+            continue;
+          }
+          if (node.m_splitDimension != m_dimensions) {
+            node.queueChildren(x, searchStack);
+            continue;
+          }
+          const bucket_t &bucket = node.m_locationId;
+          bucket.scan(
+              x, state_space, [&] { return maxRadius; },
+              [&](std::size_t j, Scalar distance) {
+                if (bucket.active(j) && distance < maxRadius) {
+                  s.addEdge(s.first[a] + i, s.first[index] + j, distance);
+                }
+              });
+        }
+      }
+    } else if (!leafA && (leafB || !separable ||
+                          nodeA.m_entries >= nodeB.m_entries)) {
+      std::size_t first = nodeA.m_children.first;
+      std::size_t second = nodeA.m_children.second;
+      std::size_t points = nodeA.m_entries + nodeB.m_entries;
+      s.spawn(points, [this, first, b, maxRadius, &s] {
+        crossJoin(first, b, maxRadius, s);
+      });
+      crossJoin(second, b, maxRadius, s);
+    } else {
+      std::size_t first = nodeB.m_children.first;
+      std::size_t second = nodeB.m_children.second;
+      std::size_t points = nodeA.m_entries + nodeB.m_entries;
+      s.spawn(points, [this, a, first, maxRadius, &s] {
+        crossJoin(a, first, maxRadius, s);
+      });
+      crossJoin(a, second, maxRadius, s);
+    }
+  }
+
+  // Gathers the edges of all the workers into a CSR graph. With `dedupe`,
+  // repeated edges are kept once.
+  Graph toGraph(GraphState &s, bool dedupe = false) const {
+    Graph graph;
+    std::size_t numVertices = s.ids.size();
+    graph.ids = std::move(s.ids);
+    graph.offsets.assign(numVertices + 1, 0);
+    for (const GraphWorker &worker : s.workers) {
+      for (const GraphEdge &edge : worker.edges) {
+        graph.offsets[edge.from + 1]++;
+      }
+    }
+    for (std::size_t v = 0; v < numVertices; v++) {
+      graph.offsets[v + 1] += graph.offsets[v];
+    }
+
+    // (distance, vertex) of every edge, by row
+    std::vector<std::pair<Scalar, std::size_t>> rows(graph.offsets.back());
+    std::vector<std::size_t> next(graph.offsets.begin(),
+                                  graph.offsets.end() - 1);
+    for (GraphWorker &worker : s.workers) {
+      for (const GraphEdge &edge : worker.edges) {
+        rows[next[edge.from]++] = {edge.distance, edge.to};
+      }
+      std::vector<GraphEdge>().swap(worker.edges);
+    }
+
+    std::size_t size = 0;
+    for (std::size_t v = 0; v < numVertices; v++) {
+      auto begin = rows.begin() + graph.offsets[v];
+      auto end = rows.begin() + graph.offsets[v + 1];
+      if (dedupe) {
+        std::sort(begin, end, [](const auto &e1, const auto &e2) {
+          return e1.second < e2.second;
+        });
+        end = std::unique(begin, end, [](const auto &e1, const auto &e2) {
+          return e1.second == e2.second;
+        });
+      }
+      std::sort(begin, end);
+      graph.offsets[v] = size;
+      size = std::copy(begin, end, rows.begin() + size) - rows.begin();
+    }
+    graph.offsets[numVertices] = size;
+
+    graph.neighbours.reserve(size);
+    graph.distances.reserve(size);
+    for (std::size_t j = 0; j < size; j++) {
+      graph.distances.push_back(rows[j].first);
+      graph.neighbours.push_back(graph.ids[rows[j].second]);
+    }
+    return graph;
+  }
+
+  // Numbers the points of the given leaves, in order: the points of leaf l
+  // get the slots first[l], first[l] + 1, ... Returns the number of slots.
+  std::size_t leafSlots(const std::vector<std::size_t> &leaves,
+                        std::vector<std::size_t> &first) const {
+    first.assign(m_nodes.size(), 0);
+    std::size_t numSlots = 0;
+    for (std::size_t leaf : leaves) {
+      first[leaf] = numSlots;
+      numSlots += m_nodes[leaf].m_locationId.size();
+    }
+    return numSlots;
+  }
+
+  // State of allKnn: the k best neighbours of every point so far, sorted,
+  // and for every leaf of this tree the largest k-th best distance of its
+  // points (max() until known).
+  struct AllKnnState {
+    const tree_t &other;
+    std::size_t k;
+    std::vector<std::size_t> first; /// first result slot of every leaf
+    std::vector<DistanceId> best;   /// k entries per slot
+    std::vector<std::size_t> counts;
+    std::vector<Scalar> bound;
+    WorkStealingPool *pool = nullptr;
+    std::vector<std::vector<Scalar>> sums =
+        std::vector<std::vector<Scalar>>(1); /// scratch, one per worker
+
+    std::vector<Scalar> &localSums() {
+      return sums[pool ? pool->workerIndex() : 0];
+    }
+  };
+
+  void allKnnNodes(std::size_t a, std::size_t b, AllKnnState &s) const {
+    const Node &nodeA = m_nodes[a];
+    const Node &nodeB = s.other.m_nodes[b];
+    if (nodeA.m_entries == 0) {
+      s.bound[a] = 0;
+      return;
+    }
+    std::vector<Scalar> &sums = s.localSums();
+    if (nodeB.m_entries == 0 ||
+        boxDistance(a, s.other, b, sums) >= s.bound[a]) {
+      return;
+    }
+    bool leafA = nodeA.m_splitDimension == m_dimensions;
+    bool leafB = nodeB.m_splitDimension == m_dimensions;
+
+    if (leafA && leafB) {
+      const bucket_t &bucketA = nodeA.m_locationId;
+      const bucket_t &bucketB = nodeB.m_locationId;
+      Scalar bound = 0;
+      for (std::size_t i = 0; i < bucketA.size(); i++) {
+        if (!bucketA.active(i)) {
+          continue;
+        }
+        std::size_t slot = s.first[a] + i;
+        DistanceId *best = s.best.data() + slot * s.k;
+        std::size_t &count = s.counts[slot];
+        auto kth = [&] {
+          return count < s.k ? std::numeric_limits<Scalar>::max()
+                             : best[s.k - 1].distance;
+        };
+        auto x = bucketA.point(i);
+        if (s.other.distanceToNode(x, b) >= kth()) {
+          bound = std::max(bound, kth());
+          continue;
+        }
+        bucketB.scan(
+            x, state_space, kth,
+            [&](std::size_t j, Scalar distance) {
+              if (!bucketB.active(j) || distance >= kth()) {
+                return;
+              }
+              std::size_t pos = std::min(count, s.k - 1);
+              for (; pos > 0 && best[pos - 1].distance > distance; pos--) {
+                best[pos] = best[pos - 1];
+              }
+              best[pos] = DistanceId{distance, bucketB.id(j)};
+              count += count < s.k;
+            });
+        bound = std::max(bound, kth());
+      }
+      s.bound[a] = bound;
+    } else if (!leafA) {
+      // down to the leaves of this tree first, so that the other tree is
+      // searched in order of distance to each leaf
+      std::size_t first = nodeA.m_children.first;
+      std::size_t second = nodeA.m_children.second;
+      if (s.pool && nodeA.m_entries > parallelGrain) {
+        s.pool->submit([this, &s, first, b] { allKnnNodes(first, b, s); });
+        s.pool->submit([this, &s, second, b] { allKnnNodes(second, b, s); });
+        return;
+      }
+      allKnnNodes(first, b, s);
+      allKnnNodes(second, b, s);
+    } else {
+      // the closer child of b first, to tighten the bound early
+      auto [first, second] = nodeB.m_children;
+      if (boxDistance(a, s.other, second, sums) <
+          boxDistance(a, s.other, first, sums)) {
+        std::swap(first, second);
+      }
+      allKnnNodes(a, first, s);
+      allKnnNodes(a, second, s);
+    }
+  }
+
+  void closestPairNodes(std::size_t a, const tree_t &other, std::size_t b,
+                        IdPair &best, std::vector<Scalar> &sums) const {
+    const Node &nodeA = m_nodes[a];
+    const Node &nodeB = other.m_nodes[b];
+    if (nodeA.m_entries == 0 || nodeB.m_entries == 0 ||
+        boxDistance(a, other, b, sums) >= best.distance) {
+      return;
+    }
+    bool leafA = nodeA.m_splitDimension == m_dimensions;
+    bool leafB = nodeB.m_splitDimension == m_dimensions;
+
+    if (leafA && leafB) {
+      const bucket_t &bucketA = nodeA.m_locationId;
+      const bucket_t &bucketB = nodeB.m_locationId;
+      for (std::size_t i = 0; i < bucketA.size(); i++) {
+        if (!bucketA.active(i)) {
+          continue;
+        }
+        bucketB.scan(
+            bucketA.point(i), state_space, [&] { return best.distance; },
+            [&](std::size_t j, Scalar distance) {
+              if (bucketB.active(j) && distance < best.distance) {
+                best = IdPair{distance, bucketA.id(i), bucketB.id(j)};
+              }
+            });
+      }
+    } else if (!leafA && (leafB || nodeA.m_entries >= nodeB.m_entries)) {
+      auto [first, second] = nodeA.m_children;
+      if (other.boxDistance(b, *this, second, sums) <
+          other.boxDistance(b, *this, first, sums)) {
+        std::swap(first, second);
+      }
+      closestPairNodes(first, other, b, best, sums);
+      closestPairNodes(second, other, b, best, sums);
+    } else {
+      auto [first, second] = nodeB.m_children;
+      if (boxDistance(a, other, second, sums) <
+          boxDistance(a, other, first, sums)) {
+        std::swap(first, second);
+      }
+      closestPairNodes(a, other, first, best, sums);
+      closestPairNodes(a, other, second, best, sums);
+    }
+  }
+
+  // Depth-first search of the points within maxRadius of x, the side of x
+  // first. Calls hit(n) for every n points found at once: 1 for a point, or
+  // the entries of a node whose box is inside the ball. Stops when hit
+  // returns false.
+  template <typename Hit>
+  void withinRadius(const point_t &x, Scalar maxRadius, Hit &&hit) const {
+    if (m_nodes[0].m_entries == 0) {
+      return;
+    }
+    SearchScratch &scratch = threadScratch();
+    bool wholeNodes = m_numInactive == 0 && separableBounds();
+    std::vector<std::size_t> &searchStack = scratch.searchStack;
+    searchStack.clear();
+    searchStack.push_back(0);
+
+    bool more = true;
+    while (more && searchStack.size() > 0) {
+      std::size_t nodeIndex = searchStack.back();
+      searchStack.pop_back();
+      const Node &node = m_nodes[nodeIndex];
+      if (node.m_entries == 0 || distanceToNode(x, nodeIndex) >= maxRadius) {
+        continue;
+      }
+      if (wholeNodes &&
+          maxDistanceToNode(x, nodeIndex, scratch.sums) < maxRadius) {
+        more = hit(node.m_entries);
+      } else if (node.m_splitDimension == m_dimensions) {
+        const bucket_t &bucket = node.m_locationId;
+        bucket.scan(
+            x, state_space, [&] { return maxRadius; },
+            [&](std::size_t i, Scalar nodeDist) {
+              if (bucket.active(i) && nodeDist < maxRadius) {
+                more = hit(1);
+              }
+              return more; // ends the scan of the bucket
+            });
+      } else {
+        node.queueChildren(x, searchStack);
+      }
+    }
+  }
 };
 
+// Free-function forms of KDTree::allKnn and KDTree::closestPair.
+template <typename Tree>
+auto allKnn(const Tree &treeA, const Tree &treeB, std::size_t k) {
+  return treeA.allKnn(treeB, k);
+}
+
+template <typename Tree>
+auto closestPair(const Tree &treeA, const Tree &treeB) {
+  return treeA.closestPair(treeB);
+}
+
 } // namespace dynotree
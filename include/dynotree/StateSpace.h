@@ -5,6 +5,7 @@
 #include <iostream>
 #include <limits>
 #include <memory>
+#include <type_traits>
 #include <variant>
 #include <vector>
 
@@ -12,6 +13,7 @@
 #include <eigen3/Eigen/Dense>
 
 #include "dynotree_macros.h"
+#include "simd.h"
 
 namespace dynotree {
 
@@ -42,6 +44,39 @@ void choose_split_dimension_weights(const T &lb, const T &ub, const T2 &weight,
   }
 }
 
+// True if the state space can evaluate the distance from a point to a box
+// dimension by dimension (rectangle_term and rectangle_bound).
+template <typename StateSpace, typename Scalar, typename = void>
+struct has_separable_bound : std::false_type {};
+
+template <typename StateSpace, typename Scalar>
+struct has_separable_bound<
+    StateSpace, Scalar,
+    std::void_t<decltype(std::declval<const StateSpace &>().rectangle_term(
+        int(), Scalar(), Scalar(), Scalar()))>> : std::true_type {};
+
+// True if the state space has parameters sized at runtime, which can be
+// checked against the dimension of the points with consistent(dimensions).
+template <typename StateSpace, typename = void>
+struct has_consistency_check : std::false_type {};
+
+template <typename StateSpace>
+struct has_consistency_check<
+    StateSpace, std::void_t<decltype(std::declval<const StateSpace &>()
+                                         .consistent(int()))>>
+    : std::true_type {};
+
+// Checked after KDTree::load: the parameters of the state space fit points
+// of the given dimension. Spaces with only fixed-size parameters always do.
+template <typename StateSpace>
+bool state_space_consistent(const StateSpace &space, int dimensions) {
+  if constexpr (has_consistency_check<StateSpace>::value) {
+    return space.consistent(dimensions);
+  } else {
+    return true;
+  }
+}
+
 template <typename Scalar, int Dimensions = -1> struct RnL1 {
 
   using cref_t = const Eigen::Ref<const Eigen::Matrix<Scalar, Dimensions, 1>> &;
@@ -63,6 +98,17 @@ template <typename Scalar, int Dimensions = -1> struct RnL1 {
     use_weights = true;
   }
 
+  // Parameters, for KDTree::save and KDTree::load (see serialization.h).
+  template <typename Archive> void serialize(Archive &ar) {
+    ar(lb, ub, weights, use_weights);
+  }
+
+  bool consistent(int dimensions) const {
+    return (lb.size() == 0 || lb.size() == dimensions) &&
+           ub.size() == lb.size() &&
+           (!use_weights || weights.size() == dimensions);
+  }
+
   void print(std::ostream &out) {
     out << "State Space: RnL1" << " RuntimeDIM: " << lb.size()
         << " CompileTimeDIM: " << Dimensions << std::endl
@@ -145,6 +191,65 @@ template <typename Scalar, int Dimensions = -1> struct RnL1 {
     else
       return (x - y).cwiseAbs().sum();
   }
+
+  // Distances from x to n points stored dimension-major: coordinate d of
+  // point j is columns[d * stride + j]. Columns may use a narrower type T;
+  // the optional `scale` multiplies the difference in each dimension.
+  template <typename T = Scalar>
+  inline void distance_to_columns(const Scalar *x, int dims, const T *columns,
+                                  std::size_t stride, std::size_t n,
+                                  Scalar *out,
+                                  const Scalar *scale = nullptr) const {
+    simd::distance_to_columns<simd::Metric::L1>(
+        x, use_weights ? weights.data() : nullptr, scale, dims, columns,
+        stride, n, out);
+  }
+
+  // Same, for points stored point-major: coordinate d of point j is
+  // rows[j * stride + d]. Returns false if there is no vector kernel for
+  // this CPU; out is then left untouched.
+  inline bool distance_to_rows(const Scalar *x, int dims, const Scalar *rows,
+                               std::size_t stride, std::size_t n,
+                               Scalar *out) const {
+    return simd::distance_to_rows<simd::Metric::L1, Scalar>(
+        x, use_weights ? weights.data() : nullptr, nullptr, dims, rows, stride,
+        n, out);
+  }
+
+  // Bound on |distance(x, p) - distance(x, q)| for any x, given the
+  // per-dimension bounds error[d] >= |p[d] - q[d]|.
+  inline Scalar distance_error_bound(const Scalar *error, int dims) const {
+    Scalar bound = 0;
+    for (int d = 0; d < dims; d++) {
+      bound += error[d] * (use_weights ? weights(d) : 1.);
+    }
+    return bound;
+  }
+
+  // Upper bound on distance(x, q), given distance(x, p) and the bound above.
+  inline Scalar distance_upper_bound(Scalar distance, Scalar error) const {
+    return distance + error;
+  }
+
+  // Separable bound (see KDTree::setIncrementalBounds): the distance from x
+  // to a box is rectangle_bound() of the sums of rectangle_term() over the
+  // dimensions of each group. With rectangle_max_term() instead, the same
+  // sums bound the distance to the farthest point of the box.
+  int rectangle_groups() const { return 1; }
+  int rectangle_group(int) const { return 0; }
+
+  inline Scalar rectangle_term(int d, Scalar x, Scalar lo, Scalar hi) const {
+    Scalar dif = std::max(lo - x, x - hi);
+    return dif > 0 ? dif * (use_weights ? weights(d) : 1.) : 0;
+  }
+
+  inline Scalar rectangle_max_term(int d, Scalar x, Scalar lo,
+                                   Scalar hi) const {
+    Scalar dif = std::max(std::abs(x - lo), std::abs(hi - x));
+    return dif * (use_weights ? weights(d) : 1.);
+  }
+
+  inline Scalar rectangle_bound(const Scalar *sums) const { return sums[0]; }
 };
 
 template <typename Scalar> struct Time {
@@ -170,6 +275,8 @@ template <typename Scalar> struct Time {
     return true;
   }
 
+  template <typename Archive> void serialize(Archive &ar) { ar(lb, ub); }
+
   void print(std::ostream &out) {
     out << "Time: " << lb(0) << " " << ub(0) << std::endl;
   }
@@ -245,6 +352,10 @@ template <typename Scalar> struct SO2 {
     return true;
   }
 
+  template <typename Archive> void serialize(Archive &ar) {
+    ar(weight, use_weights);
+  }
+
   void print(std::ostream &out) {
     out << "SO2: " << std::endl
         << "weight: " << weight << std::endl
@@ -304,17 +415,24 @@ template <typename Scalar> struct SO2 {
     assert(ub(0) >= -M_PI);
     assert(ub(0) <= M_PI);
 
-    if (x(0) >= lb(0) && x(0) <= ub(0)) {
+    return rectangle_term(0, x(0), lb(0), ub(0));
+  }
+
+  int rectangle_groups() const { return 1; }
+  int rectangle_group(int) const { return 0; }
+
+  inline Scalar rectangle_term(int, Scalar x, Scalar lo, Scalar hi) const {
+    if (x >= lo && x <= hi) {
       return 0;
-    } else if (x(0) > ub(0)) {
-      Scalar d1 = x(0) - ub(0);
-      Scalar d2 = lb(0) - (x(0) - 2 * M_PI);
+    } else if (x > hi) {
+      Scalar d1 = x - hi;
+      Scalar d2 = lo - (x - 2 * M_PI);
       assert(d2 >= 0);
       assert(d1 >= 0);
       return std::min(d1, d2) * (use_weights ? weight : 1.);
-    } else if (x(0) < lb(0)) {
-      Scalar d1 = lb(0) - x(0);
-      Scalar d2 = (x(0) + 2 * M_PI) - ub(0);
+    } else if (x < lo) {
+      Scalar d1 = lo - x;
+      Scalar d2 = (x + 2 * M_PI) - hi;
       assert(d2 >= 0);
       assert(d1 >= 0);
       return std::min(d1, d2) * (use_weights ? weight : 1.);
@@ -324,6 +442,23 @@ template <typename Scalar> struct SO2 {
     }
   }
 
+  // The farthest angle of [lo, hi] is the antipode of x if it lies inside,
+  // else one of the ends.
+  inline Scalar rectangle_max_term(int, Scalar x, Scalar lo, Scalar hi) const {
+    Scalar antipode = x > 0 ? x - M_PI : x + M_PI;
+    Scalar d = M_PI;
+    if (antipode < lo || antipode > hi) {
+      auto angular = [](Scalar a, Scalar b) {
+        Scalar dif = std::abs(a - b);
+        return std::min(dif, 2 * M_PI - dif);
+      };
+      d = std::max(angular(x, lo), angular(x, hi));
+    }
+    return d * (use_weights ? weight : 1.);
+  }
+
+  inline Scalar rectangle_bound(const Scalar *sums) const { return sums[0]; }
+
   inline Scalar distance(cref_t x, cref_t y) const {
 
     assert(x(0) >= -M_PI);
@@ -353,6 +488,8 @@ template <typename Scalar> struct SO2Squared {
 
   SO2<Scalar> so2;
 
+  template <typename Archive> void serialize(Archive &ar) { ar(lb, ub, so2); }
+
   void print(std::ostream &out) { out << "SO2Squared: " << std::endl; }
 
   bool check_bounds(cref_t x) const {
@@ -393,6 +530,22 @@ template <typename Scalar> struct SO2Squared {
     return d * d;
   }
 
+  int rectangle_groups() const { return 1; }
+  int rectangle_group(int) const { return 0; }
+
+  inline Scalar rectangle_term(int d, Scalar x, Scalar lo, Scalar hi) const {
+    Scalar t = so2.rectangle_term(d, x, lo, hi);
+    return t * t;
+  }
+
+  inline Scalar rectangle_max_term(int d, Scalar x, Scalar lo,
+                                   Scalar hi) const {
+    Scalar t = so2.rectangle_max_term(d, x, lo, hi);
+    return t * t;
+  }
+
+  inline Scalar rectangle_bound(const Scalar *sums) const { return sums[0]; }
+
   inline Scalar distance(cref_t x, cref_t y) const {
 
     Scalar d = so2.distance(x, y);
@@ -411,6 +564,16 @@ template <typename Scalar, int Dimensions = -1> struct RnSquared {
   vec_t weights;
   bool use_weights = false;
 
+  template <typename Archive> void serialize(Archive &ar) {
+    ar(lb, ub, weights, use_weights);
+  }
+
+  bool consistent(int dimensions) const {
+    return (lb.size() == 0 || lb.size() == dimensions) &&
+           ub.size() == lb.size() &&
+           (!use_weights || weights.size() == dimensions);
+  }
+
   void print(std::ostream &out) {
     out << "State Space: RnSquared" << " RuntimeDIM: " << lb.size()
         << " CompileTimeDIM: " << Dimensions << std::endl
@@ -504,6 +667,64 @@ template <typename Scalar, int Dimensions = -1> struct RnSquared {
     else
       return (x - y).squaredNorm();
   }
+
+  // Squared distances from x to n points stored dimension-major: coordinate
+  // d of point j is columns[d * stride + j].
+  template <typename T = Scalar>
+  inline void distance_to_columns(const Scalar *x, int dims, const T *columns,
+                                  std::size_t stride, std::size_t n,
+                                  Scalar *out,
+                                  const Scalar *scale = nullptr) const {
+    simd::distance_to_columns<simd::Metric::L2Squared>(
+        x, use_weights ? weights.data() : nullptr, scale, dims, columns,
+        stride, n, out);
+  }
+
+  // Same, for points stored point-major: coordinate d of point j is
+  // rows[j * stride + d]. Returns false if there is no vector kernel for
+  // this CPU; out is then left untouched.
+  inline bool distance_to_rows(const Scalar *x, int dims, const Scalar *rows,
+                               std::size_t stride, std::size_t n,
+                               Scalar *out) const {
+    return simd::distance_to_rows<simd::Metric::L2Squared, Scalar>(
+        x, use_weights ? weights.data() : nullptr, nullptr, dims, rows, stride,
+        n, out);
+  }
+
+  // The squared distance is not a metric: the bound is on the squared
+  // distance between p and q, and triangle inequality is applied to roots.
+  inline Scalar distance_error_bound(const Scalar *error, int dims) const {
+    Scalar bound = 0;
+    for (int d = 0; d < dims; d++) {
+      Scalar e = error[d] * (use_weights ? weights(d) : 1.);
+      bound += e * e;
+    }
+    return bound;
+  }
+
+  inline Scalar distance_upper_bound(Scalar distance, Scalar error) const {
+    Scalar root = std::sqrt(distance) + std::sqrt(error);
+    return root * root;
+  }
+
+  int rectangle_groups() const { return 1; }
+  int rectangle_group(int) const { return 0; }
+
+  inline Scalar rectangle_term(int d, Scalar x, Scalar lo, Scalar hi) const {
+    Scalar dif = std::max(lo - x, x - hi);
+    if (dif <= 0) {
+      return 0;
+    }
+    return dif * dif * (use_weights ? weights(d) * weights(d) : 1.);
+  }
+
+  inline Scalar rectangle_max_term(int d, Scalar x, Scalar lo,
+                                   Scalar hi) const {
+    Scalar dif = std::max(std::abs(x - lo), std::abs(hi - x));
+    return dif * dif * (use_weights ? weights(d) * weights(d) : 1.);
+  }
+
+  inline Scalar rectangle_bound(const Scalar *sums) const { return sums[0]; }
 };
 
 template <typename Scalar, int Dimensions = -1> struct Rn {
@@ -518,6 +739,17 @@ template <typename Scalar, int Dimensions = -1> struct Rn {
   vec_t weights;
   bool use_weights = false;
 
+  template <typename Archive> void serialize(Archive &ar) {
+    ar(rn_squared, lb, ub, weights, use_weights);
+  }
+
+  bool consistent(int dimensions) const {
+    return rn_squared.consistent(dimensions) &&
+           (lb.size() == 0 || lb.size() == dimensions) &&
+           ub.size() == lb.size() &&
+           (!use_weights || weights.size() == dimensions);
+  }
+
   void print(std::ostream &out) {
     out << "State Space: Rn" << " RuntimeDIM: " << lb.size()
         << " CompileTimeDIM: " << Dimensions << std::endl
@@ -583,6 +815,48 @@ template <typename Scalar, int Dimensions = -1> struct Rn {
     Scalar d = rn_squared.distance(x, y);
     return std::sqrt(d);
   }
+
+  template <typename T = Scalar>
+  inline void distance_to_columns(const Scalar *x, int dims, const T *columns,
+                                  std::size_t stride, std::size_t n,
+                                  Scalar *out,
+                                  const Scalar *scale = nullptr) const {
+    simd::distance_to_columns<simd::Metric::L2>(
+        x, use_weights ? weights.data() : nullptr, scale, dims, columns,
+        stride, n, out);
+  }
+
+  inline bool distance_to_rows(const Scalar *x, int dims, const Scalar *rows,
+                               std::size_t stride, std::size_t n,
+                               Scalar *out) const {
+    return simd::distance_to_rows<simd::Metric::L2, Scalar>(
+        x, use_weights ? weights.data() : nullptr, nullptr, dims, rows, stride,
+        n, out);
+  }
+
+  inline Scalar distance_error_bound(const Scalar *error, int dims) const {
+    return std::sqrt(rn_squared.distance_error_bound(error, dims));
+  }
+
+  inline Scalar distance_upper_bound(Scalar distance, Scalar error) const {
+    return distance + error;
+  }
+
+  int rectangle_groups() const { return 1; }
+  int rectangle_group(int) const { return 0; }
+
+  inline Scalar rectangle_term(int d, Scalar x, Scalar lo, Scalar hi) const {
+    return rn_squared.rectangle_term(d, x, lo, hi);
+  }
+
+  inline Scalar rectangle_max_term(int d, Scalar x, Scalar lo,
+                                   Scalar hi) const {
+    return rn_squared.rectangle_max_term(d, x, lo, hi);
+  }
+
+  inline Scalar rectangle_bound(const Scalar *sums) const {
+    return std::sqrt(sums[0]);
+  }
 };
 
 struct Vpure {
@@ -710,6 +984,14 @@ template <typename Scalar, int Dimensions> struct RnTime {
     lambda_r = lambda_r_;
   }
 
+  template <typename Archive> void serialize(Archive &ar) {
+    ar(time, rn, lambda_t, lambda_r);
+  }
+
+  bool consistent(int dimensions) const {
+    return rn.consistent(dimensions - 1);
+  }
+
   void print(std::ostream &out) {
     out << "RnTime: " << std::endl;
     time.print(out);
@@ -830,6 +1112,10 @@ template <typename Scalar> struct R2SO2 {
   Rn<Scalar, 2> l2;
   SO2<Scalar> so2;
 
+  template <typename Archive> void serialize(Archive &ar) {
+    ar(angular_weight, l2, so2, weights, use_weights);
+  }
+
   void print(std::ostream &out) {
     out << "R2SO2: " << std::endl;
     l2.print(out);
@@ -901,6 +1187,10 @@ template <typename Scalar> struct R2SO2Squared {
   RnSquared<Scalar, 2> rn_squared;
   SO2Squared<Scalar> so2squared;
 
+  template <typename Archive> void serialize(Archive &ar) {
+    ar(angular_weight, rn_squared, so2squared);
+  }
+
   void print(std::ostream &out) {
     out << "R2SO2Squared: " << std::endl;
     rn_squared.print(out);
@@ -944,6 +1234,8 @@ template <typename Scalar> struct SO3Squared {
 
   bool check_bounds(cref_t x) const { return std::abs(x.norm() - 1) < 1e-6; }
 
+  template <typename Archive> void serialize(Archive &ar) { ar(rn_squared); }
+
   void print(std::ostream &out) {
     out << "SO3Squared: " << std::endl;
     rn_squared.print(out);
@@ -995,6 +1287,8 @@ template <typename Scalar> struct SO3 {
 
   SO3Squared<Scalar> so3squared;
 
+  template <typename Archive> void serialize(Archive &ar) { ar(so3squared); }
+
   void print(std::ostream &out) {
     out << "SO3: " << std::endl;
     so3squared.print(out);
@@ -1048,6 +1342,8 @@ template <typename Scalar> struct R3SO3Squared {
   RnSquared<Scalar, 3> l2;
   SO3Squared<Scalar> so3;
 
+  template <typename Archive> void serialize(Archive &ar) { ar(l2, so3); }
+
   void print(std::ostream &out) {
     out << "R3SO3Squared: " << std::endl;
     l2.print(out);
@@ -1101,6 +1397,8 @@ template <typename Scalar> struct R3SO3 {
   Rn<Scalar, 3> l2;
   SO3<Scalar> so3;
 
+  template <typename Archive> void serialize(Archive &ar) { ar(l2, so3); }
+
   void print(std::ostream &out) {
     out << "R3SO3: " << std::endl;
     l2.print(out);
@@ -1219,6 +1517,29 @@ template <typename Scalar> struct Combined {
     assert(spaces.size() == dims.size());
   }
 
+  template <typename Archive> void serialize(Archive &ar) {
+    ar(spaces, dims, weights, use_weights, spaces_names, lb, ub);
+  }
+
+  // The subspaces split the dimensions, and each fits its share.
+  bool consistent(int dimensions) const {
+    if (spaces.size() != dims.size() ||
+        (use_weights && weights.size() != dimensions)) {
+      return false;
+    }
+    int total = 0;
+    for (size_t i = 0; i < spaces.size(); i++) {
+      bool fits = std::visit(
+          [&](const auto &obj) { return state_space_consistent(obj, dims[i]); },
+          spaces[i]);
+      if (dims[i] <= 0 || !fits) {
+        return false;
+      }
+      total += dims[i];
+    }
+    return total == dimensions;
+  }
+
   void print(std::ostream &out) {
 
     out << "Combined: " << std::endl;
@@ -1418,5 +1739,83 @@ template <typename Scalar> struct Combined {
 
     return d;
   }
+
+  // Separable bound with one group per subspace. Only valid if separable().
+  bool separable() const {
+    for (const auto &s : spaces) {
+      if (!std::visit(
+              [](const auto &obj) {
+                return has_separable_bound<std::decay_t<decltype(obj)>,
+                                           Scalar>::value;
+              },
+              s))
+        return false;
+    }
+    return true;
+  }
+
+  int rectangle_groups() const { return spaces.size(); }
+
+  int rectangle_group(int d) const {
+    int i = 0;
+    while (d >= dims[i]) {
+      d -= dims[i++];
+    }
+    return i;
+  }
+
+  inline Scalar rectangle_term(int d, Scalar x, Scalar lo, Scalar hi) const {
+    int i = rectangle_group(d);
+    for (int j = 0; j < i; j++) {
+      d -= dims[j];
+    }
+    return std::visit(
+        [&](const auto &obj) -> Scalar {
+          using space_t = std::decay_t<decltype(obj)>;
+          if constexpr (has_separable_bound<space_t, Scalar>::value) {
+            return obj.rectangle_term(d, x, lo, hi);
+          } else {
+            return 0;
+          }
+        },
+        spaces[i]);
+  }
+
+  // Only meaningful if separable().
+  inline Scalar rectangle_max_term(int d, Scalar x, Scalar lo,
+                                   Scalar hi) const {
+    int i = rectangle_group(d);
+    for (int j = 0; j < i; j++) {
+      d -= dims[j];
+    }
+    return std::visit(
+        [&](const auto &obj) -> Scalar {
+          using space_t = std::decay_t<decltype(obj)>;
+          if constexpr (has_separable_bound<space_t, Scalar>::value) {
+            return obj.rectangle_max_term(d, x, lo, hi);
+          } else {
+            return std::numeric_limits<Scalar>::infinity();
+          }
+        },
+        spaces[i]);
+  }
+
+  inline Scalar rectangle_bound(const Scalar *sums) const {
+    Scalar d = 0;
+    for (size_t i = 0; i < spaces.size(); i++) {
+      d += std::visit(
+          [&](const auto &obj) -> Scalar {
+            using space_t = std::decay_t<decltype(obj)>;
+            if constexpr (has_separable_bound<space_t, Scalar>::value) {
+              return obj.rectangle_bound(sums + i);
+            } else {
+              return 0;
+            }
+          },
+          spaces[i]);
+    }
+    return d;
+  }
 };
+
 } // namespace dynotree
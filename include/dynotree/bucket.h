@@ -0,0 +1,817 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <limits>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include <eigen3/Eigen/Core>
+
+namespace dynotree {
+
+// Memory layout of the points held in the leaves of a KDTree.
+enum class LeafLayout {
+  AoS,     /// one (point, id, active) record per point
+  SoA,     /// dimension-major coordinates; ids and flags in separate arrays
+  Float32, /// as SoA, with float coordinates and an exact copy for rescoring
+  Int16    /// as SoA, with coordinates quantized to 16 bits within the bucket
+           /// bounds and an exact copy for rescoring
+};
+
+// True if StateSpace can compute the distances from a query to a
+// dimension-major block of points (see RnSquared::distance_to_columns).
+template <typename StateSpace, typename Scalar, typename = void>
+struct has_column_distance : std::false_type {};
+
+template <typename StateSpace, typename Scalar>
+struct has_column_distance<
+    StateSpace, Scalar,
+    std::void_t<decltype(std::declval<const StateSpace &>().distance_to_columns(
+        std::declval<const Scalar *>(), int(), std::declval<const Scalar *>(),
+        std::size_t(), std::size_t(), std::declval<Scalar *>()))>>
+    : std::true_type {};
+
+// Same, for a point-major block (see RnSquared::distance_to_rows).
+template <typename StateSpace, typename Scalar, typename = void>
+struct has_row_distance : std::false_type {};
+
+template <typename StateSpace, typename Scalar>
+struct has_row_distance<
+    StateSpace, Scalar,
+    std::void_t<decltype(std::declval<const StateSpace &>().distance_to_rows(
+        std::declval<const Scalar *>(), int(), std::declval<const Scalar *>(),
+        std::size_t(), std::size_t(), std::declval<Scalar *>()))>>
+    : std::true_type {};
+
+// Calls the fn of a scan on point i. fn may return void, or a bool that is
+// false to end the scan. Returns false if the scan must stop.
+template <typename Fn, typename Scalar>
+inline bool scanVisit(Fn &fn, std::size_t i, Scalar distance) {
+  if constexpr (std::is_void_v<decltype(fn(i, distance))>) {
+    fn(i, distance);
+    return true;
+  } else {
+    return fn(i, distance);
+  }
+}
+
+// Leaf storage as an array of PointId records.
+template <typename PointId, typename Scalar, int Dimensions> class AosBucket {
+public:
+  using point_t = Eigen::Matrix<Scalar, Dimensions, 1>;
+  using id_t = decltype(PointId::id);
+
+  // Distances are computed in chunks of this many points.
+  static constexpr std::size_t scanChunk = 64;
+
+  std::size_t size() const { return m_points.size(); }
+  std::size_t capacity() const { return m_points.capacity(); }
+  void reserve(std::size_t capacity) { m_points.reserve(capacity); }
+  void clear() { m_points.clear(); }
+
+  void push_back(const PointId &lp) { m_points.push_back(lp); }
+  void push_back(PointId &&lp) { m_points.push_back(std::move(lp)); }
+
+  // Copies point i of `other`.
+  void append(const AosBucket &other, std::size_t i) {
+    m_points.push_back(other.m_points[i]);
+  }
+
+  // Removes point i; the last point takes its place.
+  void erase(std::size_t i) {
+    m_points[i] = std::move(m_points.back());
+    m_points.pop_back();
+  }
+
+  // Overwrites the coordinates of point i.
+  void setPoint(std::size_t i, const point_t &x) { m_points[i].x = x; }
+
+  const point_t &point(std::size_t i) const { return m_points[i].x; }
+  Scalar coord(std::size_t i, int d) const { return m_points[i].x[d]; }
+  const id_t &id(std::size_t i) const { return m_points[i].id; }
+  bool active(std::size_t i) const { return m_points[i].active; }
+  void setActive(std::size_t i, bool active) { m_points[i].active = active; }
+  const PointId &pointId(std::size_t i) const { return m_points[i]; }
+
+  // Moves all points to `out` (previous content of `out` is dropped).
+  void takePoints(std::vector<PointId> &out) {
+    out.clear();
+    std::swap(out, m_points);
+  }
+
+  // Calls fn(i, distance(x, point(i))) for every point, until fn returns
+  // false (see scanVisit). Points farther than limit() may be skipped (this
+  // layout never skips). If the state space has a vectorized row kernel, the
+  // bucket is processed a chunk at a time, reading the coordinates in place
+  // across the records.
+  template <typename StateSpace, typename Limit, typename Fn>
+  void scan(const point_t &x, const StateSpace &state_space, Limit &&,
+            Fn &&fn) const {
+    std::size_t i = 0;
+    if constexpr (has_row_distance<StateSpace, Scalar>::value &&
+                  sizeof(PointId) % sizeof(Scalar) == 0) {
+      Scalar distances[scanChunk];
+      for (; i < size(); i += scanChunk) {
+        std::size_t n = std::min(scanChunk, size() - i);
+        if (!state_space.distance_to_rows(x.data(), x.size(),
+                                          m_points[i].x.data(),
+                                          sizeof(PointId) / sizeof(Scalar), n,
+                                          distances)) {
+          break; // no kernel on this CPU
+        }
+        for (std::size_t j = 0; j < n; j++) {
+          if (!scanVisit(fn, i + j, distances[j])) {
+            return;
+          }
+        }
+      }
+    }
+    for (; i < size(); i++) {
+      if (!scanVisit(fn, i, state_space.distance(x, m_points[i].x))) {
+        return;
+      }
+    }
+  }
+
+  // Heap memory of the bucket: allocated, and used by its points.
+  std::size_t allocatedBytes() const {
+    return m_points.capacity() * sizeof(PointId);
+  }
+  std::size_t usedBytes() const { return size() * sizeof(PointId); }
+
+  // Releases the capacity beyond size().
+  void shrink() { m_points.shrink_to_fit(); }
+
+  // Contents, for KDTree::save and KDTree::load.
+  template <typename Archive> void serialize(Archive &ar) { ar(m_points); }
+
+  // True if the arrays agree with each other and with the dimension of the
+  // tree (checked after KDTree::load). Records have a fixed size here.
+  bool consistent(int) const { return true; }
+
+private:
+  std::vector<PointId> m_points;
+};
+
+// With a runtime dimension, a PointId record would own a heap vector per
+// point. Instead the coordinates are kept point-major in one array, so a
+// scan reads the bucket contiguously as it does for fixed dimensions.
+template <typename PointId, typename Scalar>
+class AosBucket<PointId, Scalar, Eigen::Dynamic> {
+public:
+  using point_t = Eigen::Matrix<Scalar, Eigen::Dynamic, 1>;
+  using id_t = decltype(PointId::id);
+  static constexpr std::size_t scanChunk = 64;
+
+  std::size_t size() const { return m_ids.size(); }
+  std::size_t capacity() const { return m_ids.capacity(); }
+  void reserve(std::size_t capacity) {
+    m_coords.reserve(m_dimensions * capacity);
+    m_ids.reserve(capacity);
+    m_active.reserve(capacity);
+    m_capacity = std::max(m_capacity, capacity);
+  }
+  void clear() {
+    m_coords.clear();
+    m_ids.clear();
+    m_active.clear();
+  }
+
+  void push_back(const PointId &lp) {
+    if (m_dimensions == 0) {
+      // first point: the dimension is known from now on
+      m_dimensions = lp.x.size();
+      m_coords.reserve(m_dimensions * m_capacity);
+    }
+    m_coords.insert(m_coords.end(), lp.x.data(), lp.x.data() + m_dimensions);
+    m_ids.push_back(lp.id);
+    m_active.push_back(lp.active);
+  }
+
+  void append(const AosBucket &other, std::size_t i) {
+    if (m_dimensions == 0) {
+      m_dimensions = other.m_dimensions;
+      m_coords.reserve(m_dimensions * m_capacity);
+    }
+    auto first = other.m_coords.begin() + i * m_dimensions;
+    m_coords.insert(m_coords.end(), first, first + m_dimensions);
+    m_ids.push_back(other.m_ids[i]);
+    m_active.push_back(other.m_active[i]);
+  }
+
+  void erase(std::size_t i) {
+    std::size_t last = size() - 1;
+    std::copy_n(m_coords.begin() + last * m_dimensions, m_dimensions,
+                m_coords.begin() + i * m_dimensions);
+    m_coords.resize(last * m_dimensions);
+    m_ids[i] = std::move(m_ids[last]);
+    m_ids.pop_back();
+    m_active[i] = m_active[last];
+    m_active.pop_back();
+  }
+
+  void setPoint(std::size_t i, const point_t &x) {
+    std::copy_n(x.data(), m_dimensions, m_coords.begin() + i * m_dimensions);
+  }
+
+  Eigen::Map<const point_t> point(std::size_t i) const {
+    return Eigen::Map<const point_t>(m_coords.data() + i * m_dimensions,
+                                     m_dimensions);
+  }
+  Scalar coord(std::size_t i, int d) const {
+    return m_coords[i * m_dimensions + d];
+  }
+  const id_t &id(std::size_t i) const { return m_ids[i]; }
+  bool active(std::size_t i) const { return m_active[i]; }
+  void setActive(std::size_t i, bool active) { m_active[i] = active; }
+  PointId pointId(std::size_t i) const {
+    return PointId{point(i), m_ids[i], bool(m_active[i])};
+  }
+
+  void takePoints(std::vector<PointId> &out) {
+    out.clear();
+    out.reserve(size());
+    for (std::size_t i = 0; i < size(); i++) {
+      out.push_back(pointId(i));
+    }
+    clear();
+  }
+
+  template <typename StateSpace, typename Limit, typename Fn>
+  void scan(const point_t &x, const StateSpace &state_space, Limit &&,
+            Fn &&fn) const {
+    std::size_t i = 0;
+    if constexpr (has_row_distance<StateSpace, Scalar>::value) {
+      Scalar distances[scanChunk];
+      for (; i < size(); i += scanChunk) {
+        std::size_t n = std::min(scanChunk, size() - i);
+        if (!state_space.distance_to_rows(x.data(), m_dimensions,
+                                          m_coords.data() + i * m_dimensions,
+                                          m_dimensions, n, distances)) {
+          break;
+        }
+        for (std::size_t j = 0; j < n; j++) {
+          if (!scanVisit(fn, i + j, distances[j])) {
+            return;
+          }
+        }
+      }
+    }
+    for (; i < size(); i++) {
+      if (!scanVisit(fn, i, state_space.distance(x, point(i)))) {
+        return;
+      }
+    }
+  }
+
+  std::size_t allocatedBytes() const {
+    return m_coords.capacity() * sizeof(Scalar) +
+           m_ids.capacity() * sizeof(id_t) + m_active.capacity();
+  }
+  std::size_t usedBytes() const {
+    return size() * (m_dimensions * sizeof(Scalar) + sizeof(id_t) + 1);
+  }
+
+  void shrink() {
+    m_coords.shrink_to_fit();
+    m_ids.shrink_to_fit();
+    m_active.shrink_to_fit();
+    m_capacity = size();
+  }
+
+  template <typename Archive> void serialize(Archive &ar) {
+    ar(m_dimensions, m_capacity, m_coords, m_ids, m_active);
+  }
+
+  bool consistent(int dimensions) const {
+    return (m_dimensions == dimensions ||
+            (m_dimensions == 0 && size() == 0)) &&
+           m_coords.size() == std::size_t(m_dimensions) * size() &&
+           m_active.size() == size();
+  }
+
+private:
+  int m_dimensions = 0;
+  std::size_t m_capacity = 0; /// requested capacity, in points
+  std::vector<Scalar> m_coords;
+  std::vector<id_t> m_ids;
+  std::vector<std::uint8_t> m_active;
+};
+
+// Leaf storage as a structure of arrays: coordinate d of point i is
+// m_coords[d * m_capacity + i], so each dimension is a contiguous column
+// that distance kernels can stream.
+template <typename PointId, typename Scalar, int Dimensions> class SoaBucket {
+public:
+  using point_t = Eigen::Matrix<Scalar, Dimensions, 1>;
+  using id_t = decltype(PointId::id);
+
+  // Distances are computed in chunks of this many points.
+  static constexpr std::size_t scanChunk = 64;
+
+  std::size_t size() const { return m_ids.size(); }
+  std::size_t capacity() const { return m_capacity; }
+
+  void reserve(std::size_t capacity) {
+    if (capacity > m_capacity) {
+      setCapacity(capacity);
+    }
+  }
+
+  void clear() {
+    m_ids.clear();
+    m_active.clear();
+  }
+
+  void push_back(const PointId &lp) {
+    if constexpr (Dimensions == Eigen::Dynamic) {
+      if (m_dimensions == 0) {
+        // first point: the dimension is known from now on
+        m_dimensions = lp.x.size();
+        m_coords.resize(m_dimensions * m_capacity);
+      }
+    }
+    if (size() == m_capacity) {
+      reserve(std::max<std::size_t>(2 * m_capacity, 8));
+    }
+    std::size_t i = size();
+    for (int d = 0; d < dimensions(); d++) {
+      m_coords[d * m_capacity + i] = lp.x[d];
+    }
+    m_ids.push_back(lp.id);
+    m_active.push_back(lp.active);
+  }
+
+  void append(const SoaBucket &other, std::size_t i) {
+    push_back(other.pointId(i));
+  }
+
+  void erase(std::size_t i) {
+    std::size_t last = size() - 1;
+    for (int d = 0; d < dimensions(); d++) {
+      m_coords[d * m_capacity + i] = m_coords[d * m_capacity + last];
+    }
+    m_ids[i] = std::move(m_ids[last]);
+    m_ids.pop_back();
+    m_active[i] = m_active[last];
+    m_active.pop_back();
+  }
+
+  void setPoint(std::size_t i, const point_t &x) {
+    for (int d = 0; d < dimensions(); d++) {
+      m_coords[d * m_capacity + i] = x[d];
+    }
+  }
+
+  point_t point(std::size_t i) const {
+    point_t x(dimensions());
+    for (int d = 0; d < dimensions(); d++) {
+      x[d] = m_coords[d * m_capacity + i];
+    }
+    return x;
+  }
+  Scalar coord(std::size_t i, int d) const {
+    return m_coords[d * m_capacity + i];
+  }
+  const id_t &id(std::size_t i) const { return m_ids[i]; }
+  bool active(std::size_t i) const { return m_active[i]; }
+  void setActive(std::size_t i, bool active) { m_active[i] = active; }
+  PointId pointId(std::size_t i) const {
+    return PointId{point(i), m_ids[i], bool(m_active[i])};
+  }
+
+  // Moves all points to `out` (previous content of `out` is dropped).
+  void takePoints(std::vector<PointId> &out) {
+    out.clear();
+    out.reserve(size());
+    for (std::size_t i = 0; i < size(); i++) {
+      out.push_back(pointId(i));
+    }
+    clear();
+  }
+
+  // Calls fn(i, distance(x, point(i))) for every point, until fn returns
+  // false. State spaces with a column kernel process the bucket a chunk at a
+  // time, streaming over each coordinate column.
+  template <typename StateSpace, typename Limit, typename Fn>
+  void scan(const point_t &x, const StateSpace &state_space, Limit &&,
+            Fn &&fn) const {
+    if constexpr (has_column_distance<StateSpace, Scalar>::value) {
+      Scalar distances[scanChunk];
+      for (std::size_t begin = 0; begin < size(); begin += scanChunk) {
+        std::size_t n = std::min(scanChunk, size() - begin);
+        state_space.distance_to_columns(x.data(), dimensions(),
+                                        m_coords.data() + begin, m_capacity, n,
+                                        distances);
+        for (std::size_t j = 0; j < n; j++) {
+          if (!scanVisit(fn, begin + j, distances[j])) {
+            return;
+          }
+        }
+      }
+    } else {
+      point_t y(dimensions());
+      for (std::size_t i = 0; i < size(); i++) {
+        for (int d = 0; d < dimensions(); d++) {
+          y[d] = m_coords[d * m_capacity + i];
+        }
+        if (!scanVisit(fn, i, state_space.distance(x, y))) {
+          return;
+        }
+      }
+    }
+  }
+
+  std::size_t allocatedBytes() const {
+    return m_coords.capacity() * sizeof(Scalar) +
+           m_ids.capacity() * sizeof(id_t) + m_active.capacity();
+  }
+  std::size_t usedBytes() const {
+    return size() * (dimensions() * sizeof(Scalar) + sizeof(id_t) + 1);
+  }
+
+  void shrink() {
+    setCapacity(size());
+    m_ids.shrink_to_fit();
+    m_active.shrink_to_fit();
+  }
+
+  template <typename Archive> void serialize(Archive &ar) {
+    ar(m_dimensions, m_capacity, m_coords, m_ids, m_active);
+  }
+
+  bool consistent(int dimensions) const {
+    return (this->dimensions() == dimensions ||
+            (m_dimensions == 0 && size() == 0)) &&
+           size() <= m_capacity && m_active.size() == size() &&
+           m_coords.size() == std::size_t(this->dimensions()) * m_capacity;
+  }
+
+private:
+  // Moves the columns to a block with room for `capacity` points.
+  void setCapacity(std::size_t capacity) {
+    if (dimensions() > 0) {
+      std::vector<Scalar> coords(dimensions() * capacity);
+      for (int d = 0; d < dimensions(); d++) {
+        std::copy_n(m_coords.begin() + d * m_capacity, size(),
+                    coords.begin() + d * capacity);
+      }
+      std::swap(m_coords, coords);
+    }
+    m_capacity = capacity;
+    m_ids.reserve(capacity);
+    m_active.reserve(capacity);
+  }
+
+  int dimensions() const {
+    if constexpr (Dimensions == Eigen::Dynamic) {
+      return m_dimensions;
+    } else {
+      return Dimensions;
+    }
+  }
+
+  int m_dimensions = 0; /// only used if Dimensions is dynamic
+  std::size_t m_capacity = 0;
+  std::vector<Scalar> m_coords;
+  std::vector<id_t> m_ids;
+  std::vector<std::uint8_t> m_active;
+};
+
+// Leaf storage with compressed coordinates: as SoaBucket, but the hot
+// coordinate block uses Storage (float, or int16_t quantized to the bounds
+// of the bucket). Scans compute approximate distances from the compressed
+// block; a point can only be within limit() if its approximate distance is
+// below distance_upper_bound(limit(), compression error). Those points are
+// rescored against the exact, point-major copy, which is not touched
+// otherwise. Requires a state space with a column kernel and error bounds
+// (Rn, RnSquared, RnL1).
+template <typename PointId, typename Scalar, int Dimensions, typename Storage>
+class CompressedBucket {
+public:
+  using point_t = Eigen::Matrix<Scalar, Dimensions, 1>;
+  using id_t = decltype(PointId::id);
+
+  static constexpr std::size_t scanChunk = 64;
+  static constexpr bool quantized = std::is_integral_v<Storage>;
+
+  std::size_t size() const { return m_ids.size(); }
+  std::size_t capacity() const { return m_capacity; }
+
+  void reserve(std::size_t capacity) {
+    if (capacity > m_capacity) {
+      setCapacity(capacity);
+    }
+  }
+
+  void clear() {
+    m_ids.clear();
+    m_active.clear();
+    m_exact.clear();
+    std::fill(m_error.begin(), m_error.end(), Scalar(0));
+  }
+
+  void push_back(const PointId &lp) {
+    if (m_error.empty()) {
+      // first point: the dimension is known from now on
+      if constexpr (Dimensions == Eigen::Dynamic) {
+        m_dimensions = lp.x.size();
+      }
+      m_coords.resize(dimensions() * m_capacity);
+      m_error.assign(dimensions(), Scalar(0));
+      m_origin.resize(dimensions());
+      m_scale.resize(dimensions());
+    }
+    if constexpr (quantized) {
+      if (size() == 0) {
+        m_lb = lp.x;
+        m_ub = lp.x;
+        updateFrame();
+      }
+    }
+    if (size() == m_capacity) {
+      reserve(std::max<std::size_t>(2 * m_capacity, 8));
+    }
+    m_exact.insert(m_exact.end(), lp.x.data(), lp.x.data() + dimensions());
+    m_ids.push_back(lp.id);
+    m_active.push_back(lp.active);
+
+    if constexpr (quantized) {
+      if (!fitsFrame(lp.x)) {
+        requantize(lp.x);
+        return;
+      }
+    }
+    compress(size() - 1);
+  }
+
+  void append(const CompressedBucket &other, std::size_t i) {
+    push_back(other.pointId(i));
+  }
+
+  // The compression error and frame are kept: they remain valid bounds.
+  void erase(std::size_t i) {
+    std::size_t last = size() - 1;
+    for (int d = 0; d < dimensions(); d++) {
+      m_coords[d * m_capacity + i] = m_coords[d * m_capacity + last];
+    }
+    std::copy_n(m_exact.begin() + last * dimensions(), dimensions(),
+                m_exact.begin() + i * dimensions());
+    m_exact.resize(last * dimensions());
+    m_ids[i] = std::move(m_ids[last]);
+    m_ids.pop_back();
+    m_active[i] = m_active[last];
+    m_active.pop_back();
+  }
+
+  void setPoint(std::size_t i, const point_t &x) {
+    std::copy_n(x.data(), dimensions(), m_exact.begin() + i * dimensions());
+    if constexpr (quantized) {
+      if (!fitsFrame(x)) {
+        requantize(x);
+        return;
+      }
+    }
+    compress(i);
+  }
+
+  point_t point(std::size_t i) const {
+    return Eigen::Map<const point_t>(m_exact.data() + i * dimensions(),
+                                     dimensions());
+  }
+  Scalar coord(std::size_t i, int d) const {
+    return m_exact[i * dimensions() + d];
+  }
+  const id_t &id(std::size_t i) const { return m_ids[i]; }
+  bool active(std::size_t i) const { return m_active[i]; }
+  void setActive(std::size_t i, bool active) { m_active[i] = active; }
+  PointId pointId(std::size_t i) const {
+    return PointId{point(i), m_ids[i], bool(m_active[i])};
+  }
+
+  void takePoints(std::vector<PointId> &out) {
+    out.clear();
+    out.reserve(size());
+    for (std::size_t i = 0; i < size(); i++) {
+      out.push_back(pointId(i));
+    }
+    clear();
+  }
+
+  template <typename StateSpace, typename Limit, typename Fn>
+  void scan(const point_t &x, const StateSpace &state_space, Limit &&limit,
+            Fn &&fn) const {
+    static_assert(has_column_distance<StateSpace, Scalar>::value,
+                  "compressed leaves need a state space with a column kernel");
+    if (size() == 0) {
+      return;
+    }
+    Scalar error = state_space.distance_error_bound(m_error.data(),
+                                                    dimensions());
+
+    // quantized coordinates are compared in the frame of the bucket
+    static thread_local std::vector<Scalar> query;
+    const Scalar *q = x.data();
+    const Scalar *scale = nullptr;
+    if constexpr (quantized) {
+      query.resize(dimensions());
+      for (int d = 0; d < dimensions(); d++) {
+        query[d] = (x[d] - m_origin[d]) / m_scale[d] - offset;
+      }
+      q = query.data();
+      scale = m_scale.data();
+    }
+
+    Scalar distances[scanChunk];
+    Scalar lastLimit = std::numeric_limits<Scalar>::quiet_NaN();
+    Scalar threshold = 0;
+    for (std::size_t begin = 0; begin < size(); begin += scanChunk) {
+      std::size_t n = std::min(scanChunk, size() - begin);
+      state_space.distance_to_columns(q, dimensions(),
+                                      m_coords.data() + begin, m_capacity, n,
+                                      distances, scale);
+      for (std::size_t j = 0; j < n; j++) {
+        Scalar currentLimit = limit();
+        if (currentLimit != lastLimit) {
+          // the slack covers rounding in the approximate distance
+          threshold = state_space.distance_upper_bound(currentLimit, error) *
+                      (1 + Scalar(1e-9));
+          lastLimit = currentLimit;
+        }
+        if (distances[j] < threshold) {
+          std::size_t i = begin + j;
+          if (!scanVisit(fn, i, exactDistance(x, state_space, i))) {
+            return;
+          }
+        }
+      }
+    }
+  }
+
+  std::size_t allocatedBytes() const {
+    return m_coords.capacity() * sizeof(Storage) +
+           (m_exact.capacity() + frameSize()) * sizeof(Scalar) +
+           m_ids.capacity() * sizeof(id_t) + m_active.capacity();
+  }
+  std::size_t usedBytes() const {
+    return size() * (dimensions() * (sizeof(Storage) + sizeof(Scalar)) +
+                     sizeof(id_t) + 1) +
+           frameSize() * sizeof(Scalar);
+  }
+
+  void shrink() {
+    setCapacity(size());
+    m_exact.shrink_to_fit();
+    m_ids.shrink_to_fit();
+    m_active.shrink_to_fit();
+  }
+
+  template <typename Archive> void serialize(Archive &ar) {
+    ar(m_dimensions, m_capacity, m_coords, m_exact, m_ids, m_active, m_error,
+       m_lb, m_ub, m_origin, m_scale);
+  }
+
+  // The error and frame arrays are allocated with the first point.
+  bool consistent(int dimensions) const {
+    std::size_t d = this->dimensions();
+    bool frame = m_error.empty()
+                     ? size() == 0
+                     : m_error.size() == d && m_origin.size() == d &&
+                           m_scale.size() == d &&
+                           (!quantized ||
+                            (std::size_t(m_lb.size()) == d &&
+                             std::size_t(m_ub.size()) == d));
+    return (this->dimensions() == dimensions ||
+            (m_dimensions == 0 && m_error.empty())) &&
+           frame && size() <= m_capacity && m_active.size() == size() &&
+           m_exact.size() == d * size() && m_coords.size() == d * m_capacity;
+  }
+
+private:
+  void setCapacity(std::size_t capacity) {
+    if (dimensions() > 0) {
+      std::vector<Storage> coords(dimensions() * capacity);
+      for (int d = 0; d < dimensions(); d++) {
+        std::copy_n(m_coords.begin() + d * m_capacity, size(),
+                    coords.begin() + d * capacity);
+      }
+      std::swap(m_coords, coords);
+      m_exact.reserve(dimensions() * capacity);
+    }
+    m_capacity = capacity;
+    m_ids.reserve(capacity);
+    m_active.reserve(capacity);
+  }
+
+  // Distance from x to the exact copy of point i, computed as an AoS leaf
+  // computes it, so that both layouts return the same values.
+  template <typename StateSpace>
+  Scalar exactDistance(const point_t &x, const StateSpace &state_space,
+                       std::size_t i) const {
+    const Scalar *row = m_exact.data() + i * dimensions();
+    if constexpr (has_row_distance<StateSpace, Scalar>::value) {
+      Scalar distance;
+      if (state_space.distance_to_rows(x.data(), dimensions(), row,
+                                        dimensions(), 1, &distance)) {
+        return distance;
+      }
+    }
+    return state_space.distance(
+        x, Eigen::Map<const point_t>(row, dimensions()));
+  }
+
+  // Scalars of the error bounds and of the quantization frame.
+  std::size_t frameSize() const {
+    return m_error.capacity() + m_origin.capacity() + m_scale.capacity();
+  }
+
+  // int16 values are stored with this offset, to use the full range
+  static constexpr Scalar offset = 32768;
+
+  int dimensions() const {
+    if constexpr (Dimensions == Eigen::Dynamic) {
+      return m_dimensions;
+    } else {
+      return Dimensions;
+    }
+  }
+
+  bool fitsFrame(const point_t &x) const {
+    return !((x.array() < m_lb.array()).any() ||
+             (x.array() > m_ub.array()).any());
+  }
+
+  // Grows the frame to contain x and compresses every point again.
+  void requantize(const point_t &x) {
+    m_lb = m_lb.cwiseMin(x);
+    m_ub = m_ub.cwiseMax(x);
+    updateFrame();
+    std::fill(m_error.begin(), m_error.end(), Scalar(0));
+    for (std::size_t i = 0; i < size(); i++) {
+      compress(i);
+    }
+  }
+
+  void updateFrame() {
+    for (int d = 0; d < dimensions(); d++) {
+      m_origin[d] = m_lb[d];
+      m_scale[d] = m_ub[d] > m_lb[d] ? (m_ub[d] - m_lb[d]) / 65535 : 1;
+    }
+  }
+
+  // Writes the compressed coordinates of point i and updates the error.
+  void compress(std::size_t i) {
+    for (int d = 0; d < dimensions(); d++) {
+      Scalar value = m_exact[i * dimensions() + d];
+      Scalar decoded;
+      if constexpr (quantized) {
+        Scalar level = std::round((value - m_origin[d]) / m_scale[d]);
+        level = std::min(std::max(level, Scalar(0)), Scalar(65535));
+        m_coords[d * m_capacity + i] = Storage(level - offset);
+        decoded = m_origin[d] + level * m_scale[d];
+      } else {
+        m_coords[d * m_capacity + i] = Storage(value);
+        decoded = Scalar(Storage(value));
+      }
+      m_error[d] = std::max(m_error[d], std::abs(value - decoded));
+    }
+  }
+
+  int m_dimensions = 0; /// only used if Dimensions is dynamic
+  std::size_t m_capacity = 0;
+  std::vector<Storage> m_coords; /// hot: dimension-major, compressed
+  std::vector<Scalar> m_exact;   /// cold: point-major, exact
+  std::vector<id_t> m_ids;
+  std::vector<std::uint8_t> m_active;
+  std::vector<Scalar> m_error; /// max compression error in each dimension
+
+  // quantization frame (int16 only): value = origin + (q + offset) * scale.
+  // Zero until set, so that save() never writes indeterminate bytes.
+  point_t m_lb = point_t::Zero(std::max(Dimensions, 0));
+  point_t m_ub = point_t::Zero(std::max(Dimensions, 0));
+  std::vector<Scalar> m_origin, m_scale;
+};
+
+template <LeafLayout Layout, typename PointId, typename Scalar, int Dimensions>
+struct leaf_bucket {
+  using type = AosBucket<PointId, Scalar, Dimensions>;
+};
+
+template <typename PointId, typename Scalar, int Dimensions>
+struct leaf_bucket<LeafLayout::SoA, PointId, Scalar, Dimensions> {
+  using type = SoaBucket<PointId, Scalar, Dimensions>;
+};
+
+template <typename PointId, typename Scalar, int Dimensions>
+struct leaf_bucket<LeafLayout::Float32, PointId, Scalar, Dimensions> {
+  using type = CompressedBucket<PointId, Scalar, Dimensions, float>;
+};
+
+template <typename PointId, typename Scalar, int Dimensions>
+struct leaf_bucket<LeafLayout::Int16, PointId, Scalar, Dimensions> {
+  using type = CompressedBucket<PointId, Scalar, Dimensions, std::int16_t>;
+};
+
+} // namespace dynotree
@@ -0,0 +1,288 @@
+#pragma once
+
+#include <atomic>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+#include "KDTree.h"
+
+namespace dynotree {
+
+// Test-and-set lock for short critical sections. Yields instead of burning
+// the core while waiting, so it stays usable with more threads than cores.
+class SpinLock {
+public:
+  void lock() {
+    while (m_flag.test_and_set(std::memory_order_acquire)) {
+      std::this_thread::yield();
+    }
+  }
+  void unlock() { m_flag.clear(std::memory_order_release); }
+
+private:
+  std::atomic_flag m_flag = ATOMIC_FLAG_INIT;
+};
+
+// Kd-tree that supports addPoint and queries from many threads at once.
+//
+// Nodes live in a deque and are linked by pointer, so they never move.
+// Inner nodes are immutable once published: a leaf becomes an inner node
+// by filling in its split and children and then storing its left child
+// with release semantics. Bounding boxes only grow, through atomic
+// min / max per coordinate, and are expanded on the way down before the
+// point is added, so a point visible in a leaf is always inside the boxes
+// above it. The bucket of a leaf is guarded by a per-leaf spin lock, held
+// by addPoint (and split) and while a query scans it.
+//
+// Splits follow the median rule of KDTree::split. Queries running
+// concurrently with an insertion may or may not see the new point.
+template <class Id, int Dimensions, std::size_t BucketSize = 32,
+          typename Scalar = double,
+          typename StateSpace = Rn<Scalar, Dimensions>>
+class ConcurrentKDTree {
+public:
+  using scalar_t = Scalar;
+  using id_t = Id;
+  using point_t = Eigen::Matrix<Scalar, Dimensions, 1>;
+  using cref_t = const Eigen::Ref<const Eigen::Matrix<Scalar, Dimensions, 1>> &;
+  using ref_t = Eigen::Ref<Eigen::Matrix<Scalar, Dimensions, 1>>;
+  using state_space_t = StateSpace;
+  using DistanceId = typename KDTree<Id, Dimensions, BucketSize, Scalar,
+                                     StateSpace>::DistanceId;
+  int m_dimensions = Dimensions;
+
+  StateSpace &getStateSpace() { return state_space; }
+
+  ConcurrentKDTree() = default;
+  ConcurrentKDTree(const ConcurrentKDTree &) = delete;
+  ConcurrentKDTree &operator=(const ConcurrentKDTree &) = delete;
+
+  // Not thread-safe, call before any other method.
+  void init_tree(int runtime_dimension = -1,
+                 const StateSpace &t_state_space = StateSpace()) {
+    state_space = t_state_space;
+    if constexpr (Dimensions == Eigen::Dynamic) {
+      assert(runtime_dimension > 0);
+      m_dimensions = runtime_dimension;
+    }
+    m_nodes.clear();
+    m_root = &m_nodes.emplace_back(m_dimensions);
+    m_size = 0;
+  }
+
+  size_t size() const { return m_size.load(std::memory_order_relaxed); }
+
+  std::size_t numNodes() const {
+    std::lock_guard<std::mutex> lock(m_allocMutex);
+    return m_nodes.size();
+  }
+
+  // Thread-safe. Locks only the leaf that receives the point.
+  void addPoint(const point_t &x, const Id &id) {
+    Node *node = m_root;
+    while (true) {
+      expandBounds(*node, x);
+      Node *left = node->m_left.load(std::memory_order_acquire);
+      if (left) {
+        node = x[node->m_splitDimension] < node->m_splitValue
+                   ? left
+                   : node->m_right;
+        continue;
+      }
+
+      std::lock_guard<SpinLock> lock(node->m_lock);
+      if (node->m_left.load(std::memory_order_relaxed)) {
+        continue; // split while we were waiting
+      }
+      node->m_points.push_back(PointId{x, id});
+      m_size.fetch_add(1, std::memory_order_relaxed);
+      if (node->m_points.size() > 1 &&
+          node->m_points.size() % BucketSize == 0) {
+        split(*node);
+      }
+      return;
+    }
+  }
+
+  // Thread-safe. k nearest neighbours, sorted by distance.
+  std::vector<DistanceId> searchKnn(const point_t &x,
+                                    std::size_t maxPoints) const {
+    return searchCapacityLimitedBall(x, std::numeric_limits<Scalar>::max(),
+                                     maxPoints);
+  }
+
+  std::vector<DistanceId> searchBall(const point_t &x, Scalar maxRadius) const {
+    return searchCapacityLimitedBall(x, maxRadius,
+                                     std::numeric_limits<std::size_t>::max());
+  }
+
+  DistanceId search(const point_t &x) const {
+    auto results = searchKnn(x, 1);
+    if (results.empty()) {
+      DistanceId result;
+      result.distance = std::numeric_limits<Scalar>::infinity();
+      return result;
+    }
+    return results[0];
+  }
+
+  std::vector<DistanceId>
+  searchCapacityLimitedBall(const point_t &x, Scalar maxRadius,
+                            std::size_t maxPoints) const {
+    CandidateQueue<DistanceId> prioqueue;
+    std::vector<const Node *> searchStack{m_root};
+    point_t lb = x, ub = x;
+
+    while (maxPoints > 0 && size() > 0 && searchStack.size() > 0) {
+      const Node *node = searchStack.back();
+      searchStack.pop_back();
+      // A box being grown by another thread may be read half-updated. It
+      // is inverted in any dimension its first point has not reached yet,
+      // and the node holds no visible point then.
+      bool empty = false;
+      for (int i = 0; i < m_dimensions; i++) {
+        lb[i] = node->m_lb[i].load(std::memory_order_relaxed);
+        ub[i] = node->m_ub[i].load(std::memory_order_relaxed);
+        empty = empty || lb[i] > ub[i];
+      }
+      if (empty) {
+        continue;
+      }
+      Scalar minDist = state_space.distance_to_rectangle(x, lb, ub);
+      if (maxRadius <= minDist || (prioqueue.size() == maxPoints &&
+                                   prioqueue.top().distance <= minDist)) {
+        continue;
+      }
+
+      const Node *left = node->m_left.load(std::memory_order_acquire);
+      if (!left) {
+        std::lock_guard<SpinLock> lock(node->m_lock);
+        left = node->m_left.load(std::memory_order_relaxed);
+        for (std::size_t i = 0; !left && i < node->m_points.size(); i++) {
+          const PointId &p = node->m_points[i];
+          Scalar distance = state_space.distance(x, p.x);
+          if (distance < maxRadius) {
+            offerCandidate(prioqueue, maxPoints, DistanceId{distance, p.id});
+          }
+        }
+      }
+      if (left) {
+        // the child on the side of x is searched first
+        if (x[node->m_splitDimension] < node->m_splitValue) {
+          searchStack.push_back(node->m_right);
+          searchStack.push_back(left);
+        } else {
+          searchStack.push_back(left);
+          searchStack.push_back(node->m_right);
+        }
+      }
+    }
+
+    std::vector<DistanceId> results;
+    drainCandidates(prioqueue, results);
+    return results;
+  }
+
+private:
+  struct PointId {
+    point_t x;
+    Id id;
+  };
+
+  struct Node {
+    explicit Node(int dimensions) : m_lb(dimensions), m_ub(dimensions) {
+      for (int i = 0; i < dimensions; i++) {
+        m_lb[i].store(std::numeric_limits<Scalar>::max());
+        m_ub[i].store(std::numeric_limits<Scalar>::lowest());
+      }
+      m_points.reserve(BucketSize);
+    }
+
+    std::vector<std::atomic<Scalar>> m_lb, m_ub;
+    std::atomic<Node *> m_left{nullptr}; /// set last, nullptr for leaves
+    Node *m_right = nullptr;
+    int m_splitDimension = 0;
+    Scalar m_splitValue = 0;
+    mutable SpinLock m_lock;       /// guards m_points
+    std::vector<PointId> m_points; /// empty for inner nodes
+  };
+
+  static void atomicMin(std::atomic<Scalar> &a, Scalar value) {
+    Scalar current = a.load(std::memory_order_relaxed);
+    while (value < current && !a.compare_exchange_weak(current, value)) {
+    }
+  }
+
+  static void atomicMax(std::atomic<Scalar> &a, Scalar value) {
+    Scalar current = a.load(std::memory_order_relaxed);
+    while (value > current && !a.compare_exchange_weak(current, value)) {
+    }
+  }
+
+  void expandBounds(Node &node, const point_t &x) {
+    for (int i = 0; i < m_dimensions; i++) {
+      atomicMin(node.m_lb[i], x[i]);
+      atomicMax(node.m_ub[i], x[i]);
+    }
+  }
+
+  Node *allocate() {
+    std::lock_guard<std::mutex> lock(m_allocMutex);
+    m_nodes.emplace_back(m_dimensions);
+    return &m_nodes.back();
+  }
+
+  // Called with the lock of `node` held. Does nothing if all the points
+  // share the same coordinate in the widest dimension.
+  void split(Node &node) {
+    std::vector<PointId> &points = node.m_points;
+    point_t lb = points[0].x, ub = points[0].x;
+    for (const PointId &p : points) {
+      lb = lb.cwiseMin(p.x);
+      ub = ub.cwiseMax(p.x);
+    }
+    int splitDimension = m_dimensions;
+    Scalar width(0);
+    state_space.choose_split_dimension(lb, ub, splitDimension, width);
+    if (splitDimension == m_dimensions) {
+      return;
+    }
+
+    std::vector<Scalar> keys;
+    keys.reserve(points.size());
+    for (const PointId &p : points) {
+      keys.push_back(p.x[splitDimension]);
+    }
+    auto upper = keys.begin() + keys.size() / 2 + 1;
+    std::nth_element(keys.begin(), upper, keys.end());
+    Scalar splitValue = (*std::max_element(keys.begin(), upper) + *upper) / 2;
+    auto middle = std::partition(points.begin(), points.end(),
+                                 [&](const PointId &p) {
+                                   return p.x[splitDimension] < splitValue;
+                                 });
+    if (middle == points.begin()) {
+      return; // points with equality to splitValue go right
+    }
+
+    Node *left = allocate();
+    Node *right = allocate();
+    for (auto it = points.begin(); it != points.end(); ++it) {
+      Node *child = it < middle ? left : right;
+      expandBounds(*child, it->x);
+      child->m_points.push_back(std::move(*it));
+    }
+    node.m_splitDimension = splitDimension;
+    node.m_splitValue = splitValue;
+    node.m_right = right;
+    node.m_left.store(left, std::memory_order_release);
+    std::vector<PointId>().swap(points);
+  }
+
+  std::deque<Node> m_nodes;
+  Node *m_root = nullptr; /// m_nodes.front(), never moves
+  mutable std::mutex m_allocMutex;
+  std::atomic<std::size_t> m_size{0};
+  StateSpace state_space;
+};
+} // namespace dynotree
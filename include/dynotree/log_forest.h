@@ -0,0 +1,253 @@
+#pragma once
+
+#include <memory>
+#include <mutex>
+
+#include "KDTree.h"
+
+namespace dynotree {
+
+// Dynamic index made of static kd-trees (the logarithmic method of Bentley
+// and Saxe). New points go to a buffer of BucketSize points that is scanned
+// linearly. When the buffer is full, it is merged with levels 0, 1, ... up to
+// the first empty level j, which is rebuilt by KDTree::build from the
+// BucketSize * 2^j points. Every tree is thus balanced, whatever the
+// insertion order, and each point is rebuilt O(log n) times.
+//
+// Queries visit the trees from the largest to the smallest. The k-th best
+// distance found so far bounds the search radius in the next tree.
+//
+// Built trees are never modified, which gives cheap snapshots for
+// concurrent readers, see publish(). KDTree has no snapshots: addPoint
+// updates counts, boxes and buckets in place along the path of the point,
+// and a split may reallocate the node and bound arrays, so a snapshot would
+// have to copy the tree, or every path touched since the last one.
+template <class Id, int Dimensions, std::size_t BucketSize = 32,
+          typename Scalar = double,
+          typename StateSpace = Rn<Scalar, Dimensions>,
+          LeafLayout Layout = LeafLayout::AoS>
+class LogForest {
+private:
+  struct Level;
+
+public:
+  using scalar_t = Scalar;
+  using id_t = Id;
+  using tree_t = KDTree<Id, Dimensions, BucketSize, Scalar, StateSpace, Layout>;
+  using point_t = typename tree_t::point_t;
+  using points_t = typename tree_t::points_t;
+  using cref_t = typename tree_t::cref_t;
+  using ref_t = typename tree_t::ref_t;
+  using state_space_t = StateSpace;
+  using DistanceId = typename tree_t::DistanceId;
+  int m_dimensions = Dimensions;
+
+  // Immutable view of the forest, as of the last publish(). Trees are shared
+  // with the forest and with other snapshots, and freed with the last
+  // snapshot that uses them; only the buffer is copied.
+  class Snapshot {
+  public:
+    size_t size() const { return m_size; }
+
+    std::vector<DistanceId> searchKnn(const point_t &x, std::size_t maxPoints,
+                                      Scalar eps = 0) const {
+      return searchCapacityLimitedBall(x, std::numeric_limits<Scalar>::max(),
+                                       maxPoints, eps);
+    }
+
+    std::vector<DistanceId> searchBall(const point_t &x,
+                                       Scalar maxRadius) const {
+      return searchCapacityLimitedBall(
+          x, maxRadius, std::numeric_limits<std::size_t>::max());
+    }
+
+    // Only the returned vector is allocated: the trees search with their
+    // per-thread scratch, and the partial results of the levels go to
+    // per-thread buffers.
+    std::vector<DistanceId>
+    searchCapacityLimitedBall(const point_t &x, Scalar maxRadius,
+                              std::size_t maxPoints, Scalar eps = 0) const {
+      std::vector<DistanceId> results;
+      if (maxPoints == 0) {
+        return results;
+      }
+      static thread_local std::vector<DistanceId> found, merged;
+      Scalar slack = 1 + eps;
+      auto radius = [&] {
+        return results.size() < maxPoints
+                   ? maxRadius
+                   : std::min(maxRadius, results.back().distance / slack);
+      };
+      auto merge = [&] {
+        merged.clear();
+        std::merge(results.begin(), results.end(), found.begin(), found.end(),
+                   std::back_inserter(merged));
+        if (merged.size() > maxPoints) {
+          merged.resize(maxPoints);
+        }
+        results.assign(merged.begin(), merged.end());
+      };
+
+      for (auto it = m_levels.rbegin(); it != m_levels.rend(); ++it) {
+        if (*it) {
+          (*it)->tree.searchCapacityLimitedBallInto(x, radius(), maxPoints,
+                                                    found, eps);
+          merge();
+        }
+      }
+
+      found.clear();
+      Scalar bound = radius();
+      for (std::size_t i = 0; i < m_bufferIds.size(); i++) {
+        Scalar distance = state_space.distance(x, m_buffer.col(i));
+        if (distance < bound) {
+          found.push_back(DistanceId{distance, m_bufferIds[i]});
+        }
+      }
+      std::sort(found.begin(), found.end());
+      merge();
+      return results;
+    }
+
+    // Nearest neighbour, see KDTree::search.
+    DistanceId search(const point_t &x, Scalar eps = 0) const {
+      auto results = searchKnn(x, 1, eps);
+      if (results.empty()) {
+        DistanceId result;
+        result.distance = std::numeric_limits<Scalar>::infinity();
+        return result;
+      }
+      return results[0];
+    }
+
+  private:
+    friend class LogForest;
+
+    /// level j holds 0 (nullptr) or BucketSize * 2^j points
+    std::vector<std::shared_ptr<const Level>> m_levels;
+    points_t m_buffer;
+    std::vector<Id> m_bufferIds;
+    std::size_t m_size = 0;
+    StateSpace state_space;
+  };
+
+  StateSpace &getStateSpace() { return m_state.state_space; }
+
+  LogForest() = default;
+
+  void init_tree(int runtime_dimension = -1,
+                 const StateSpace &t_state_space = StateSpace()) {
+    if constexpr (Dimensions == Eigen::Dynamic) {
+      assert(runtime_dimension > 0);
+      m_dimensions = runtime_dimension;
+    }
+    m_state = Snapshot();
+    m_state.state_space = t_state_space;
+    m_state.m_buffer.resize(m_dimensions, BucketSize);
+    publish();
+  }
+
+  size_t size() const { return m_state.size(); }
+
+  // Number of non-empty trees, the buffer not included.
+  std::size_t numTrees() const {
+    return std::count_if(m_state.m_levels.begin(), m_state.m_levels.end(),
+                         [](const auto &level) { return bool(level); });
+  }
+
+  // Not visible to snapshot() until the next publish().
+  void addPoint(const point_t &x, const Id &id) {
+    CHECK_PRETTY_DYNOTREE(m_state.m_buffer.rows() == m_dimensions,
+                          "call init_tree before addPoint");
+    m_state.m_buffer.col(m_state.m_bufferIds.size()) = x;
+    m_state.m_bufferIds.push_back(id);
+    m_state.m_size++;
+    if (m_state.m_bufferIds.size() == BucketSize) {
+      carry();
+    }
+  }
+
+  // Readers and a single writer can run concurrently: the writer calls
+  // addPoint() and publish(), while any number of threads take a snapshot()
+  // and query it. Published trees are never modified, so queries take no
+  // lock and never see a partial insertion. The snapshot pointer itself is
+  // swapped and copied under a mutex of the forest, held only for that
+  // copy. Cost is O(log n) plus a copy of the buffer.
+  void publish() {
+    auto published = std::make_shared<const Snapshot>(m_state);
+    std::lock_guard<std::mutex> lock(m_publishMutex);
+    std::swap(m_published, published);
+    // the previous snapshot may be freed here, outside the lock
+  }
+
+  std::shared_ptr<const Snapshot> snapshot() const {
+    std::lock_guard<std::mutex> lock(m_publishMutex);
+    return m_published;
+  }
+
+  // Queries on the current content, for the writer thread.
+  std::vector<DistanceId> searchKnn(const point_t &x, std::size_t maxPoints,
+                                    Scalar eps = 0) const {
+    return m_state.searchKnn(x, maxPoints, eps);
+  }
+
+  std::vector<DistanceId> searchBall(const point_t &x, Scalar maxRadius) const {
+    return m_state.searchBall(x, maxRadius);
+  }
+
+  std::vector<DistanceId>
+  searchCapacityLimitedBall(const point_t &x, Scalar maxRadius,
+                            std::size_t maxPoints, Scalar eps = 0) const {
+    return m_state.searchCapacityLimitedBall(x, maxRadius, maxPoints, eps);
+  }
+
+  DistanceId search(const point_t &x, Scalar eps = 0) const {
+    return m_state.search(x, eps);
+  }
+
+private:
+  // A static tree and a copy of its points, which are needed to rebuild it
+  // into the next level. Immutable once built.
+  struct Level {
+    tree_t tree;
+    points_t points;
+    std::vector<Id> ids;
+  };
+
+  // Merges the full buffer and the levels below the first empty one into
+  // that level. Replaced levels stay alive while a snapshot holds them.
+  void carry() {
+    auto &levels = m_state.m_levels;
+    std::size_t j = 0;
+    while (j < levels.size() && levels[j]) {
+      j++;
+    }
+    if (j == levels.size()) {
+      levels.emplace_back();
+    }
+
+    auto level = std::make_shared<Level>();
+    level->points.resize(m_dimensions, BucketSize << j);
+    level->ids.reserve(BucketSize << j);
+    level->points.leftCols(BucketSize) = m_state.m_buffer;
+    level->ids.insert(level->ids.end(), m_state.m_bufferIds.begin(),
+                      m_state.m_bufferIds.end());
+    m_state.m_bufferIds.clear();
+    for (std::size_t i = 0; i < j; i++) {
+      level->points.middleCols(level->ids.size(), levels[i]->ids.size()) =
+          levels[i]->points;
+      level->ids.insert(level->ids.end(), levels[i]->ids.begin(),
+                        levels[i]->ids.end());
+      levels[i].reset();
+    }
+
+    level->tree.init_tree(m_dimensions, m_state.state_space);
+    level->tree.build(level->points, level->ids);
+    levels[j] = std::move(level);
+  }
+
+  Snapshot m_state; /// owned by the writer
+  std::shared_ptr<const Snapshot> m_published;
+  mutable std::mutex m_publishMutex; /// guards m_published
+};
+} // namespace dynotree
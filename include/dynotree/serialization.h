@@ -0,0 +1,229 @@
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <ostream>
+#include <set>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#include <vector>
+
+#include <eigen3/Eigen/Core>
+
+#include "dynotree/dynotree_macros.h"
+
+namespace dynotree {
+
+// Binary archives used by KDTree::save and KDTree::load.
+//
+// Values are written in native byte order, one after the other: numbers and
+// enums as raw bytes, containers as a uint64 size followed by their
+// elements (a single block for arrays of numbers), Eigen matrices as rows,
+// cols and the coefficients in storage order. Other classes provide
+//
+//   template <typename Archive> void serialize(Archive &ar) { ar(a, b); }
+//
+// which is used both for writing and for reading.
+class BinaryWriter {
+public:
+  explicit BinaryWriter(std::ostream &out) : m_out(out) {}
+
+  template <typename... T> void operator()(const T &...values) {
+    (write(values), ...);
+  }
+
+private:
+  template <typename T> void write(const T &value) {
+    if constexpr (std::is_arithmetic_v<T> || std::is_enum_v<T>) {
+      writeBytes(&value, sizeof(T));
+    } else {
+      const_cast<T &>(value).serialize(*this);
+    }
+  }
+
+  void write(const std::string &s) {
+    write(std::uint64_t(s.size()));
+    writeBytes(s.data(), s.size());
+  }
+
+  template <typename T> void write(const std::vector<T> &v) {
+    write(std::uint64_t(v.size()));
+    if constexpr (std::is_arithmetic_v<T>) {
+      writeBytes(v.data(), v.size() * sizeof(T));
+    } else {
+      for (const T &value : v) {
+        write(value);
+      }
+    }
+  }
+
+  void write(const std::vector<bool> &v) {
+    write(std::uint64_t(v.size()));
+    for (bool value : v) {
+      write(value);
+    }
+  }
+
+  template <typename T> void write(const std::set<T> &s) {
+    write(std::vector<T>(s.begin(), s.end()));
+  }
+
+  template <typename A, typename B> void write(const std::pair<A, B> &p) {
+    write(p.first);
+    write(p.second);
+  }
+
+  template <typename... T> void write(const std::variant<T...> &v) {
+    write(std::uint64_t(v.index()));
+    std::visit([&](const auto &value) { write(value); }, v);
+  }
+
+  template <typename S, int R, int C, int O, int MR, int MC>
+  void write(const Eigen::Matrix<S, R, C, O, MR, MC> &m) {
+    write(std::int64_t(m.rows()));
+    write(std::int64_t(m.cols()));
+    writeBytes(m.data(), m.size() * sizeof(S));
+  }
+
+  void writeBytes(const void *data, std::size_t size) {
+    m_out.write(static_cast<const char *>(data), size);
+    CHECK_PRETTY_DYNOTREE(m_out.good(), "write failed");
+  }
+
+  std::ostream &m_out;
+};
+
+// Reads what BinaryWriter wrote, from a buffer in memory. Throws if the
+// buffer ends early.
+class BinaryReader {
+public:
+  BinaryReader(const char *data, std::size_t size)
+      : m_data(data), m_end(data + size) {}
+
+  template <typename... T> void operator()(T &...values) {
+    (read(values), ...);
+  }
+
+  std::size_t remaining() const { return m_end - m_data; }
+
+private:
+  template <typename T> void read(T &value) {
+    if constexpr (std::is_arithmetic_v<T> || std::is_enum_v<T>) {
+      readBytes(&value, sizeof(T));
+    } else {
+      value.serialize(*this);
+    }
+  }
+
+  // Any other byte than 0 or 1 would be an invalid bool.
+  void read(bool &value) {
+    std::uint8_t byte;
+    read(byte);
+    CHECK_PRETTY_DYNOTREE(byte <= 1, "bad bool");
+    value = byte;
+  }
+
+  // Size of a container whose elements take at least elementSize bytes.
+  std::size_t readSize(std::size_t elementSize) {
+    std::uint64_t size;
+    read(size);
+    CHECK_PRETTY_DYNOTREE(size <= remaining() / elementSize,
+                          "truncated archive");
+    return size;
+  }
+
+  void read(std::string &s) {
+    s.resize(readSize(1));
+    readBytes(s.data(), s.size());
+  }
+
+  template <typename T> void read(std::vector<T> &v) {
+    if constexpr (std::is_arithmetic_v<T>) {
+      v.resize(readSize(sizeof(T)));
+      readBytes(v.data(), v.size() * sizeof(T));
+    } else {
+      v.resize(readSize(1));
+      for (T &value : v) {
+        read(value);
+      }
+    }
+  }
+
+  void read(std::vector<bool> &v) {
+    v.resize(readSize(1));
+    for (std::size_t i = 0; i < v.size(); i++) {
+      bool value;
+      read(value);
+      v[i] = value;
+    }
+  }
+
+  template <typename T> void read(std::set<T> &s) {
+    std::vector<T> v;
+    read(v);
+    s = std::set<T>(v.begin(), v.end());
+  }
+
+  template <typename A, typename B> void read(std::pair<A, B> &p) {
+    read(p.first);
+    read(p.second);
+  }
+
+  template <typename... T> void read(std::variant<T...> &v) {
+    std::uint64_t index;
+    read(index);
+    CHECK_PRETTY_DYNOTREE(index < sizeof...(T), "bad variant index");
+    emplaceIndex(v, index, std::index_sequence_for<T...>());
+    std::visit([&](auto &value) { read(value); }, v);
+  }
+
+  template <typename Variant, std::size_t... I>
+  static void emplaceIndex(Variant &v, std::size_t index,
+                           std::index_sequence<I...>) {
+    ((index == I ? (void)v.template emplace<I>() : (void)0), ...);
+  }
+
+  template <typename S, int R, int C, int O, int MR, int MC>
+  void read(Eigen::Matrix<S, R, C, O, MR, MC> &m) {
+    std::int64_t rows, cols;
+    read(rows);
+    read(cols);
+    CHECK_PRETTY_DYNOTREE((R == Eigen::Dynamic || rows == R) &&
+                              (C == Eigen::Dynamic || cols == C),
+                          "matrix size mismatch");
+    CHECK_PRETTY_DYNOTREE(rows >= 0 && cols >= 0 &&
+                              std::size_t(rows * cols) <=
+                                  remaining() / sizeof(S),
+                          "truncated archive");
+    m.resize(rows, cols);
+    readBytes(m.data(), m.size() * sizeof(S));
+  }
+
+  void readBytes(void *data, std::size_t size) {
+    CHECK_PRETTY_DYNOTREE(size <= remaining(), "truncated archive");
+    if (size == 0) {
+      return; // data may be null
+    }
+    std::memcpy(data, m_data, size);
+    m_data += size;
+  }
+
+  const char *m_data;
+  const char *m_end;
+};
+
+// Whole content of a file.
+inline std::string readFile(const std::string &path) {
+  std::ifstream in(path, std::ios::binary | std::ios::ate);
+  CHECK_PRETTY_DYNOTREE(in.is_open(), "cannot open " + path);
+  std::string data(std::size_t(in.tellg()), '\0');
+  in.seekg(0);
+  in.read(data.data(), data.size());
+  CHECK_PRETTY_DYNOTREE(in.good(), "cannot read " + path);
+  return data;
+}
+
+} // namespace dynotree
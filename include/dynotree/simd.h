@@ -0,0 +1,385 @@
+#pragma once
+
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <type_traits>
+
+#if (defined(__x86_64__) || defined(__i386__)) &&                              \
+    (defined(__GNUC__) || defined(__clang__)) && !defined(DYNOTREE_NO_SIMD)
+#define DYNOTREE_SIMD_X86 1
+#include <immintrin.h>
+#endif
+
+namespace dynotree {
+namespace simd {
+
+// Leaf-scan kernels: distances from a query x to the n points of a
+// dimension-major block, where coordinate d of point j is
+// columns[d * stride + j]. The difference in dimension d is multiplied by
+// weights[d] and scale[d]; either may be null. Columns may be stored with a
+// narrower type T (float or int16_t), which is converted to Scalar on load.
+// The instruction set is picked at runtime; Scalar types other than float
+// and double always use the portable loop.
+//
+// The row kernels do the same for a point-major block (array-of-structs
+// leaves), where coordinate d of point j is rows[j * stride + d]: vectors of
+// points are filled with gathers. They only exist for AVX-512; with AVX2,
+// gathers were measured slower than the scalar loop of the caller.
+
+enum class Metric { L1, L2, L2Squared };
+
+enum class Isa { Scalar, Avx2, Avx512 };
+
+inline bool supported(Isa isa) {
+#ifdef DYNOTREE_SIMD_X86
+  __builtin_cpu_init();
+  switch (isa) {
+  case Isa::Avx512:
+    return __builtin_cpu_supports("avx512f");
+  case Isa::Avx2:
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+  default:
+    return true;
+  }
+#else
+  return isa == Isa::Scalar;
+#endif
+}
+
+// Instruction set used by the kernels. Defaults to the best one supported
+// by the CPU; can be lowered (e.g. to compare against the scalar loop).
+inline Isa &active_isa() {
+  static Isa isa = supported(Isa::Avx512) ? Isa::Avx512
+                   : supported(Isa::Avx2) ? Isa::Avx2
+                                          : Isa::Scalar;
+  return isa;
+}
+
+template <typename Scalar>
+inline Scalar factor(const Scalar *weights, const Scalar *scale, int d) {
+  return (weights ? weights[d] : Scalar(1)) * (scale ? scale[d] : Scalar(1));
+}
+
+template <Metric M, typename Scalar, typename T>
+void columns_scalar(const Scalar *x, const Scalar *weights,
+                    const Scalar *scale, int dims, const T *columns,
+                    std::size_t stride, std::size_t n, Scalar *out) {
+  std::fill(out, out + n, Scalar(0));
+  for (int d = 0; d < dims; d++) {
+    const T *column = columns + d * stride;
+    Scalar w = factor(weights, scale, d);
+    for (std::size_t j = 0; j < n; j++) {
+      Scalar dif = Scalar(column[j]) - x[d];
+      if constexpr (M == Metric::L1) {
+        out[j] += w * std::abs(dif);
+      } else {
+        dif *= w;
+        out[j] += dif * dif;
+      }
+    }
+  }
+  if constexpr (M == Metric::L2) {
+    for (std::size_t j = 0; j < n; j++) {
+      out[j] = std::sqrt(out[j]);
+    }
+  }
+}
+
+#ifdef DYNOTREE_SIMD_X86
+
+#define DYNOTREE_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define DYNOTREE_TARGET_AVX512 __attribute__((target("avx512f")))
+
+// Thin wrappers over the intrinsics, so that one kernel body serves every
+// (instruction set, Scalar) pair.
+template <typename Scalar> struct Avx2;
+template <typename Scalar> struct Avx512;
+
+#define DYNOTREE_VECTOR_OPS(TARGET, REG, SCALAR, WIDTH, PREFIX, SUFFIX)        \
+  using reg = REG;                                                             \
+  static constexpr std::size_t width = WIDTH;                                  \
+  TARGET static reg zero() { return PREFIX##_setzero_##SUFFIX(); }             \
+  TARGET static reg set1(SCALAR a) { return PREFIX##_set1_##SUFFIX(a); }       \
+  TARGET static reg load(const SCALAR *p) {                                    \
+    return PREFIX##_loadu_##SUFFIX(p);                                         \
+  }                                                                            \
+  TARGET static void store(SCALAR *p, reg a) {                                 \
+    PREFIX##_storeu_##SUFFIX(p, a);                                            \
+  }                                                                            \
+  TARGET static reg add(reg a, reg b) { return PREFIX##_add_##SUFFIX(a, b); }  \
+  TARGET static reg sub(reg a, reg b) { return PREFIX##_sub_##SUFFIX(a, b); }  \
+  TARGET static reg mul(reg a, reg b) { return PREFIX##_mul_##SUFFIX(a, b); }  \
+  TARGET static reg fmadd(reg a, reg b, reg c) {                               \
+    return PREFIX##_fmadd_##SUFFIX(a, b, c);                                   \
+  }                                                                            \
+  TARGET static reg sqrt(reg a) { return PREFIX##_sqrt_##SUFFIX(a); }
+
+// Offsets of the first m of width rows, `stride` scalars apart; the lanes
+// past m repeat the last row, so that a gather stays within the block.
+#define DYNOTREE_OFFSETS(TARGET)                                               \
+  TARGET static index offsets(std::size_t stride, std::size_t m = width) {     \
+    std::int32_t buffer[sizeof(index) / sizeof(std::int32_t)] = {};           \
+    for (std::size_t l = 0; l < width; l++) {                                  \
+      buffer[l] = std::int32_t(std::min(l, m - 1) * stride);                   \
+    }                                                                          \
+    index out;                                                                 \
+    std::memcpy(&out, buffer, sizeof(index));                                  \
+    return out;                                                                \
+  }
+
+// Loads m < width values of type T, zero padded.
+#define DYNOTREE_LOAD_PARTIAL(TARGET)                                          \
+  template <typename T>                                                        \
+  TARGET static reg loadPartial(const T *p, std::size_t m) {                   \
+    T buffer[width] = {};                                                      \
+    std::memcpy(buffer, p, m * sizeof(T));                                     \
+    return load(buffer);                                                       \
+  }
+
+template <> struct Avx2<double> {
+  DYNOTREE_VECTOR_OPS(DYNOTREE_TARGET_AVX2, __m256d, double, 4, _mm256, pd)
+  DYNOTREE_LOAD_PARTIAL(DYNOTREE_TARGET_AVX2)
+  DYNOTREE_TARGET_AVX2 static reg load(const float *p) {
+    return _mm256_cvtps_pd(_mm_loadu_ps(p));
+  }
+  DYNOTREE_TARGET_AVX2 static reg load(const std::int16_t *p) {
+    __m128i q = _mm_loadl_epi64(reinterpret_cast<const __m128i *>(p));
+    return _mm256_cvtepi32_pd(_mm_cvtepi16_epi32(q));
+  }
+  DYNOTREE_TARGET_AVX2 static reg abs(reg a) {
+    return _mm256_andnot_pd(_mm256_set1_pd(-0.), a);
+  }
+  DYNOTREE_TARGET_AVX2 static void storePartial(double *p, reg a,
+                                                std::size_t m) {
+    double buffer[width];
+    store(buffer, a);
+    std::memcpy(p, buffer, m * sizeof(double));
+  }
+};
+
+template <> struct Avx2<float> {
+  DYNOTREE_VECTOR_OPS(DYNOTREE_TARGET_AVX2, __m256, float, 8, _mm256, ps)
+  DYNOTREE_LOAD_PARTIAL(DYNOTREE_TARGET_AVX2)
+  DYNOTREE_TARGET_AVX2 static reg load(const std::int16_t *p) {
+    __m128i q = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(q));
+  }
+  DYNOTREE_TARGET_AVX2 static reg abs(reg a) {
+    return _mm256_andnot_ps(_mm256_set1_ps(-0.f), a);
+  }
+  DYNOTREE_TARGET_AVX2 static void storePartial(float *p, reg a,
+                                                std::size_t m) {
+    float buffer[width];
+    store(buffer, a);
+    std::memcpy(p, buffer, m * sizeof(float));
+  }
+};
+
+template <> struct Avx512<double> {
+  DYNOTREE_VECTOR_OPS(DYNOTREE_TARGET_AVX512, __m512d, double, 8, _mm512, pd)
+  DYNOTREE_LOAD_PARTIAL(DYNOTREE_TARGET_AVX512)
+  DYNOTREE_TARGET_AVX512 static reg load(const float *p) {
+    return _mm512_cvtps_pd(_mm256_loadu_ps(p));
+  }
+  DYNOTREE_TARGET_AVX512 static reg load(const std::int16_t *p) {
+    __m128i q = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p));
+    return _mm512_cvtepi32_pd(_mm256_cvtepi16_epi32(q));
+  }
+  DYNOTREE_TARGET_AVX512 static reg abs(reg a) { return _mm512_abs_pd(a); }
+  using index = __m256i;
+  DYNOTREE_OFFSETS(DYNOTREE_TARGET_AVX512)
+  DYNOTREE_TARGET_AVX512 static reg gather(const double *p, index offsets) {
+    return _mm512_i32gather_pd(offsets, p, 8);
+  }
+  DYNOTREE_TARGET_AVX512 static void storePartial(double *p, reg a,
+                                                  std::size_t m) {
+    _mm512_mask_storeu_pd(p, __mmask8((1u << m) - 1), a);
+  }
+};
+
+template <> struct Avx512<float> {
+  DYNOTREE_VECTOR_OPS(DYNOTREE_TARGET_AVX512, __m512, float, 16, _mm512, ps)
+  DYNOTREE_LOAD_PARTIAL(DYNOTREE_TARGET_AVX512)
+  DYNOTREE_TARGET_AVX512 static reg load(const std::int16_t *p) {
+    __m256i q = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p));
+    return _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(q));
+  }
+  DYNOTREE_TARGET_AVX512 static reg abs(reg a) { return _mm512_abs_ps(a); }
+  using index = __m512i;
+  DYNOTREE_OFFSETS(DYNOTREE_TARGET_AVX512)
+  DYNOTREE_TARGET_AVX512 static reg gather(const float *p, index offsets) {
+    return _mm512_i32gather_ps(offsets, p, 4);
+  }
+  DYNOTREE_TARGET_AVX512 static void storePartial(float *p, reg a,
+                                                  std::size_t m) {
+    _mm512_mask_storeu_ps(p, __mmask16((1u << m) - 1), a);
+  }
+};
+
+#undef DYNOTREE_VECTOR_OPS
+#undef DYNOTREE_LOAD_PARTIAL
+#undef DYNOTREE_OFFSETS
+
+// Same loop as columns_scalar, one vector of points at a time: the
+// accumulator stays in a register while the dimensions are streamed. Two
+// vectors are processed together to overlap their accumulation chains.
+#define DYNOTREE_COLUMNS_KERNEL(NAME, TARGET, VECTOR)                          \
+  template <Metric M, typename Scalar, typename T>                             \
+  TARGET void NAME(const Scalar *x, const Scalar *weights,                     \
+                   const Scalar *scale, int dims, const T *columns,            \
+                   std::size_t stride, std::size_t n, Scalar *out) {           \
+    using V = VECTOR<Scalar>;                                                  \
+    bool weighted = weights || scale;                                          \
+    std::size_t j = 0;                                                         \
+    for (; j + 2 * V::width <= n; j += 2 * V::width) {                         \
+      typename V::reg acc0 = V::zero();                                        \
+      typename V::reg acc1 = V::zero();                                        \
+      for (int d = 0; d < dims; d++) {                                         \
+        const T *column = columns + d * stride + j;                            \
+        typename V::reg xd = V::set1(x[d]);                                    \
+        typename V::reg dif0 = V::sub(V::load(column), xd);                    \
+        typename V::reg dif1 = V::sub(V::load(column + V::width), xd);         \
+        if (weighted) {                                                        \
+          typename V::reg w = V::set1(factor(weights, scale, d));              \
+          dif0 = V::mul(dif0, w);                                              \
+          dif1 = V::mul(dif1, w);                                              \
+        }                                                                      \
+        if constexpr (M == Metric::L1) {                                       \
+          acc0 = V::add(acc0, V::abs(dif0));                                   \
+          acc1 = V::add(acc1, V::abs(dif1));                                   \
+        } else {                                                               \
+          acc0 = V::fmadd(dif0, dif0, acc0);                                   \
+          acc1 = V::fmadd(dif1, dif1, acc1);                                   \
+        }                                                                      \
+      }                                                                        \
+      if constexpr (M == Metric::L2) {                                         \
+        acc0 = V::sqrt(acc0);                                                  \
+        acc1 = V::sqrt(acc1);                                                  \
+      }                                                                        \
+      V::store(out + j, acc0);                                                 \
+      V::store(out + j + V::width, acc1);                                      \
+    }                                                                          \
+    for (; j < n; j += V::width) {                                             \
+      std::size_t m = std::min(V::width, n - j);                               \
+      typename V::reg acc = V::zero();                                         \
+      for (int d = 0; d < dims; d++) {                                         \
+        const T *column = columns + d * stride + j;                            \
+        typename V::reg c =                                                    \
+            m == V::width ? V::load(column) : V::loadPartial(column, m);       \
+        typename V::reg dif = V::sub(c, V::set1(x[d]));                        \
+        if (weighted) {                                                        \
+          dif = V::mul(dif, V::set1(factor(weights, scale, d)));               \
+        }                                                                      \
+        if constexpr (M == Metric::L1) {                                       \
+          acc = V::add(acc, V::abs(dif));                                      \
+        } else {                                                               \
+          acc = V::fmadd(dif, dif, acc);                                       \
+        }                                                                      \
+      }                                                                        \
+      if constexpr (M == Metric::L2) {                                         \
+        acc = V::sqrt(acc);                                                    \
+      }                                                                        \
+      if (m == V::width) {                                                     \
+        V::store(out + j, acc);                                                \
+      } else {                                                                 \
+        V::storePartial(out + j, acc, m);                                      \
+      }                                                                        \
+    }                                                                          \
+  }
+
+DYNOTREE_COLUMNS_KERNEL(columns_avx2, DYNOTREE_TARGET_AVX2, Avx2)
+DYNOTREE_COLUMNS_KERNEL(columns_avx512, DYNOTREE_TARGET_AVX512, Avx512)
+
+#undef DYNOTREE_COLUMNS_KERNEL
+
+// Same as the columns kernel, for a point-major block: coordinate d of a
+// vector of points is one gather. The last, partial vector gathers its last
+// point again in the unused lanes.
+template <Metric M, typename Scalar>
+DYNOTREE_TARGET_AVX512 void
+rows_avx512(const Scalar *x, const Scalar *weights, const Scalar *scale,
+            int dims, const Scalar *rows, std::size_t stride, std::size_t n,
+            Scalar *out) {
+  using V = Avx512<Scalar>;
+  bool weighted = weights || scale;
+  typename V::index offsets = V::offsets(stride);
+  for (std::size_t j = 0; j < n; j += V::width) {
+    std::size_t m = std::min(V::width, n - j);
+    if (m < V::width) {
+      offsets = V::offsets(stride, m);
+    }
+    const Scalar *block = rows + j * stride;
+    typename V::reg acc = V::zero();
+    for (int d = 0; d < dims; d++) {
+      typename V::reg dif =
+          V::sub(V::gather(block + d, offsets), V::set1(x[d]));
+      if (weighted) {
+        dif = V::mul(dif, V::set1(factor(weights, scale, d)));
+      }
+      if constexpr (M == Metric::L1) {
+        acc = V::add(acc, V::abs(dif));
+      } else {
+        acc = V::fmadd(dif, dif, acc);
+      }
+    }
+    if constexpr (M == Metric::L2) {
+      acc = V::sqrt(acc);
+    }
+    if (m == V::width) {
+      V::store(out + j, acc);
+    } else {
+      V::storePartial(out + j, acc, m);
+    }
+  }
+}
+
+#endif
+
+template <Metric M, typename Scalar, typename T>
+void distance_to_columns(const Scalar *x, const Scalar *weights,
+                         const Scalar *scale, int dims, const T *columns,
+                         std::size_t stride, std::size_t n, Scalar *out) {
+#ifdef DYNOTREE_SIMD_X86
+  constexpr bool vectorized =
+      (std::is_same_v<Scalar, double> || std::is_same_v<Scalar, float>) &&
+      (std::is_same_v<T, Scalar> || std::is_same_v<T, std::int16_t> ||
+       (std::is_same_v<T, float> && std::is_same_v<Scalar, double>));
+  if constexpr (vectorized) {
+    switch (active_isa()) {
+    case Isa::Avx512:
+      return columns_avx512<M>(x, weights, scale, dims, columns, stride, n,
+                               out);
+    case Isa::Avx2:
+      return columns_avx2<M>(x, weights, scale, dims, columns, stride, n, out);
+    default:
+      break;
+    }
+  }
+#endif
+  columns_scalar<M>(x, weights, scale, dims, columns, stride, n, out);
+}
+
+// Returns false, without writing to out, if there is no row kernel for
+// Scalar on this CPU. The caller then computes the distances one point at a
+// time.
+template <Metric M, typename Scalar>
+bool distance_to_rows(const Scalar *x, const Scalar *weights,
+                      const Scalar *scale, int dims, const Scalar *rows,
+                      std::size_t stride, std::size_t n, Scalar *out) {
+#ifdef DYNOTREE_SIMD_X86
+  if constexpr (std::is_same_v<Scalar, double> ||
+                std::is_same_v<Scalar, float>) {
+    if (active_isa() == Isa::Avx512) {
+      rows_avx512<M>(x, weights, scale, dims, rows, stride, n, out);
+      return true;
+    }
+  }
+#endif
+  return false;
+}
+
+} // namespace simd
+} // namespace dynotree
@@ -0,0 +1,172 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace dynotree {
+
+// Small work-stealing thread pool used for tree construction.
+//
+// Every worker owns a deque of tasks: it pushes and pops at the back, and
+// idle workers steal from the front of the others. Tasks submitted from
+// inside a task go to the queue of the worker running it, so recursive
+// divide and conquer keeps its locality. The thread that calls wait() acts
+// as worker 0, i.e. a pool of size N starts N - 1 threads.
+class WorkStealingPool {
+public:
+  explicit WorkStealingPool(std::size_t num_threads)
+      : m_queues(std::max<std::size_t>(num_threads, 1)) {
+    for (std::size_t i = 1; i < m_queues.size(); i++) {
+      m_threads.emplace_back([this, i] { workerLoop(i); });
+    }
+  }
+
+  WorkStealingPool(const WorkStealingPool &) = delete;
+  WorkStealingPool &operator=(const WorkStealingPool &) = delete;
+
+  ~WorkStealingPool() {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_cv.notify_all();
+    for (auto &thread : m_threads) {
+      thread.join();
+    }
+  }
+
+  std::size_t size() const { return m_queues.size(); }
+
+  // Index in [0, size()) of the calling thread within this pool.
+  std::size_t workerIndex() const {
+    const Worker &worker = currentWorker();
+    return worker.pool == this ? worker.index : 0;
+  }
+
+  void submit(std::function<void()> task) {
+    std::size_t q = workerIndex();
+    m_pending++;
+    {
+      std::lock_guard<std::mutex> lock(m_queues[q].mutex);
+      m_queues[q].tasks.push_back(std::move(task));
+      m_queued++;
+    }
+    {
+      // sleeping threads check m_queued under m_mutex: no lost wake-ups
+      std::lock_guard<std::mutex> lock(m_mutex);
+    }
+    m_cv.notify_one();
+  }
+
+  // Runs tasks on the calling thread until every submitted task (and the
+  // tasks they submitted) has finished. Rethrows the first exception thrown
+  // by a task.
+  void wait() {
+    Worker previous = currentWorker();
+    currentWorker() = Worker{this, 0};
+    while (m_pending > 0) {
+      if (!runOne(0)) {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_cv.wait(lock, [this] { return m_queued > 0 || m_pending == 0; });
+      }
+    }
+    currentWorker() = previous;
+
+    if (m_exception) {
+      std::exception_ptr exception = m_exception;
+      m_exception = nullptr;
+      std::rethrow_exception(exception);
+    }
+  }
+
+private:
+  struct Queue {
+    std::mutex mutex;
+    std::deque<std::function<void()>> tasks;
+  };
+
+  struct Worker {
+    WorkStealingPool *pool = nullptr;
+    std::size_t index = 0;
+  };
+
+  static Worker &currentWorker() {
+    static thread_local Worker worker;
+    return worker;
+  }
+
+  bool pop(std::size_t q, bool back, std::function<void()> &task) {
+    std::lock_guard<std::mutex> lock(m_queues[q].mutex);
+    auto &tasks = m_queues[q].tasks;
+    if (tasks.empty()) {
+      return false;
+    }
+    if (back) {
+      task = std::move(tasks.back());
+      tasks.pop_back();
+    } else {
+      task = std::move(tasks.front());
+      tasks.pop_front();
+    }
+    m_queued--;
+    return true;
+  }
+
+  bool runOne(std::size_t index) {
+    std::function<void()> task;
+    bool found = pop(index, true, task);
+    for (std::size_t k = 1; !found && k < m_queues.size(); k++) {
+      found = pop((index + k) % m_queues.size(), false, task);
+    }
+    if (!found) {
+      return false;
+    }
+
+    try {
+      task();
+    } catch (...) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      if (!m_exception) {
+        m_exception = std::current_exception();
+      }
+    }
+
+    if (--m_pending == 0) {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_cv.notify_all();
+    }
+    return true;
+  }
+
+  void workerLoop(std::size_t index) {
+    currentWorker() = Worker{this, index};
+    while (true) {
+      if (runOne(index)) {
+        continue;
+      }
+      std::unique_lock<std::mutex> lock(m_mutex);
+      m_cv.wait(lock, [this] { return m_stop || m_queued > 0; });
+      if (m_stop && m_queued == 0) {
+        return;
+      }
+    }
+  }
+
+  std::vector<Queue> m_queues;
+  std::vector<std::thread> m_threads;
+  std::mutex m_mutex;
+  std::condition_variable m_cv;
+  std::atomic<std::size_t> m_pending{0};
+  std::atomic<std::size_t> m_queued{0};
+  std::exception_ptr m_exception;
+  bool m_stop = false;
+};
+
+} // namespace dynotree
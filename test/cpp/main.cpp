@@ -1,13 +1,20 @@
 #define BOOST_TEST_MODULE test_0
 #define BOOST_TEST_DYN_LINK
 
+#include <atomic>
 #include <chrono>
+#include <filesystem>
 #include <iostream>
+#include <set>
+#include <sstream>
+#include <thread>
 
 #include "dynotree/KDTree.h"
 #include <Eigen/Dense>
 
+#include "dynotree/concurrent_kdtree.h"
 #include "dynotree/linear_nn.h"
+#include "dynotree/log_forest.h"
 
 #include "ompl/base/ScopedState.h"
 #include "ompl/base/spaces/SE3StateSpace.h"
@@ -1388,3 +1395,2153 @@ BOOST_AUTO_TEST_CASE(t_scaling) {
 BOOST_AUTO_TEST_CASE(t_scaling_so2) {
   // TODO: continue here!!
 }
+
+BOOST_AUTO_TEST_CASE(t_build) {
+
+  std::srand(0);
+  using TreeR4 = dynotree::KDTree<int, 4>;
+  using TreeRX = dynotree::KDTree<int, -1>;
+
+  int num_points = 100000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(4, num_points);
+  std::vector<int> ids(num_points);
+  for (size_t i = 0; i < ids.size(); i++) {
+    ids[i] = i;
+  }
+
+  TreeR4 tree_inc;
+  tree_inc.init_tree();
+  {
+    auto tic = std::chrono::high_resolution_clock::now();
+    for (size_t i = 0; i < X.cols(); ++i) {
+      tree_inc.addPoint(X.col(i), i);
+    }
+    std::cout << "addPoint: " << time_since_s(tic) << "s" << std::endl;
+  }
+
+  TreeR4 tree;
+  tree.init_tree();
+  {
+    auto tic = std::chrono::high_resolution_clock::now();
+    tree.build(X, ids);
+    std::cout << "build: " << time_since_s(tic) << "s" << std::endl;
+  }
+
+  TreeRX treex;
+  treex.init_tree(4);
+  treex.build(X, ids);
+
+  BOOST_TEST(tree.size() == num_points);
+  BOOST_TEST(treex.size() == num_points);
+
+  for (size_t j = 0; j < 100; j++) {
+    Eigen::Vector4d x = Eigen::Vector4d::Random();
+    auto out1 = tree.searchKnn(x, 10);
+    auto out2 = tree_inc.searchKnn(x, 10);
+    auto out3 = treex.searchKnn(x, 10);
+    BOOST_TEST(out1.size() == 10);
+    BOOST_TEST(out2.size() == 10);
+    BOOST_TEST(out3.size() == 10);
+    for (size_t i = 0; i < out1.size(); i++) {
+      BOOST_TEST(out1[i].id == out2[i].id);
+      BOOST_TEST(out1[i].id == out3[i].id);
+    }
+    BOOST_TEST(tree.search(x).id == out1[0].id);
+  }
+
+  // the tree stays dynamic after a bulk build
+  Eigen::Vector4d x = Eigen::Vector4d::Random();
+  tree.addPoint(x, num_points);
+  BOOST_TEST(tree.size() == num_points + 1);
+  BOOST_TEST(tree.search(x).id == num_points);
+  BOOST_TEST(tree.search(x).distance == 0);
+}
+
+BOOST_AUTO_TEST_CASE(t_build_parallel) {
+
+  std::srand(0);
+  using TreeR4 = dynotree::KDTree<int, 4>;
+
+  int num_points = 200000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(4, num_points);
+  std::vector<int> ids(num_points);
+  for (size_t i = 0; i < ids.size(); i++) {
+    ids[i] = i;
+  }
+
+  std::vector<TreeR4> trees;
+  for (int num_threads : {1, 2, 4, 8}) {
+    TreeR4 tree;
+    tree.init_tree();
+    auto tic = std::chrono::high_resolution_clock::now();
+    tree.build(X, ids, num_threads);
+    std::cout << "build with " << num_threads
+              << " threads: " << time_since_s(tic) << "s" << std::endl;
+    trees.push_back(tree);
+
+    TreeR4 tree2;
+    tree2.init_tree();
+    for (size_t i = 0; i < X.cols(); ++i) {
+      tree2.addPoint(X.col(i), i, false);
+    }
+    tic = std::chrono::high_resolution_clock::now();
+    tree2.splitOutstanding(num_threads);
+    std::cout << "splitOutstanding with " << num_threads
+              << " threads: " << time_since_s(tic) << "s" << std::endl;
+    trees.push_back(tree2);
+  }
+
+  for (size_t j = 0; j < 100; j++) {
+    Eigen::Vector4d x = Eigen::Vector4d::Random();
+    auto expected = trees[0].searchKnn(x, 10);
+    for (auto &tree : trees) {
+      BOOST_TEST(tree.size() == num_points);
+      auto out = tree.searchKnn(x, 10);
+      BOOST_TEST(out.size() == expected.size());
+      for (size_t i = 0; i < out.size(); i++) {
+        BOOST_TEST(out[i].id == expected[i].id);
+      }
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(t_search_batch) {
+  using TreeR4 = dynotree::KDTree<int, 4>;
+  size_t num_points = 50000;
+  size_t num_queries = 1000;
+  size_t k = 8;
+  double radius = 0.1;
+  std::srand(0);
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(4, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(4, num_queries);
+  std::vector<int> ids(num_points);
+  for (size_t i = 0; i < num_points; i++) {
+    ids[i] = i;
+  }
+
+  TreeR4 tree;
+  tree.init_tree();
+  tree.build(X, ids);
+
+  for (int num_threads : {1, 4}) {
+    for (bool reorder : {false, true}) {
+      std::vector<int> knn_ids(num_queries * k);
+      std::vector<double> knn_dists(num_queries * k);
+      auto tic = std::chrono::high_resolution_clock::now();
+      tree.searchKnnBatch(Q, k, knn_ids.data(), knn_dists.data(), num_threads,
+                          reorder);
+      std::cout << "searchKnnBatch threads " << num_threads << " reorder "
+                << reorder << ": " << time_since_s(tic) << "s" << std::endl;
+
+      std::vector<size_t> offsets;
+      std::vector<int> ball_ids;
+      std::vector<double> ball_dists;
+      tree.searchBallBatch(Q, radius, offsets, ball_ids, ball_dists,
+                           num_threads, reorder);
+      BOOST_TEST(offsets.size() == num_queries + 1);
+
+      for (size_t q = 0; q < num_queries; q++) {
+        auto knn = tree.searchKnn(Q.col(q), k);
+        BOOST_TEST(knn.size() == k);
+        for (size_t j = 0; j < k; j++) {
+          BOOST_TEST(knn_ids[q * k + j] == knn[j].id);
+          BOOST_TEST(knn_dists[q * k + j] == knn[j].distance);
+        }
+
+        auto ball = tree.searchBall(Q.col(q), radius);
+        BOOST_TEST(offsets[q + 1] - offsets[q] == ball.size());
+        for (size_t j = 0; j < ball.size(); j++) {
+          BOOST_TEST(ball_ids[offsets[q] + j] == ball[j].id);
+          BOOST_TEST(ball_dists[offsets[q] + j] == ball[j].distance);
+        }
+      }
+    }
+  }
+
+  // fewer points than k: missing neighbours have id -1 and infinite distance
+  TreeR4 small;
+  small.init_tree();
+  small.addPoint(X.col(0), 0);
+  std::vector<int> knn_ids(num_queries * k, 7);
+  std::vector<double> knn_dists(num_queries * k);
+  small.searchKnnBatch(Q, k, knn_ids.data(), knn_dists.data());
+  BOOST_TEST(knn_ids[0] == 0);
+  BOOST_TEST(knn_ids[1] == -1);
+  BOOST_TEST(knn_ids[num_queries * k - 1] == -1);
+  BOOST_TEST(std::isinf(knn_dists[1]));
+}
+
+template <typename TreeA, typename TreeB>
+void compare_knn(TreeA &treeA, TreeB &treeB, const Eigen::MatrixXd &Q,
+                 size_t k) {
+  for (size_t q = 0; q < Q.cols(); q++) {
+    auto outA = treeA.searchKnn(Q.col(q), k);
+    auto outB = treeB.searchKnn(Q.col(q), k);
+    BOOST_TEST(outA.size() == outB.size());
+    for (size_t i = 0; i < outA.size(); i++) {
+      BOOST_TEST(outA[i].id == outB[i].id);
+      BOOST_TEST(std::abs(outA[i].distance - outB[i].distance) < 1e-10);
+    }
+    BOOST_TEST(treeA.search(Q.col(q)).id == treeB.search(Q.col(q)).id);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(t_soa_layout) {
+  using dynotree::LeafLayout;
+  std::srand(0);
+  size_t num_points = 100000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(4, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(4, 1000);
+  std::vector<int> ids(num_points);
+  for (size_t i = 0; i < num_points; i++) {
+    ids[i] = i;
+  }
+
+  {
+    using TreeAoS = dynotree::KDTree<int, 4>;
+    using TreeSoA = dynotree::KDTree<int, 4, 32, double,
+                                     dynotree::Rn<double, 4>, LeafLayout::SoA>;
+    TreeAoS aos;
+    TreeSoA soa;
+    aos.init_tree();
+    soa.init_tree();
+    for (size_t i = 0; i < num_points; i++) {
+      aos.addPoint(X.col(i), i);
+      soa.addPoint(X.col(i), i);
+    }
+    compare_knn(aos, soa, Q, 10);
+
+    auto tic = std::chrono::high_resolution_clock::now();
+    for (size_t q = 0; q < Q.cols(); q++) {
+      aos.searchKnn(Q.col(q), 10);
+    }
+    std::cout << "AoS knn: " << time_since_s(tic) << "s" << std::endl;
+    tic = std::chrono::high_resolution_clock::now();
+    for (size_t q = 0; q < Q.cols(); q++) {
+      soa.searchKnn(Q.col(q), 10);
+    }
+    std::cout << "SoA knn: " << time_since_s(tic) << "s" << std::endl;
+
+    // inactive points are skipped by search
+    soa.set_inactive(X.col(0));
+    BOOST_TEST(soa.search(X.col(0)).id != 0);
+  }
+
+  {
+    // dynamic dimension, bulk build and parallel splitOutstanding
+    using StateSpace = dynotree::RnL1<double>;
+    using TreeAoS = dynotree::KDTree<int, -1, 16, double, StateSpace>;
+    using TreeSoA =
+        dynotree::KDTree<int, -1, 16, double, StateSpace, LeafLayout::SoA>;
+    TreeAoS aos;
+    TreeSoA soa, soa_split;
+    aos.init_tree(4);
+    soa.init_tree(4);
+    soa_split.init_tree(4);
+    aos.build(X, ids);
+    soa.build(X, ids);
+    for (size_t i = 0; i < num_points; i++) {
+      soa_split.addPoint(X.col(i), i, false);
+    }
+    soa_split.splitOutstanding(4);
+    compare_knn(aos, soa, Q, 10);
+    compare_knn(aos, soa_split, Q, 10);
+  }
+
+  {
+    // state space without a column kernel
+    using StateSpace = dynotree::R2SO2Squared<double>;
+    using TreeAoS = dynotree::KDTree<int, 3, 32, double, StateSpace>;
+    using TreeSoA =
+        dynotree::KDTree<int, 3, 32, double, StateSpace, LeafLayout::SoA>;
+    Eigen::MatrixXd X3 = X.topRows(3);
+    X3.row(2) *= M_PI;
+    Eigen::MatrixXd Q3 = Q.topRows(3);
+    Q3.row(2) *= M_PI;
+    TreeAoS aos;
+    TreeSoA soa;
+    aos.init_tree();
+    soa.init_tree();
+    for (size_t i = 0; i < num_points; i++) {
+      aos.addPoint(X3.col(i), i);
+      soa.addPoint(X3.col(i), i);
+    }
+    compare_knn(aos, soa, Q3, 10);
+  }
+}
+
+template <typename Scalar, typename StateSpace>
+void check_column_kernel(const StateSpace &state_space, int dims,
+                         double tol) {
+  using vec_t = Eigen::Matrix<Scalar, -1, 1>;
+  size_t n = 45; // not a multiple of the vector width
+  size_t stride = 48;
+  Eigen::Matrix<Scalar, -1, -1> points =
+      Eigen::Matrix<Scalar, -1, -1>::Random(stride, dims);
+  vec_t x = vec_t::Random(dims);
+  std::vector<Scalar> out(n + 1, Scalar(-1));
+
+  dynotree::simd::Isa previous = dynotree::simd::active_isa();
+  for (auto isa : {dynotree::simd::Isa::Scalar, dynotree::simd::Isa::Avx2,
+                   dynotree::simd::Isa::Avx512}) {
+    if (!dynotree::simd::supported(isa)) {
+      continue;
+    }
+    dynotree::simd::active_isa() = isa;
+    state_space.distance_to_columns(x.data(), dims, points.data(), stride, n,
+                                    out.data());
+    for (size_t j = 0; j < n; j++) {
+      vec_t y = points.row(j).transpose();
+      BOOST_TEST(std::abs(out[j] - state_space.distance(x, y)) < tol);
+    }
+    BOOST_TEST(out[n] == Scalar(-1)); // nothing written past n
+  }
+  dynotree::simd::active_isa() = previous;
+}
+
+template <typename Scalar, typename StateSpace>
+void check_row_kernel(const StateSpace &state_space, int dims, double tol) {
+  using vec_t = Eigen::Matrix<Scalar, -1, 1>;
+  size_t n = 45;            // not a multiple of the vector width
+  size_t stride = dims + 3; // rows with padding, as in a PointId record
+  Eigen::Matrix<Scalar, -1, -1> points =
+      Eigen::Matrix<Scalar, -1, -1>::Random(stride, n);
+  vec_t x = vec_t::Random(dims);
+  std::vector<Scalar> out(n + 1, Scalar(-1));
+
+  dynotree::simd::Isa previous = dynotree::simd::active_isa();
+  for (auto isa : {dynotree::simd::Isa::Scalar, dynotree::simd::Isa::Avx2,
+                   dynotree::simd::Isa::Avx512}) {
+    if (!dynotree::simd::supported(isa)) {
+      continue;
+    }
+    dynotree::simd::active_isa() = isa;
+    bool computed = state_space.distance_to_rows(x.data(), dims, points.data(),
+                                                 stride, n, out.data());
+    BOOST_TEST(computed == (isa == dynotree::simd::Isa::Avx512));
+    if (!computed) {
+      BOOST_TEST(out[0] == Scalar(-1));
+      continue;
+    }
+    for (size_t j = 0; j < n; j++) {
+      vec_t y = points.col(j).head(dims);
+      BOOST_TEST(std::abs(out[j] - state_space.distance(x, y)) < tol);
+    }
+    BOOST_TEST(out[n] == Scalar(-1)); // nothing written past n
+  }
+  dynotree::simd::active_isa() = previous;
+}
+
+BOOST_AUTO_TEST_CASE(t_simd_kernels) {
+  std::srand(0);
+  const int dims = 7;
+  Eigen::VectorXd weights = Eigen::VectorXd::Random(dims).cwiseAbs();
+
+  dynotree::Rn<double, dims> rn;
+  dynotree::RnSquared<double, dims> rn_squared;
+  dynotree::RnL1<double, dims> rn_l1;
+  for (int weighted = 0; weighted < 2; weighted++) {
+    check_column_kernel<double>(rn, dims, 1e-12);
+    check_column_kernel<double>(rn_squared, dims, 1e-12);
+    check_column_kernel<double>(rn_l1, dims, 1e-12);
+    check_row_kernel<double>(rn, dims, 1e-12);
+    check_row_kernel<double>(rn_squared, dims, 1e-12);
+    check_row_kernel<double>(rn_l1, dims, 1e-12);
+    rn.set_weights(weights);
+    rn_squared.set_weights(weights);
+    rn_l1.set_weights(weights);
+  }
+
+  dynotree::Rn<float> rn_float;
+  dynotree::RnL1<float> rn_l1_float;
+  check_column_kernel<float>(rn_float, dims, 1e-5);
+  check_column_kernel<float>(rn_l1_float, dims, 1e-5);
+  check_row_kernel<float>(rn_float, dims, 1e-5);
+  check_row_kernel<float>(rn_l1_float, dims, 1e-5);
+}
+
+template <dynotree::LeafLayout Layout, int Dims, typename StateSpace>
+void check_compressed_layout(const StateSpace &state_space,
+                             const Eigen::MatrixXd &X,
+                             const Eigen::MatrixXd &Q) {
+  using TreeExact = dynotree::KDTree<int, Dims, 32, double, StateSpace>;
+  using Tree = dynotree::KDTree<int, Dims, 32, double, StateSpace, Layout>;
+  TreeExact exact;
+  Tree tree, built;
+  exact.init_tree(X.rows(), state_space);
+  tree.init_tree(X.rows(), state_space);
+  built.init_tree(X.rows(), state_space);
+  std::vector<int> ids(X.cols());
+  for (size_t i = 0; i < X.cols(); i++) {
+    ids[i] = i;
+    exact.addPoint(X.col(i), i);
+    tree.addPoint(X.col(i), i);
+  }
+  built.build(X, ids);
+
+  // rescoring makes results identical to the exact tree
+  for (auto *t : {&tree, &built}) {
+    for (size_t q = 0; q < Q.cols(); q++) {
+      auto expected = exact.searchKnn(Q.col(q), 10);
+      auto out = t->searchKnn(Q.col(q), 10);
+      BOOST_TEST(out.size() == expected.size());
+      for (size_t i = 0; i < out.size(); i++) {
+        BOOST_TEST(out[i].id == expected[i].id);
+        BOOST_TEST(out[i].distance == expected[i].distance);
+      }
+      BOOST_TEST(t->search(Q.col(q)).id == exact.search(Q.col(q)).id);
+      BOOST_TEST(t->searchBall(Q.col(q), 0.2).size() ==
+                 exact.searchBall(Q.col(q), 0.2).size());
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(t_compressed_layout) {
+  using dynotree::LeafLayout;
+  std::srand(0);
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(4, 20000);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(4, 200);
+  // many points share coordinates, some are far away
+  X.row(3) = X.row(3).array().round();
+  X.col(0) *= 1000;
+
+  dynotree::Rn<double, 4> rn;
+  check_compressed_layout<LeafLayout::Float32, 4>(rn, X, Q);
+  check_compressed_layout<LeafLayout::Int16, 4>(rn, X, Q);
+
+  dynotree::RnSquared<double> rn_squared;
+  rn_squared.set_weights(Eigen::Vector4d(1, 2, 3, 4));
+  check_compressed_layout<LeafLayout::Float32, -1>(rn_squared, X, Q);
+  check_compressed_layout<LeafLayout::Int16, -1>(rn_squared, X, Q);
+
+  dynotree::RnL1<double, 4> rn_l1;
+  rn_l1.set_weights(Eigen::Vector4d(4, 3, 2, 1));
+  check_compressed_layout<LeafLayout::Float32, 4>(rn_l1, X, Q);
+  check_compressed_layout<LeafLayout::Int16, 4>(rn_l1, X, Q);
+}
+
+BOOST_AUTO_TEST_CASE(t_runtime_dimension) {
+  std::srand(0);
+  size_t num_points = 100000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(4, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(4, 2000);
+  std::vector<int> ids(num_points);
+  for (size_t i = 0; i < num_points; i++) {
+    ids[i] = i;
+  }
+
+  using TreeRX = dynotree::KDTree<int, -1>;
+  using TreeR4 = dynotree::KDTree<int, 4>;
+  TreeRX treex, treex_build, treex_split;
+  TreeR4 tree4;
+  treex.init_tree(4);
+  treex_build.init_tree(4);
+  treex_split.init_tree(4);
+  tree4.init_tree();
+
+  auto tic = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < num_points; i++) {
+    treex.addPoint(X.col(i), i);
+  }
+  std::cout << "add X: " << time_since_s(tic) << "s" << std::endl;
+  tic = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < num_points; i++) {
+    tree4.addPoint(X.col(i), i);
+  }
+  std::cout << "add 4: " << time_since_s(tic) << "s" << std::endl;
+
+  treex_build.build(X, ids, 4);
+  for (size_t i = 0; i < num_points; i++) {
+    treex_split.addPoint(X.col(i), i, false);
+  }
+  treex_split.splitOutstanding(4);
+
+  compare_knn(treex, tree4, Q, 10);
+  compare_knn(treex_build, tree4, Q, 10);
+  compare_knn(treex_split, tree4, Q, 10);
+
+  Eigen::VectorXd x(4);
+  Eigen::Vector4d x4;
+  tic = std::chrono::high_resolution_clock::now();
+  for (size_t q = 0; q < Q.cols(); q++) {
+    x = Q.col(q);
+    treex.searchKnn(x, 10);
+  }
+  std::cout << "knn X: " << time_since_s(tic) << "s" << std::endl;
+  tic = std::chrono::high_resolution_clock::now();
+  for (size_t q = 0; q < Q.cols(); q++) {
+    x4 = Q.col(q);
+    tree4.searchKnn(x4, 10);
+  }
+  std::cout << "knn 4: " << time_since_s(tic) << "s" << std::endl;
+
+  treex.set_inactive(X.col(0));
+  BOOST_TEST(treex.search(X.col(0)).id != 0);
+}
+
+template <typename Tree>
+void check_incremental_bounds(Tree &tree, const Eigen::MatrixXd &X,
+                              const Eigen::MatrixXd &Q, size_t k,
+                              double radius) {
+  Tree incremental = tree;
+  incremental.setIncrementalBounds();
+  compare_knn(tree, incremental, Q, k);
+  for (size_t q = 0; q < Q.cols(); q++) {
+    auto outA = tree.searchBall(Q.col(q), radius);
+    auto outB = incremental.searchBall(Q.col(q), radius);
+    BOOST_TEST(outA.size() == outB.size());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(t_incremental_bounds) {
+  std::srand(0);
+  size_t num_points = 50000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(7, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(7, 1000);
+  std::vector<int> ids(num_points);
+  for (size_t i = 0; i < num_points; i++) {
+    ids[i] = i;
+  }
+
+  {
+    using TreeR7 = dynotree::KDTree<int, 7>;
+    TreeR7 tree, tree_build;
+    tree.init_tree();
+    tree_build.init_tree();
+    for (size_t i = 0; i < num_points; i++) {
+      tree.addPoint(X.col(i), i);
+    }
+    tree_build.build(X, ids);
+    check_incremental_bounds(tree, X, Q, 10, .5);
+    check_incremental_bounds(tree_build, X, Q, 10, .5);
+
+    TreeR7 incremental = tree;
+    incremental.setIncrementalBounds();
+    auto tic = std::chrono::high_resolution_clock::now();
+    for (size_t q = 0; q < Q.cols(); q++) {
+      tree.searchKnn(Q.col(q), 10);
+    }
+    std::cout << "R7 box bounds knn: " << time_since_s(tic) << "s"
+              << std::endl;
+    tic = std::chrono::high_resolution_clock::now();
+    for (size_t q = 0; q < Q.cols(); q++) {
+      incremental.searchKnn(Q.col(q), 10);
+    }
+    std::cout << "R7 incremental bounds knn: " << time_since_s(tic) << "s"
+              << std::endl;
+  }
+
+  {
+    using Tree =
+        dynotree::KDTree<int, 7, 32, double, dynotree::RnSquared<double, 7>>;
+    Tree tree;
+    tree.init_tree();
+    tree.build(X, ids);
+    check_incremental_bounds(tree, X, Q, 10, .25);
+  }
+
+  {
+    using Tree =
+        dynotree::KDTree<int, -1, 16, double, dynotree::RnL1<double>>;
+    Tree tree;
+    tree.init_tree(7);
+    for (size_t i = 0; i < num_points; i++) {
+      tree.addPoint(X.col(i), i);
+    }
+    check_incremental_bounds(tree, X, Q, 10, 1.);
+  }
+
+  {
+    using Tree = dynotree::KDTree<int, 1, 8, double, dynotree::SO2<double>>;
+    Eigen::MatrixXd X1 = M_PI * X.topRows(1);
+    Eigen::MatrixXd Q1 = M_PI * Q.topRows(1);
+    Tree tree;
+    tree.init_tree();
+    for (size_t i = 0; i < 2000; i++) {
+      tree.addPoint(X1.col(i), i);
+    }
+    check_incremental_bounds(tree, X1, Q1, 5, .1);
+  }
+
+  {
+    using Tree =
+        dynotree::KDTree<int, -1, 32, double, dynotree::Combined<double>>;
+    dynotree::Combined<double> space({"Rn:3", "SO2", "RnL1:2", "RnSquared:1"});
+    Tree tree;
+    tree.init_tree(7, space);
+    for (size_t i = 0; i < num_points; i++) {
+      tree.addPoint(X.col(i), i);
+    }
+    check_incremental_bounds(tree, X, Q, 10, .5);
+
+    // SO3 is not separable
+    Tree tree_so3;
+    tree_so3.init_tree(7, dynotree::Combined<double>({"Rn:3", "SO3"}));
+    BOOST_CHECK_THROW(tree_so3.setIncrementalBounds(), std::runtime_error);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(t_best_first) {
+  std::srand(0);
+  // clustered data: a few tight clusters of very different sizes
+  size_t num_points = 100000;
+  int dims = 6;
+  Eigen::MatrixXd centers = Eigen::MatrixXd::Random(dims, 20);
+  Eigen::MatrixXd X(dims, num_points);
+  for (size_t i = 0; i < num_points; i++) {
+    int c = (i * i) % 20;
+    double scale = 0.001 * (1 + c * c);
+    X.col(i) = centers.col(c) + scale * Eigen::VectorXd::Random(dims);
+  }
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(dims, 2000);
+
+  using Tree = dynotree::KDTree<int, 6>;
+  Tree tree;
+  tree.init_tree();
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+
+  auto dfs = tree.searcher();
+  auto best = tree.searcher();
+  best.setTraversal(dynotree::Traversal::BestFirst);
+  BOOST_TEST((tree.searcher().traversal() == dynotree::Traversal::DepthFirst));
+
+  std::size_t k = 10;
+  for (size_t q = 0; q < Q.cols(); q++) {
+    auto outA = dfs.search(Q.col(q), std::numeric_limits<double>::max(), k,
+                           tree.getStateSpace());
+    auto outB = best.search(Q.col(q), std::numeric_limits<double>::max(), k,
+                            tree.getStateSpace());
+    BOOST_TEST(outA.size() == outB.size());
+    for (size_t i = 0; i < outA.size(); i++) {
+      BOOST_TEST(outA[i].id == outB[i].id);
+    }
+    BOOST_TEST(best.visitedNodes() <= dfs.visitedNodes());
+
+    // per query traversal, and a radius search
+    auto outC = dfs.search(Q.col(q), .2, 1000, tree.getStateSpace(),
+                           dynotree::Traversal::BestFirst);
+    auto outD = best.search(Q.col(q), .2, 1000, tree.getStateSpace(),
+                            dynotree::Traversal::DepthFirst);
+    BOOST_TEST(outC.size() == outD.size());
+  }
+
+  for (auto traversal :
+       {dynotree::Traversal::DepthFirst, dynotree::Traversal::BestFirst}) {
+    auto searcher = tree.searcher();
+    searcher.setTraversal(traversal);
+    std::size_t visited = 0;
+    auto tic = std::chrono::high_resolution_clock::now();
+    for (size_t q = 0; q < Q.cols(); q++) {
+      searcher.search(Q.col(q), std::numeric_limits<double>::max(), k,
+                      tree.getStateSpace());
+      visited += searcher.visitedNodes();
+    }
+    std::cout << (traversal == dynotree::Traversal::BestFirst ? "best-first"
+                                                              : "depth-first")
+              << " knn: " << time_since_s(tic) << "s, nodes per query: "
+              << double(visited) / Q.cols() << std::endl;
+  }
+}
+
+template <typename Tree>
+void check_approximate_knn(Tree &tree, const Eigen::MatrixXd &Q, size_t k,
+                           double eps) {
+  auto exact = tree.searcher();
+  auto approx = tree.searcher();
+  std::size_t visited_exact = 0, visited_approx = 0;
+  for (size_t q = 0; q < Q.cols(); q++) {
+    auto outA = exact.search(Q.col(q), std::numeric_limits<double>::max(), k,
+                             tree.getStateSpace());
+    auto outB = approx.search(Q.col(q), std::numeric_limits<double>::max(),
+                              k, tree.getStateSpace(), eps);
+    visited_exact += exact.visitedNodes();
+    visited_approx += approx.visitedNodes();
+    BOOST_TEST(outA.size() == outB.size());
+    for (size_t i = 0; i < outA.size(); i++) {
+      BOOST_TEST(outB[i].distance <= (1 + eps) * outA[i].distance + 1e-12);
+    }
+    BOOST_TEST(tree.search(Q.col(q), eps).distance <=
+               (1 + eps) * outA[0].distance + 1e-12);
+    BOOST_TEST(tree.searchKnn(Q.col(q), k, eps).back().distance <=
+               (1 + eps) * outA.back().distance + 1e-12);
+  }
+  BOOST_TEST(visited_approx <= visited_exact);
+  std::cout << "eps " << eps << ": nodes per query "
+            << double(visited_approx) / Q.cols() << " (exact "
+            << double(visited_exact) / Q.cols() << ")" << std::endl;
+}
+
+BOOST_AUTO_TEST_CASE(t_approximate_knn) {
+  std::srand(0);
+  size_t num_points = 50000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(10, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(10, 500);
+
+  {
+    using Tree = dynotree::KDTree<int, 10>;
+    Tree tree;
+    tree.init_tree();
+    for (size_t i = 0; i < num_points; i++) {
+      tree.addPoint(X.col(i), i);
+    }
+    for (double eps : {0.1, 0.5, 1.}) {
+      check_approximate_knn(tree, Q, 10, eps);
+    }
+    tree.setIncrementalBounds();
+    check_approximate_knn(tree, Q, 10, .5);
+  }
+
+  {
+    using Tree =
+        dynotree::KDTree<int, -1, 32, double, dynotree::Combined<double>>;
+    Tree tree;
+    tree.init_tree(
+        10, dynotree::Combined<double>({"Rn:3", "SO3", "SO2", "RnL1:2"}));
+    for (size_t i = 0; i < num_points; i++) {
+      Eigen::VectorXd x = X.col(i);
+      x.segment(3, 4).normalize();
+      tree.addPoint(x, i);
+    }
+    Eigen::MatrixXd Qn = Q;
+    for (size_t q = 0; q < Q.cols(); q++) {
+      Qn.col(q).segment(3, 4).normalize();
+    }
+    check_approximate_knn(tree, Qn, 10, .5);
+  }
+}
+
+template <typename Tree>
+void check_knn_brute_force(Tree &tree, const Eigen::MatrixXd &X,
+                           const std::vector<bool> &alive,
+                           const Eigen::MatrixXd &Q, size_t k) {
+  for (size_t q = 0; q < Q.cols(); q++) {
+    std::vector<double> distances;
+    for (size_t i = 0; i < X.cols(); i++) {
+      if (alive[i]) {
+        distances.push_back(
+            tree.getStateSpace().distance(Q.col(q), X.col(i)));
+      }
+    }
+    std::sort(distances.begin(), distances.end());
+    auto out = tree.searchKnn(Q.col(q), k);
+    BOOST_TEST(out.size() == std::min(k, distances.size()));
+    for (size_t i = 0; i < out.size(); i++) {
+      BOOST_TEST(alive[out[i].id]);
+      BOOST_TEST(std::abs(out[i].distance - distances[i]) < 1e-10);
+    }
+  }
+}
+
+template <typename Tree> void check_remove_point(int dims) {
+  std::srand(0);
+  size_t num_points = 20000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(dims, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(dims, 200);
+  std::vector<int> ids(num_points);
+  for (size_t i = 0; i < num_points; i++) {
+    ids[i] = i;
+  }
+  std::vector<bool> alive(num_points, true);
+
+  Tree tree, tree_build;
+  tree.init_tree(dims);
+  tree_build.init_tree(dims);
+  tree.setIdIndex();
+  tree_build.setIdIndex();
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+  tree_build.build(X, ids);
+
+  // remove three quarters of the points
+  for (size_t i = 0; i < num_points; i++) {
+    if (i % 4 != 0) {
+      BOOST_TEST(tree.removePoint(i));
+      BOOST_TEST(tree_build.removePoint(i));
+      alive[i] = false;
+    }
+  }
+  BOOST_TEST(tree.size() == num_points / 4);
+  BOOST_TEST(tree_build.size() == num_points / 4);
+  BOOST_TEST(!tree.removePoint(1));
+  BOOST_TEST(!tree.removePoint(-1));
+  check_knn_brute_force(tree, X, alive, Q, 10);
+  check_knn_brute_force(tree_build, X, alive, Q, 10);
+
+  // churn: removed points come back, others go
+  for (size_t i = 0; i < num_points; i++) {
+    if (i % 4 != 0) {
+      tree.addPoint(X.col(i), i);
+      alive[i] = true;
+    } else if (i % 8 == 0) {
+      BOOST_TEST(tree.removePoint(i));
+      alive[i] = false;
+    }
+  }
+  check_knn_brute_force(tree, X, alive, Q, 10);
+
+  // empty the tree and fill it again
+  for (size_t i = 0; i < num_points; i++) {
+    if (alive[i]) {
+      BOOST_TEST(tree.removePoint(i));
+      alive[i] = false;
+    }
+  }
+  BOOST_TEST(tree.size() == 0);
+  BOOST_TEST(tree.searchKnn(Q.col(0), 5).size() == 0);
+  for (size_t i = 0; i < num_points; i += 2) {
+    tree.addPoint(X.col(i), i);
+    alive[i] = true;
+  }
+  check_knn_brute_force(tree, X, alive, Q, 10);
+}
+
+BOOST_AUTO_TEST_CASE(t_remove_point) {
+  using dynotree::LeafLayout;
+  check_remove_point<dynotree::KDTree<int, 4>>(4);
+  check_remove_point<dynotree::KDTree<int, -1, 16>>(6);
+  check_remove_point<dynotree::KDTree<int, 4, 32, double,
+                                      dynotree::Rn<double, 4>,
+                                      LeafLayout::SoA>>(4);
+  check_remove_point<dynotree::KDTree<int, -1, 32, double,
+                                      dynotree::RnSquared<double>,
+                                      LeafLayout::Int16>>(5);
+}
+
+template <typename Tree> void check_update_point(int dims) {
+  std::srand(0);
+  size_t num_points = 20000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(dims, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(dims, 200);
+  std::vector<bool> alive(num_points, true);
+
+  Tree tree;
+  tree.init_tree(dims);
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+  BOOST_CHECK_THROW(tree.updatePoint(0, X.col(0)), std::runtime_error);
+  BOOST_TEST(!tree.idIndex());
+  tree.setIdIndex();
+  BOOST_TEST(tree.idIndex());
+
+  // small moves mostly stay in their leaf, large ones cross the tree
+  for (double step : {0.001, 0.5}) {
+    for (int tick = 0; tick < 3; tick++) {
+      for (size_t i = 0; i < num_points; i += 3) {
+        X.col(i) += step * Eigen::VectorXd::Random(dims);
+        BOOST_TEST(tree.updatePoint(i, X.col(i)));
+      }
+      check_knn_brute_force(tree, X, alive, Q, 10);
+    }
+  }
+  BOOST_TEST(tree.size() == num_points);
+  BOOST_TEST(!tree.updatePoint(-1, X.col(0)));
+
+  typename Tree::point_t x;
+  BOOST_TEST(tree.getPoint(7, x));
+  BOOST_TEST((x - X.col(7)).norm() < 1e-12);
+  BOOST_TEST(!tree.getPoint(-1, x));
+
+  BOOST_TEST(tree.removePoint(7));
+  alive[7] = false;
+  BOOST_TEST(!tree.getPoint(7, x));
+  check_knn_brute_force(tree, X, alive, Q, 10);
+
+  // an inactive point stays inactive when it moves to another leaf
+  tree.set_inactive(X.col(8));
+  alive[8] = false;
+  X.col(8) = -X.col(8);
+  BOOST_TEST(tree.updatePoint(8, X.col(8)));
+  BOOST_TEST(tree.getPoint(8, x));
+  BOOST_TEST(tree.search(X.col(8)).id != 8);
+  check_knn_brute_force(tree, X, alive, Q, 10);
+  BOOST_TEST(tree.removePoint(8));
+}
+
+BOOST_AUTO_TEST_CASE(t_update_point) {
+  using dynotree::LeafLayout;
+  check_update_point<dynotree::KDTree<int, 4>>(4);
+  check_update_point<dynotree::KDTree<int, -1, 16>>(6);
+  check_update_point<dynotree::KDTree<int, -1, 32, double,
+                                      dynotree::RnSquared<double>,
+                                      LeafLayout::Int16>>(5);
+
+  // a tick of a moving-obstacle workload: in place vs remove and add
+  std::srand(0);
+  size_t num_points = 100000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(3, num_points);
+  using Tree = dynotree::KDTree<int, 3>;
+  Tree moved, reinserted;
+  moved.init_tree();
+  reinserted.init_tree();
+  for (size_t i = 0; i < num_points; i++) {
+    moved.addPoint(X.col(i), i);
+    reinserted.addPoint(X.col(i), i);
+  }
+  moved.setIdIndex();
+  reinserted.setIdIndex();
+  Eigen::MatrixXd Y = X + 1e-3 * Eigen::MatrixXd::Random(3, num_points);
+
+  auto tic = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < num_points; i++) {
+    moved.updatePoint(i, Y.col(i));
+  }
+  std::cout << "updatePoint: " << time_since_s(tic) << "s" << std::endl;
+  tic = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < num_points; i++) {
+    reinserted.removePoint(i);
+    reinserted.addPoint(Y.col(i), i);
+  }
+  std::cout << "removePoint + addPoint: " << time_since_s(tic) << "s"
+            << std::endl;
+}
+
+template <typename Tree> void check_rebalance(int dims) {
+  // a random walk: every point is inserted next to the previous one
+  std::srand(0);
+  size_t num_points = 20000;
+  Eigen::MatrixXd X(dims, num_points);
+  X.col(0).setZero();
+  for (size_t i = 1; i < num_points; i++) {
+    X.col(i) = X.col(i - 1) + 0.01 * Eigen::VectorXd::Random(dims);
+  }
+  Eigen::MatrixXd Q = X.rowwise().mean().replicate(1, 200) +
+                      Eigen::MatrixXd::Random(dims, 200);
+  std::vector<bool> alive(num_points, true);
+
+  Tree plain, balanced;
+  plain.init_tree(dims);
+  balanced.init_tree(dims);
+  balanced.setBalanceFactor(.7);
+  balanced.setIdIndex();
+  for (size_t i = 0; i < num_points; i++) {
+    plain.addPoint(X.col(i), i);
+    balanced.addPoint(X.col(i), i);
+  }
+  BOOST_TEST(balanced.size() == num_points);
+  BOOST_TEST(balanced.depthStats().maxDepth <=
+             plain.depthStats().maxDepth);
+  check_knn_brute_force(balanced, X, alive, Q, 10);
+
+  typename Tree::point_t x;
+  for (size_t i = 0; i < num_points; i += 97) {
+    BOOST_TEST(balanced.getPoint(i, x));
+    BOOST_TEST((x - X.col(i)).norm() == 0);
+  }
+  for (size_t i = 0; i < num_points; i += 2) {
+    BOOST_TEST(balanced.removePoint(i));
+    alive[i] = false;
+  }
+  check_knn_brute_force(balanced, X, alive, Q, 10);
+}
+
+BOOST_AUTO_TEST_CASE(t_rebalance) {
+  using dynotree::LeafLayout;
+  check_rebalance<dynotree::KDTree<int, 3>>(3);
+  check_rebalance<dynotree::KDTree<int, -1, 8>>(5);
+  check_rebalance<dynotree::KDTree<int, -1, 32, double,
+                                   dynotree::RnSquared<double>,
+                                   LeafLayout::SoA>>(4);
+  dynotree::KDTree<int, 3> invalid;
+  BOOST_CHECK_THROW(invalid.setBalanceFactor(.4), std::runtime_error);
+
+  // points sorted along the first axis, as produced by a sweeping sampler
+  size_t num_points = 200000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(3, num_points);
+  std::vector<size_t> order(num_points);
+  for (size_t i = 0; i < num_points; i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(),
+            [&](size_t a, size_t b) { return X(0, a) < X(0, b); });
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(3, 20000);
+
+  for (double alpha : {0., .6, .7, .8}) {
+    using Tree = dynotree::KDTree<int, 3>;
+    Tree tree;
+    tree.init_tree();
+    tree.setBalanceFactor(alpha);
+    auto tic = std::chrono::high_resolution_clock::now();
+    for (size_t i : order) {
+      tree.addPoint(X.col(i), i);
+    }
+    double insert = time_since_s(tic);
+    tic = std::chrono::high_resolution_clock::now();
+    for (size_t q = 0; q < Q.cols(); q++) {
+      tree.searchKnn(Q.col(q), 10);
+    }
+    auto stats = tree.depthStats();
+    std::cout << "alpha " << alpha << ": insert " << insert << "s, knn "
+              << time_since_s(tic) << "s, max depth " << stats.maxDepth
+              << ", mean depth " << stats.meanDepth << std::endl;
+  }
+}
+
+template <typename Tree> void check_log_forest(int dims) {
+  std::srand(0);
+  size_t num_points = 10000 + 17;
+  Eigen::MatrixXd X(dims, num_points);
+  X.col(0).setZero();
+  for (size_t i = 1; i < num_points; i++) {
+    X.col(i) = X.col(i - 1) + 0.01 * Eigen::VectorXd::Random(dims);
+  }
+  Eigen::MatrixXd Q = X.rowwise().mean().replicate(1, 200) +
+                      Eigen::MatrixXd::Random(dims, 200);
+  std::vector<bool> alive(num_points, true);
+
+  Tree forest;
+  forest.init_tree(dims);
+  BOOST_TEST(forest.search(Q.col(0)).distance ==
+             std::numeric_limits<double>::infinity());
+  for (size_t i = 0; i < num_points; i++) {
+    forest.addPoint(X.col(i), i);
+  }
+  BOOST_TEST(forest.size() == num_points);
+  BOOST_TEST(forest.numTrees() <= std::log2(num_points));
+  check_knn_brute_force(forest, X, alive, Q, 10);
+
+  for (size_t q = 0; q < Q.cols(); q++) {
+    double radius = .3;
+    std::vector<double> inside;
+    for (size_t i = 0; i < num_points; i++) {
+      double d = forest.getStateSpace().distance(Q.col(q), X.col(i));
+      if (d < radius) {
+        inside.push_back(d);
+      }
+    }
+    std::sort(inside.begin(), inside.end());
+    auto ball = forest.searchBall(Q.col(q), radius);
+    BOOST_TEST(ball.size() == inside.size());
+    for (size_t i = 0; i < std::min(ball.size(), inside.size()); i++) {
+      BOOST_TEST(std::abs(ball[i].distance - inside[i]) < 1e-10);
+    }
+    auto nn = forest.search(Q.col(q));
+    BOOST_TEST(nn.distance == forest.searchKnn(Q.col(q), 1)[0].distance);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(t_log_forest) {
+  using dynotree::LeafLayout;
+  check_log_forest<dynotree::LogForest<int, 3>>(3);
+  check_log_forest<dynotree::LogForest<int, -1, 8>>(5);
+  check_log_forest<dynotree::LogForest<int, -1, 32, double,
+                                       dynotree::RnSquared<double>,
+                                       LeafLayout::SoA>>(4);
+
+  // an insert-heavy planning run: every new state is a perturbation of the
+  // nearest existing state to a random sample
+  size_t num_points = 100000;
+  Eigen::MatrixXd samples = 10 * Eigen::MatrixXd::Random(3, num_points);
+
+  auto run = [&](auto &index, const char *name) {
+    std::srand(0);
+    index.init_tree();
+    index.addPoint(Eigen::Vector3d::Zero(), 0);
+    Eigen::MatrixXd states(3, num_points);
+    states.col(0).setZero();
+    auto tic = std::chrono::high_resolution_clock::now();
+    for (size_t i = 1; i < num_points; i++) {
+      auto nn = index.search(samples.col(i));
+      Eigen::Vector3d step = samples.col(i) - states.col(nn.id);
+      states.col(i) = states.col(nn.id) + 0.05 * step.normalized();
+      index.addPoint(states.col(i), i);
+    }
+    std::cout << name << ": " << time_since_s(tic) << "s" << std::endl;
+  };
+  dynotree::KDTree<int, 3> tree;
+  dynotree::LogForest<int, 3> forest;
+  run(tree, "KDTree");
+  run(forest, "LogForest");
+}
+
+BOOST_AUTO_TEST_CASE(t_log_forest_snapshot) {
+  // one writer inserts and publishes while readers query snapshots; ids are
+  // insertion indices, so a snapshot of size s holds exactly ids < s
+  std::srand(0);
+  size_t num_points = 50000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(3, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(3, 100);
+  using Forest = dynotree::LogForest<int, 3>;
+  Forest forest;
+  forest.init_tree();
+
+  std::atomic<bool> done{false};
+  std::atomic<size_t> queries{0}, errors{0};
+  auto reader = [&] {
+    size_t q = 0;
+    while (!done) {
+      auto snapshot = forest.snapshot();
+      size_t s = snapshot->size();
+      auto out = snapshot->searchKnn(Q.col(q), 5);
+      std::vector<double> distances;
+      for (size_t i = 0; i < s; i++) {
+        distances.push_back((Q.col(q) - X.col(i)).norm());
+      }
+      std::sort(distances.begin(), distances.end());
+      if (out.size() != std::min<size_t>(5, s)) {
+        errors++;
+      }
+      for (size_t i = 0; i < out.size(); i++) {
+        if (size_t(out[i].id) >= s ||
+            std::abs(out[i].distance - distances[i]) > 1e-10) {
+          errors++;
+        }
+      }
+      queries++;
+      q = (q + 1) % Q.cols();
+    }
+  };
+
+  std::vector<std::thread> readers;
+  for (int i = 0; i < 3; i++) {
+    readers.emplace_back(reader);
+  }
+  auto tic = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < num_points; i++) {
+    forest.addPoint(X.col(i), i);
+    if (i % 64 == 0) {
+      forest.publish();
+    }
+  }
+  forest.publish();
+  double elapsed = time_since_s(tic);
+  done = true;
+  for (auto &thread : readers) {
+    thread.join();
+  }
+  BOOST_TEST(errors == 0);
+  BOOST_TEST(forest.snapshot()->size() == num_points);
+  std::cout << "writer with 3 readers: " << elapsed << "s, " << queries
+            << " snapshot queries" << std::endl;
+}
+
+template <typename Tree> void check_concurrent_insert(int dims) {
+  std::srand(0);
+  size_t num_points = 20000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(dims, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(dims, 200);
+  std::vector<bool> alive(num_points, true);
+
+  Tree tree;
+  tree.init_tree(dims);
+  int num_threads = 8;
+  std::vector<std::thread> threads;
+  for (int t = 0; t < num_threads; t++) {
+    threads.emplace_back([&, t] {
+      for (size_t i = t; i < num_points; i += num_threads) {
+        tree.addPoint(X.col(i), i);
+        tree.searchKnn(Q.col(i % Q.cols()), 5);
+      }
+    });
+  }
+  for (auto &thread : threads) {
+    thread.join();
+  }
+  BOOST_TEST(tree.size() == num_points);
+  check_knn_brute_force(tree, X, alive, Q, 10);
+  for (size_t i = 0; i < num_points; i += 101) {
+    auto nn = tree.search(X.col(i));
+    BOOST_TEST(nn.id == int(i));
+    BOOST_TEST(nn.distance == 0);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(t_concurrent_insert) {
+  check_concurrent_insert<dynotree::ConcurrentKDTree<int, 3>>(3);
+  check_concurrent_insert<dynotree::ConcurrentKDTree<int, -1, 8>>(6);
+  check_concurrent_insert<dynotree::ConcurrentKDTree<
+      int, -1, 32, double, dynotree::RnSquared<double>>>(4);
+
+  // throughput of a mixed workload: every thread inserts a point and then
+  // runs a 10-nn query, as in a parallel RRT
+  size_t num_ops = 200000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(4, num_ops);
+  for (int num_threads : {1, 2, 4, 8, 16, 32, 64}) {
+    dynotree::ConcurrentKDTree<int, 4> tree;
+    tree.init_tree();
+    std::vector<std::thread> threads;
+    auto tic = std::chrono::high_resolution_clock::now();
+    for (int t = 0; t < num_threads; t++) {
+      threads.emplace_back([&, t] {
+        for (size_t i = t; i < num_ops; i += num_threads) {
+          tree.addPoint(X.col(i), i);
+          tree.searchKnn(X.col(num_ops - 1 - i), 10);
+        }
+      });
+    }
+    for (auto &thread : threads) {
+      thread.join();
+    }
+    double elapsed = time_since_s(tic);
+    BOOST_TEST(tree.size() == num_ops);
+    std::cout << num_threads << " threads: " << num_ops / elapsed
+              << " insert+query per s" << std::endl;
+  }
+
+  // reference: the single-threaded tree on the same workload
+  dynotree::KDTree<int, 4> tree;
+  tree.init_tree();
+  auto tic = std::chrono::high_resolution_clock::now();
+  for (size_t i = 0; i < num_ops; i++) {
+    tree.addPoint(X.col(i), i);
+    tree.searchKnn(X.col(num_ops - 1 - i), 10);
+  }
+  std::cout << "KDTree: " << num_ops / time_since_s(tic)
+            << " insert+query per s" << std::endl;
+}
+
+// Counts heap allocations, to check that warm queries do not allocate.
+static std::atomic<size_t> num_allocations{0};
+
+void *operator new(std::size_t size) {
+  num_allocations++;
+  if (void *p = std::malloc(size)) {
+    return p;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, std::size_t) noexcept { std::free(p); }
+
+template <typename Tree> void check_no_allocation(int dims, bool incremental) {
+  std::srand(0);
+  size_t num_points = 20000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(dims, num_points);
+  Tree tree;
+  tree.init_tree(dims);
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+  tree.setIncrementalBounds(incremental);
+
+  using DistanceId = typename Tree::DistanceId;
+  size_t k = 10;
+  std::vector<DistanceId> knn(k), ball;
+  std::vector<typename Tree::point_t> queries;
+  for (int q = 0; q < 100; q++) {
+    queries.push_back(Eigen::VectorXd::Random(dims));
+  }
+  auto run = [&] {
+    for (const auto &x : queries) {
+      size_t n = tree.searchKnnInto(x, k, knn.data());
+      BOOST_TEST(n == k);
+      tree.searchCapacityLimitedBallInto(x, .3, k, knn.data());
+      tree.searchBallInto(x, .3, ball);
+      tree.search(x);
+    }
+  };
+  run(); // warm-up
+  size_t before = num_allocations;
+  run();
+  BOOST_TEST(num_allocations == before);
+
+  for (const auto &x : queries) {
+    size_t n = tree.searchKnnInto(x, k, knn.data());
+    auto expected = tree.searchKnn(x, k);
+    BOOST_TEST(n == expected.size());
+    for (size_t i = 0; i < n; i++) {
+      BOOST_TEST(knn[i].id == expected[i].id);
+    }
+    tree.searchBallInto(x, .3, ball);
+    BOOST_TEST(ball.size() == tree.searchBall(x, .3).size());
+  }
+}
+
+BOOST_AUTO_TEST_CASE(t_no_allocation) {
+  check_no_allocation<dynotree::KDTree<int, 3>>(3, false);
+  check_no_allocation<dynotree::KDTree<int, 3>>(3, true);
+  check_no_allocation<dynotree::KDTree<int, -1>>(6, false);
+  check_no_allocation<dynotree::KDTree<int, -1, 32, double,
+                                       dynotree::RnSquared<double>,
+                                       dynotree::LeafLayout::SoA>>(4, true);
+
+  // warm snapshot queries of a LogForest only allocate the returned vector
+  std::srand(0);
+  dynotree::LogForest<int, 3> forest;
+  forest.init_tree();
+  for (int i = 0; i < 5000; i++) {
+    forest.addPoint(Eigen::Vector3d::Random(), i);
+  }
+  forest.publish();
+  auto snapshot = forest.snapshot();
+  std::vector<Eigen::Vector3d> forest_queries(100);
+  for (auto &x : forest_queries) {
+    x = Eigen::Vector3d::Random();
+  }
+  auto forest_run = [&] {
+    for (const auto &x : forest_queries) {
+      BOOST_TEST(snapshot->searchKnn(x, 4).size() == 4);
+    }
+  };
+  forest_run(); // warm-up
+  size_t before = num_allocations;
+  forest_run();
+  BOOST_TEST(num_allocations - before == forest_queries.size());
+
+  // small queries in a replanning loop: returned vectors vs caller buffers
+  std::srand(0);
+  size_t num_points = 10000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(3, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(3, 1000000);
+  using Tree = dynotree::KDTree<int, 3>;
+  Tree tree;
+  tree.init_tree();
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+  double sum = 0;
+  auto tic = std::chrono::high_resolution_clock::now();
+  for (size_t q = 0; q < Q.cols(); q++) {
+    sum += tree.searchKnn(Q.col(q), 4)[0].distance;
+  }
+  std::cout << "searchKnn: " << time_since_s(tic) << "s" << std::endl;
+  Tree::DistanceId out[4];
+  tic = std::chrono::high_resolution_clock::now();
+  for (size_t q = 0; q < Q.cols(); q++) {
+    tree.searchKnnInto(Q.col(q), 4, out);
+    sum -= out[0].distance;
+  }
+  std::cout << "searchKnnInto: " << time_since_s(tic) << "s" << std::endl;
+  BOOST_TEST(std::abs(sum) < 1e-6);
+}
+
+template <typename Tree, size_t K>
+void check_fixed_k(int dims, bool incremental, double eps) {
+  std::srand(0);
+  size_t num_points = 20000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(dims, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(dims, 200);
+  Tree tree;
+  tree.init_tree(dims);
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+  tree.setIncrementalBounds(incremental);
+  for (size_t q = 0; q < Q.cols(); q++) {
+    auto fixed = tree.template searchKnnFixed<K>(Q.col(q), eps);
+    auto expected = tree.searchKnn(Q.col(q), K, eps);
+    BOOST_TEST(fixed.size() == expected.size());
+    for (size_t i = 0; i < fixed.size(); i++) {
+      BOOST_TEST(fixed[i].distance == expected[i].distance);
+    }
+  }
+}
+
+template <size_t K> void bench_fixed_k() {
+  std::srand(0);
+  size_t num_points = 100000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(4, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(4, 200000);
+  using Tree = dynotree::KDTree<int, 4>;
+  Tree tree;
+  tree.init_tree();
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+  std::vector<Tree::DistanceId> out(K);
+  double sum = 0;
+  auto tic = std::chrono::high_resolution_clock::now();
+  for (size_t q = 0; q < Q.cols(); q++) {
+    tree.searchKnnInto(Q.col(q), K, out.data());
+    sum += out[K - 1].distance;
+  }
+  double queue = time_since_s(tic);
+  tic = std::chrono::high_resolution_clock::now();
+  for (size_t q = 0; q < Q.cols(); q++) {
+    sum -= tree.searchKnnFixed<K>(Q.col(q))[K - 1].distance;
+  }
+  std::cout << "k = " << K << ": priority queue " << queue
+            << "s, inline array " << time_since_s(tic) << "s" << std::endl;
+  BOOST_TEST(std::abs(sum) < 1e-6);
+}
+
+BOOST_AUTO_TEST_CASE(t_fixed_k) {
+  check_fixed_k<dynotree::KDTree<int, 3>, 1>(3, false, 0);
+  check_fixed_k<dynotree::KDTree<int, 3>, 8>(3, true, 0);
+  check_fixed_k<dynotree::KDTree<int, -1>, 16>(6, false, 0);
+  check_fixed_k<dynotree::KDTree<int, -1>, 4>(6, false, .5);
+  check_fixed_k<dynotree::KDTree<int, -1, 32, double,
+                                 dynotree::RnSquared<double>,
+                                 dynotree::LeafLayout::SoA>,
+                5>(4, true, 0);
+
+  dynotree::KDTree<int, 3> empty;
+  empty.init_tree();
+  BOOST_TEST(empty.searchKnnFixed<4>(Eigen::Vector3d::Zero()).size() == 0);
+  BOOST_TEST(empty.search(Eigen::Vector3d::Zero()).distance ==
+             std::numeric_limits<double>::infinity());
+
+  bench_fixed_k<1>();
+  bench_fixed_k<4>();
+  bench_fixed_k<16>();
+}
+
+template <typename Tree>
+void check_within(Tree &tree, const Eigen::MatrixXd &X,
+                  const Eigen::MatrixXd &Q, double radius) {
+  for (size_t q = 0; q < Q.cols(); q++) {
+    size_t count = 0;
+    for (size_t i = 0; i < X.cols(); i++) {
+      count += tree.getStateSpace().distance(Q.col(q), X.col(i)) < radius;
+    }
+    BOOST_TEST(tree.countWithin(Q.col(q), radius) == count);
+    BOOST_TEST(tree.anyWithin(Q.col(q), radius) == (count > 0));
+    BOOST_TEST(tree.searchBall(Q.col(q), radius).size() == count);
+  }
+}
+
+template <typename Tree>
+void check_within(int dims, const typename Tree::state_space_t &space,
+                  double radius, double angle_row = -1) {
+  std::srand(0);
+  size_t num_points = 5000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(dims, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(dims, 100);
+  if (angle_row >= 0) {
+    X.row(angle_row) *= M_PI;
+    Q.row(angle_row) *= M_PI;
+  }
+  Tree tree;
+  tree.init_tree(dims, space);
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+  check_within(tree, X, Q, radius);
+  check_within(tree, X, Q, 4 * radius);
+}
+
+BOOST_AUTO_TEST_CASE(t_within) {
+  using dynotree::KDTree;
+  check_within<KDTree<int, 3>>(3, {}, .2);
+  check_within<KDTree<int, -1, 8, double, dynotree::RnSquared<double>>>(
+      4, {}, .1);
+  check_within<KDTree<int, -1, 32, double, dynotree::RnL1<double>>>(5, {},
+                                                                     .5);
+  check_within<KDTree<int, 1, 4, double, dynotree::SO2<double>>>(1, {}, .1,
+                                                                  0);
+  check_within<KDTree<int, -1, 32, double, dynotree::Combined<double>>>(
+      7, dynotree::Combined<double>({"Rn:3", "SO2", "RnL1:2", "RnSquared:1"}),
+      .5, 3);
+  // SO3 is not separable: no whole-node counting
+  {
+    std::srand(0);
+    Eigen::MatrixXd X = Eigen::MatrixXd::Random(7, 5000);
+    Eigen::MatrixXd Q = Eigen::MatrixXd::Random(7, 100);
+    for (size_t i = 0; i < X.cols(); i++) {
+      X.col(i).tail(4).normalize();
+    }
+    for (size_t q = 0; q < Q.cols(); q++) {
+      Q.col(q).tail(4).normalize();
+    }
+    KDTree<int, -1, 32, double, dynotree::Combined<double>> tree;
+    tree.init_tree(7, dynotree::Combined<double>({"Rn:3", "SO3"}));
+    for (size_t i = 0; i < X.cols(); i++) {
+      tree.addPoint(X.col(i), i);
+    }
+    check_within(tree, X, Q, .5);
+    check_within(tree, X, Q, 2);
+  }
+
+  // points hidden by set_inactive are not counted
+  {
+    std::srand(0);
+    Eigen::MatrixXd X = Eigen::MatrixXd::Random(3, 2000);
+    dynotree::KDTree<int, 3> tree;
+    tree.init_tree();
+    for (size_t i = 0; i < X.cols(); i++) {
+      tree.addPoint(X.col(i), i);
+    }
+    size_t before = tree.countWithin(Eigen::Vector3d::Zero(), 10);
+    tree.set_inactive(X.col(7));
+    BOOST_TEST(before == X.cols());
+    BOOST_TEST(tree.countWithin(Eigen::Vector3d::Zero(), 10) == before - 1);
+  }
+
+  // RRT* rewiring-sized counts: whole nodes vs collecting the ball
+  std::srand(0);
+  size_t num_points = 200000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(3, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(3, 10000);
+  dynotree::KDTree<int, 3> tree;
+  tree.init_tree();
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+  size_t total = 0;
+  auto tic = std::chrono::high_resolution_clock::now();
+  for (size_t q = 0; q < Q.cols(); q++) {
+    total += tree.searchBall(Q.col(q), .2).size();
+  }
+  std::cout << "searchBall: " << time_since_s(tic) << "s" << std::endl;
+  tic = std::chrono::high_resolution_clock::now();
+  for (size_t q = 0; q < Q.cols(); q++) {
+    total -= tree.countWithin(Q.col(q), .2);
+  }
+  std::cout << "countWithin: " << time_since_s(tic) << "s" << std::endl;
+  BOOST_TEST(total == 0);
+  tic = std::chrono::high_resolution_clock::now();
+  for (size_t q = 0; q < Q.cols(); q++) {
+    total += tree.anyWithin(Q.col(q), .2);
+  }
+  std::cout << "anyWithin: " << time_since_s(tic) << "s" << std::endl;
+}
+
+template <typename Tree> void check_search_box(int dims) {
+  std::srand(0);
+  size_t num_points = 20000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(dims, num_points);
+  Tree tree;
+  tree.init_tree(dims);
+  tree.setIdIndex();
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+  for (size_t i = 0; i < num_points; i += 3) {
+    BOOST_TEST(tree.removePoint(i));
+  }
+
+  double inf = std::numeric_limits<double>::infinity();
+  for (int q = 0; q < 50; q++) {
+    Eigen::VectorXd a = Eigen::VectorXd::Random(dims);
+    Eigen::VectorXd b = Eigen::VectorXd::Random(dims);
+    typename Tree::point_t lb = a.cwiseMin(b), ub = a.cwiseMax(b);
+    if (q % 2) {
+      // only the first two coordinates are constrained
+      lb.tail(dims - 2).setConstant(-inf);
+      ub.tail(dims - 2).setConstant(inf);
+    }
+    std::vector<int> expected;
+    for (size_t i = 0; i < num_points; i++) {
+      if (i % 3 != 0 && (X.col(i).array() >= lb.array()).all() &&
+          (X.col(i).array() <= ub.array()).all()) {
+        expected.push_back(i);
+      }
+    }
+    auto ids = tree.searchBox(lb, ub);
+    std::sort(ids.begin(), ids.end());
+    BOOST_TEST(ids == expected);
+  }
+}
+
+BOOST_AUTO_TEST_CASE(t_search_box) {
+  using dynotree::LeafLayout;
+  check_search_box<dynotree::KDTree<int, 3>>(3);
+  check_search_box<dynotree::KDTree<int, -1, 8>>(6);
+  check_search_box<dynotree::KDTree<int, -1, 32, double,
+                                    dynotree::RnSquared<double>,
+                                    LeafLayout::Int16>>(4);
+  check_search_box<dynotree::KDTree<int, 4, 32, double,
+                                    dynotree::Rn<double, 4>,
+                                    LeafLayout::SoA>>(4);
+
+  // a region of the workspace that changed: tree vs testing every point
+  std::srand(0);
+  size_t num_points = 1000000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(3, num_points);
+  dynotree::KDTree<int, 3> tree;
+  tree.init_tree();
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+  for (double side : {.05, .5}) {
+    size_t found = 0, scanned = 0;
+    auto tic = std::chrono::high_resolution_clock::now();
+    for (int q = 0; q < 100; q++) {
+      Eigen::Vector3d lb = (1 - side) * Eigen::Vector3d::Random();
+      Eigen::Vector3d ub = lb.array() + side;
+      tree.searchBox(lb, ub, [&](int) { found++; });
+    }
+    double elapsed = time_since_s(tic);
+    std::srand(0);
+    tic = std::chrono::high_resolution_clock::now();
+    for (int q = 0; q < 100; q++) {
+      Eigen::Vector3d lb = (1 - side) * Eigen::Vector3d::Random();
+      Eigen::Vector3d ub = lb.array() + side;
+      for (size_t i = 0; i < num_points; i++) {
+        scanned += (X.col(i).array() >= lb.array()).all() &&
+                   (X.col(i).array() <= ub.array()).all();
+      }
+    }
+    std::cout << "box side " << side << ": searchBox " << elapsed
+              << "s, linear scan " << time_since_s(tic) << "s" << std::endl;
+    BOOST_TEST(found > 0);
+  }
+}
+
+template <typename Tree> void check_filtered_knn(int dims, bool incremental) {
+  std::srand(0);
+  size_t num_points = 20000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(dims, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(dims, 100);
+  Tree tree;
+  tree.init_tree(dims);
+  tree.setIdIndex();
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+  for (size_t i = 0; i < num_points; i += 5) {
+    tree.removePoint(i);
+  }
+  tree.setIncrementalBounds(incremental);
+
+  // e.g. the other tree of RRT-Connect: only ids with the right parity
+  auto odd = [](int id) { return id % 2 == 1; };
+  std::vector<bool> alive(num_points);
+  for (size_t i = 0; i < num_points; i++) {
+    alive[i] = i % 5 != 0 && odd(i);
+  }
+  for (size_t q = 0; q < Q.cols(); q++) {
+    std::vector<double> distances;
+    for (size_t i = 0; i < num_points; i++) {
+      if (alive[i]) {
+        distances.push_back(
+            tree.getStateSpace().distance(Q.col(q), X.col(i)));
+      }
+    }
+    std::sort(distances.begin(), distances.end());
+    auto out = tree.searchKnn(Q.col(q), 10, odd);
+    BOOST_TEST(out.size() == 10);
+    for (size_t i = 0; i < out.size(); i++) {
+      BOOST_TEST(alive[out[i].id]);
+      BOOST_TEST(std::abs(out[i].distance - distances[i]) < 1e-10);
+    }
+  }
+  auto none = tree.searchKnn(Q.col(0), 10, [](int) { return false; });
+  BOOST_TEST(none.size() == 0);
+}
+
+BOOST_AUTO_TEST_CASE(t_filtered_knn) {
+  check_filtered_knn<dynotree::KDTree<int, 3>>(3, false);
+  check_filtered_knn<dynotree::KDTree<int, 3>>(3, true);
+  check_filtered_knn<dynotree::KDTree<int, -1, 8>>(5, false);
+  check_filtered_knn<dynotree::KDTree<int, -1, 32, double,
+                                      dynotree::RnSquared<double>,
+                                      dynotree::LeafLayout::Int16>>(4, true);
+
+  // a rare condition: 1% of the ids, vs over-fetching and filtering
+  std::srand(0);
+  size_t num_points = 100000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(3, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(3, 10000);
+  dynotree::KDTree<int, 3> tree;
+  tree.init_tree();
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+  auto rare = [](int id) { return id % 100 == 0; };
+  size_t missed = 0;
+  auto tic = std::chrono::high_resolution_clock::now();
+  for (size_t q = 0; q < Q.cols(); q++) {
+    size_t found = 0;
+    for (const auto &dp : tree.searchKnn(Q.col(q), 500)) {
+      found += rare(dp.id);
+    }
+    missed += found < 5;
+  }
+  std::cout << "searchKnn(500) and filter: " << time_since_s(tic) << "s, "
+            << missed << " queries with fewer than 5 results" << std::endl;
+  tic = std::chrono::high_resolution_clock::now();
+  for (size_t q = 0; q < Q.cols(); q++) {
+    BOOST_TEST(tree.searchKnn(Q.col(q), 5, rare).size() == 5);
+  }
+  std::cout << "searchKnn(5, pred): " << time_since_s(tic) << "s"
+            << std::endl;
+}
+
+template <typename Tree> void check_dual_tree(int dims) {
+  std::srand(0);
+  size_t num_a = 3000, num_b = 5000, k = 5;
+  Eigen::MatrixXd A = Eigen::MatrixXd::Random(dims, num_a);
+  Eigen::MatrixXd B = Eigen::MatrixXd::Random(dims, num_b);
+  Tree tree_a, tree_b;
+  tree_a.init_tree(dims);
+  tree_b.init_tree(dims);
+  tree_a.setIdIndex();
+  tree_b.setIdIndex();
+  for (size_t i = 0; i < num_a; i++) {
+    tree_a.addPoint(A.col(i), i);
+  }
+  for (size_t i = 0; i < num_b; i++) {
+    tree_b.addPoint(B.col(i), i);
+  }
+  for (size_t i = 0; i < num_a; i += 7) {
+    tree_a.removePoint(i);
+  }
+  for (size_t i = 0; i < num_b; i += 3) {
+    tree_b.removePoint(i);
+  }
+
+  auto join = dynotree::allKnn(tree_a, tree_b, k);
+  BOOST_TEST(join.size() == tree_a.size());
+  std::vector<bool> seen(num_a);
+  for (const auto &[id, neighbours] : join) {
+    BOOST_TEST(id % 7 != 0);
+    BOOST_TEST(!seen[id]);
+    seen[id] = true;
+    auto expected = tree_b.searchKnn(A.col(id), k);
+    BOOST_TEST(neighbours.size() == expected.size());
+    for (size_t i = 0; i < neighbours.size(); i++) {
+      BOOST_TEST(neighbours[i].id % 3 != 0);
+      BOOST_TEST(std::abs(neighbours[i].distance - expected[i].distance) <
+                 1e-10);
+    }
+  }
+
+  double best = std::numeric_limits<double>::infinity();
+  for (size_t i = 0; i < num_a; i++) {
+    if (i % 7 != 0) {
+      best = std::min(best, tree_b.search(A.col(i)).distance);
+    }
+  }
+  auto pair = dynotree::closestPair(tree_a, tree_b);
+  BOOST_TEST(std::abs(pair.distance - best) < 1e-10);
+  BOOST_TEST(pair.first % 7 != 0);
+  BOOST_TEST(pair.second % 3 != 0);
+  BOOST_TEST(std::abs(tree_a.getStateSpace().distance(A.col(pair.first),
+                                                      B.col(pair.second)) -
+                      best) < 1e-10);
+
+  Tree empty;
+  empty.init_tree(dims);
+  BOOST_TEST(empty.allKnn(tree_b, k).size() == 0);
+  BOOST_TEST(tree_a.allKnn(empty, k).size() == tree_a.size());
+  BOOST_TEST(std::isinf(tree_a.closestPair(empty).distance));
+}
+
+BOOST_AUTO_TEST_CASE(t_dual_tree) {
+  check_dual_tree<dynotree::KDTree<int, 3>>(3);
+  check_dual_tree<dynotree::KDTree<int, -1, 8>>(5);
+  check_dual_tree<dynotree::KDTree<int, 1, 4, double, dynotree::SO2<double>>>(
+      1);
+  check_dual_tree<dynotree::KDTree<int, -1, 32, double,
+                                   dynotree::RnL1<double>,
+                                   dynotree::LeafLayout::Int16>>(4);
+  // not separable: one query per point
+  check_dual_tree<
+      dynotree::KDTree<int, 3, 32, double, dynotree::R2SO2Squared<double>>>(3);
+
+  // all nearest neighbours of 100k points, vs one searchKnn per point
+  std::srand(0);
+  size_t num_points = 100000, k = 4;
+  Eigen::MatrixXd A = Eigen::MatrixXd::Random(3, num_points);
+  Eigen::MatrixXd B = Eigen::MatrixXd::Random(3, num_points);
+  dynotree::KDTree<int, 3> tree_a, tree_b;
+  tree_a.init_tree();
+  tree_b.init_tree();
+  for (size_t i = 0; i < num_points; i++) {
+    tree_a.addPoint(A.col(i), i);
+    tree_b.addPoint(B.col(i), i);
+  }
+  auto tic = std::chrono::high_resolution_clock::now();
+  double total = 0;
+  for (size_t i = 0; i < num_points; i++) {
+    total += tree_b.searchKnn(A.col(i), k).back().distance;
+  }
+  std::cout << "searchKnn per point: " << time_since_s(tic) << "s"
+            << std::endl;
+  tic = std::chrono::high_resolution_clock::now();
+  double total_join = 0;
+  for (const auto &[id, neighbours] : tree_a.allKnn(tree_b, k)) {
+    total_join += neighbours.back().distance;
+  }
+  std::cout << "allKnn: " << time_since_s(tic) << "s" << std::endl;
+  BOOST_TEST(std::abs(total - total_join) < 1e-6);
+  tic = std::chrono::high_resolution_clock::now();
+  auto pair = tree_a.closestPair(tree_b);
+  std::cout << "closestPair: " << time_since_s(tic) << "s, distance "
+            << pair.distance << std::endl;
+}
+
+template <typename Graph>
+std::set<std::pair<int, int>> graph_edges(const Graph &graph) {
+  std::set<std::pair<int, int>> edges;
+  BOOST_TEST(graph.offsets.size() == graph.ids.size() + 1);
+  BOOST_TEST(graph.offsets.back() == graph.neighbours.size());
+  for (size_t v = 0; v < graph.ids.size(); v++) {
+    for (size_t j = graph.offsets[v]; j < graph.offsets[v + 1]; j++) {
+      if (j > graph.offsets[v]) {
+        BOOST_TEST(graph.distances[j - 1] <= graph.distances[j]);
+      }
+      int a = graph.ids[v], b = graph.neighbours[j];
+      BOOST_TEST(edges.insert({std::min(a, b), std::max(a, b)}).second);
+    }
+  }
+  return edges;
+}
+
+template <typename Tree> void check_graph(int dims, double radius) {
+  std::srand(0);
+  size_t num_points = 3000, k = 6;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(dims, num_points);
+  Tree tree;
+  tree.init_tree(dims);
+  tree.setIdIndex();
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+  for (size_t i = 0; i < num_points; i += 7) {
+    tree.removePoint(i);
+  }
+
+  std::set<std::pair<int, int>> ball_edges, knn_edges;
+  for (int i = 0; i < int(num_points); i++) {
+    if (i % 7 == 0) {
+      continue;
+    }
+    for (const auto &dp : tree.searchBall(X.col(i), radius)) {
+      if (dp.id != i) {
+        ball_edges.insert({std::min(i, dp.id), std::max(i, dp.id)});
+      }
+    }
+    size_t count = 0;
+    for (const auto &dp : tree.searchKnn(X.col(i), k + 1)) {
+      if (dp.id != i && count++ < k) {
+        knn_edges.insert({std::min(i, dp.id), std::max(i, dp.id)});
+      }
+    }
+  }
+
+  auto graph = tree.buildRadiusGraph(radius);
+  BOOST_TEST(graph.ids.size() == tree.size());
+  BOOST_TEST((graph_edges(graph) == ball_edges));
+  for (size_t j = 0; j < graph.distances.size(); j++) {
+    BOOST_TEST(graph.distances[j] < radius);
+  }
+  auto parallel = tree.buildRadiusGraph(radius, 4);
+  BOOST_TEST((parallel.ids == graph.ids));
+  BOOST_TEST((parallel.offsets == graph.offsets));
+  BOOST_TEST((parallel.neighbours == graph.neighbours));
+
+  auto knn_graph = tree.buildKnnGraph(k);
+  BOOST_TEST((graph_edges(knn_graph) == knn_edges));
+  BOOST_TEST((graph_edges(tree.buildKnnGraph(k, 4)) == knn_edges));
+}
+
+BOOST_AUTO_TEST_CASE(t_graph) {
+  check_graph<dynotree::KDTree<int, 3>>(3, 0.2);
+  check_graph<dynotree::KDTree<int, -1, 8>>(4, 0.4);
+  check_graph<dynotree::KDTree<int, 2, 16, double, dynotree::RnL1<double>,
+                               dynotree::LeafLayout::SoA>>(2, 0.1);
+  // not separable: every point searches the other subtree
+  check_graph<
+      dynotree::KDTree<int, 3, 32, double, dynotree::R2SO2Squared<double>>>(
+      3, 0.05);
+
+  // PRM roadmap of 100k points with about 10 neighbours per point, vs one
+  // searchBall per point and deduplication of the edges
+  std::srand(0);
+  size_t num_points = 100000;
+  double radius = 0.06;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(3, num_points);
+  dynotree::KDTree<int, 3> tree;
+  tree.init_tree();
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+  auto tic = std::chrono::high_resolution_clock::now();
+  std::vector<std::pair<int, int>> edges;
+  for (int i = 0; i < int(num_points); i++) {
+    for (const auto &dp : tree.searchBall(X.col(i), radius)) {
+      if (dp.id > i) {
+        edges.emplace_back(i, dp.id);
+      }
+    }
+  }
+  std::cout << "searchBall per point: " << time_since_s(tic) << "s, "
+            << edges.size() << " edges" << std::endl;
+  for (int num_threads : {1, 4}) {
+    tic = std::chrono::high_resolution_clock::now();
+    auto graph = tree.buildRadiusGraph(radius, num_threads);
+    std::cout << "buildRadiusGraph, " << num_threads
+              << " threads: " << time_since_s(tic) << "s" << std::endl;
+    BOOST_TEST(graph.neighbours.size() == edges.size());
+  }
+  for (int num_threads : {1, 4}) {
+    tic = std::chrono::high_resolution_clock::now();
+    auto graph = tree.buildKnnGraph(10, num_threads);
+    std::cout << "buildKnnGraph(10), " << num_threads
+              << " threads: " << time_since_s(tic) << "s, "
+              << graph.neighbours.size() << " edges" << std::endl;
+  }
+}
+
+template <typename Tree>
+void check_serialization(int dims, const typename Tree::state_space_t &space =
+                                       typename Tree::state_space_t()) {
+  std::srand(0);
+  size_t num_points = 5000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(dims, num_points + 100);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(dims, 100);
+  auto fill = [&](Tree &tree) {
+    tree.init_tree(dims, space);
+    tree.setIdIndex();
+    for (size_t i = 0; i < num_points; i++) {
+      tree.addPoint(X.col(i), i);
+    }
+    for (size_t i = 0; i < num_points; i += 9) {
+      tree.removePoint(i);
+    }
+    tree.set_inactive(X.col(10));
+    tree.set_inactive(X.col(11));
+    BOOST_TEST(tree.removePoint(11));
+  };
+  Tree tree;
+  fill(tree);
+
+  std::ostringstream out;
+  tree.save(out);
+  std::string data = out.str();
+
+  // the bytes only depend on the content of the tree
+  Tree twin;
+  fill(twin);
+  std::ostringstream twin_out;
+  twin.save(twin_out);
+  BOOST_TEST((twin_out.str() == data));
+  Tree copy;
+  copy.setIdIndex(); // kept by load
+  copy.load(data.data(), data.size());
+  BOOST_TEST(copy.size() == tree.size());
+
+  auto path = (std::filesystem::temp_directory_path() / "dynotree_test.bin")
+                  .string();
+  tree.save(path);
+  Tree from_file;
+  from_file.load(path);
+  std::filesystem::remove(path);
+
+  // queries match, and the loaded trees stay dynamic
+  for (size_t i = num_points; i < num_points + 100; i++) {
+    tree.addPoint(X.col(i), i);
+    copy.addPoint(X.col(i), i);
+    from_file.addPoint(X.col(i), i);
+  }
+  for (size_t q = 0; q < Q.cols(); q++) {
+    auto expected = tree.searchKnn(Q.col(q), 10);
+    for (Tree *loaded : {&copy, &from_file}) {
+      auto found = loaded->searchKnn(Q.col(q), 10);
+      BOOST_TEST(found.size() == expected.size());
+      for (size_t j = 0; j < found.size(); j++) {
+        BOOST_TEST(found[j].id == expected[j].id);
+        BOOST_TEST(found[j].distance == expected[j].distance);
+      }
+    }
+  }
+  BOOST_TEST(copy.removePoint(1));
+  BOOST_TEST(!copy.removePoint(9));
+
+  Tree truncated;
+  BOOST_CHECK_THROW(truncated.load(data.data(), data.size() / 2),
+                    std::runtime_error);
+  BOOST_CHECK_THROW(truncated.load(data.data() + 1, data.size() - 1),
+                    std::runtime_error);
+}
+
+BOOST_AUTO_TEST_CASE(t_serialization) {
+  check_serialization<dynotree::KDTree<int, 3>>(3);
+  check_serialization<dynotree::KDTree<int, -1, 8>>(5);
+  check_serialization<dynotree::KDTree<int, -1, 32, double,
+                                       dynotree::RnSquared<double>,
+                                       dynotree::LeafLayout::SoA>>(4);
+  check_serialization<dynotree::KDTree<int, 3, 32, double,
+                                       dynotree::Rn<double, 3>,
+                                       dynotree::LeafLayout::Int16>>(3);
+  check_serialization<dynotree::KDTree<int, 3, 32, double,
+                                       dynotree::Rn<double, 3>,
+                                       dynotree::LeafLayout::Float32>>(3);
+
+  // the weights and layout of a Combined space are saved too
+  dynotree::Combined<double> combined({"Rn:2", "SO2"});
+  combined.set_weights(Eigen::Vector3d(1, 2, 0.5));
+  check_serialization<
+      dynotree::KDTree<int, -1, 32, double, dynotree::Combined<double>>>(
+      3, combined);
+
+  // a tree of another type is rejected
+  dynotree::KDTree<int, 3> tree;
+  tree.init_tree();
+  tree.addPoint(Eigen::Vector3d(0, 0, 0), 0);
+  std::ostringstream out;
+  tree.save(out);
+  std::string data = out.str();
+  dynotree::KDTree<int, 3, 16> other;
+  BOOST_CHECK_THROW(other.load(data.data(), data.size()), std::runtime_error);
+
+  // a corrupt file either throws or loads a well-formed tree
+  for (int i = 1; i < 300; i++) {
+    tree.addPoint(Eigen::Vector3d::Random(), i);
+  }
+  out.str("");
+  tree.save(out);
+  data = out.str();
+  size_t rejected = 0;
+  for (size_t i = 0; i < data.size(); i++) {
+    std::string corrupt = data;
+    corrupt[i] = ~corrupt[i];
+    dynotree::KDTree<int, 3> loaded;
+    try {
+      loaded.load(corrupt.data(), corrupt.size());
+    } catch (const std::runtime_error &) {
+      rejected++;
+      continue;
+    }
+    loaded.searchKnn(Eigen::Vector3d::Zero(), 5);
+  }
+  BOOST_TEST(rejected > 0);
+
+  // options are checked as by their setters. The file ends with the
+  // incremental flag, the inactive count and the balance factor.
+  std::string corrupt = data;
+  double alpha = 1;
+  std::memcpy(&corrupt[corrupt.size() - sizeof(alpha)], &alpha, sizeof(alpha));
+  dynotree::KDTree<int, 3> unbalanced;
+  BOOST_CHECK_THROW(unbalanced.load(corrupt.data(), corrupt.size()),
+                    std::runtime_error);
+  dynotree::KDTree<int, 4, 32, double, dynotree::SO3<double>> so3;
+  so3.init_tree();
+  so3.addPoint(Eigen::Vector4d(0, 0, 0, 1), 0);
+  out.str("");
+  so3.save(out);
+  corrupt = out.str();
+  so3.load(corrupt.data(), corrupt.size());
+  corrupt[corrupt.size() - 2 * sizeof(double) - 1] = 1;
+  BOOST_CHECK_THROW(so3.load(corrupt.data(), corrupt.size()),
+                    std::runtime_error);
+
+  // cold start of a 1M point tree: build vs load
+  std::srand(0);
+  size_t num_points = 1000000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(3, num_points);
+  std::vector<int> ids(num_points);
+  for (size_t i = 0; i < num_points; i++) {
+    ids[i] = i;
+  }
+  auto tic = std::chrono::high_resolution_clock::now();
+  dynotree::KDTree<int, 3> big;
+  big.init_tree();
+  for (size_t i = 0; i < num_points; i++) {
+    big.addPoint(X.col(i), ids[i]);
+  }
+  std::cout << "addPoint: " << time_since_s(tic) << "s" << std::endl;
+  tic = std::chrono::high_resolution_clock::now();
+  dynotree::KDTree<int, 3> built;
+  built.init_tree();
+  built.build(X, ids);
+  std::cout << "build: " << time_since_s(tic) << "s" << std::endl;
+
+  auto path =
+      (std::filesystem::temp_directory_path() / "dynotree_big.bin").string();
+  tic = std::chrono::high_resolution_clock::now();
+  big.save(path);
+  std::cout << "save: " << time_since_s(tic) << "s, "
+            << std::filesystem::file_size(path) << " bytes" << std::endl;
+  tic = std::chrono::high_resolution_clock::now();
+  dynotree::KDTree<int, 3> loaded;
+  loaded.load(path);
+  std::cout << "load: " << time_since_s(tic) << "s" << std::endl;
+  std::filesystem::remove(path);
+  BOOST_TEST(loaded.size() == num_points);
+  BOOST_TEST(loaded.search(X.col(7)).id == 7);
+}
+
+template <typename Tree> void check_compact(int dims) {
+  std::srand(0);
+  size_t num_points = 20000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(dims, num_points + 1000);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(dims, 100);
+  Tree tree, reference;
+  BOOST_TEST(tree.compact() == 0); // before init_tree: no nodes
+  tree.init_tree(dims);
+  reference.init_tree(dims);
+  tree.setIdIndex();
+  reference.setIdIndex();
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+    reference.addPoint(X.col(i), i);
+  }
+  for (size_t i = 0; i < num_points; i += 3) {
+    tree.removePoint(i);
+    reference.removePoint(i);
+  }
+
+  auto before = tree.memoryUsage();
+  BOOST_TEST(before.slack > 0);
+  BOOST_TEST(before.buckets > 0);
+  BOOST_TEST(before.index > 0);
+  size_t freed = tree.compact();
+  auto after = tree.memoryUsage();
+  BOOST_TEST(freed == before.total() - after.total());
+  BOOST_TEST(after.slack < before.slack / 4);
+  BOOST_TEST(after.buckets == before.buckets);
+  BOOST_TEST(after.nodes <= before.nodes);
+  BOOST_TEST(tree.compact() == 0);
+  BOOST_TEST(tree.depthStats().maxDepth == reference.depthStats().maxDepth);
+
+  // same answers, and the tree (and its id index) stays usable
+  auto check_queries = [&] {
+    for (size_t q = 0; q < Q.cols(); q++) {
+      auto expected = reference.searchKnn(Q.col(q), 10);
+      auto found = tree.searchKnn(Q.col(q), 10);
+      BOOST_TEST(found.size() == expected.size());
+      for (size_t j = 0; j < found.size(); j++) {
+        BOOST_TEST(found[j].id == expected[j].id);
+      }
+    }
+  };
+  check_queries();
+  for (size_t i = 1; i < num_points; i += 3) {
+    BOOST_TEST(tree.removePoint(i));
+    reference.removePoint(i);
+  }
+  for (size_t i = num_points; i < num_points + 1000; i++) {
+    tree.addPoint(X.col(i), i);
+    reference.addPoint(X.col(i), i);
+  }
+  check_queries();
+  BOOST_TEST(tree.size() == reference.size());
+}
+
+BOOST_AUTO_TEST_CASE(t_compact) {
+  check_compact<dynotree::KDTree<int, 3>>(3);
+  check_compact<dynotree::KDTree<int, -1, 8>>(5);
+  check_compact<dynotree::KDTree<int, -1, 32, double,
+                                 dynotree::RnSquared<double>,
+                                 dynotree::LeafLayout::SoA>>(4);
+  check_compact<dynotree::KDTree<int, 3, 32, double, dynotree::Rn<double, 3>,
+                                 dynotree::LeafLayout::Int16>>(3);
+
+  // 1M incrementally inserted points: memory and query time
+  std::srand(0);
+  size_t num_points = 1000000;
+  Eigen::MatrixXd X = Eigen::MatrixXd::Random(3, num_points);
+  Eigen::MatrixXd Q = Eigen::MatrixXd::Random(3, 100000);
+  dynotree::KDTree<int, 3> tree;
+  tree.init_tree();
+  for (size_t i = 0; i < num_points; i++) {
+    tree.addPoint(X.col(i), i);
+  }
+  auto print = [](const auto &usage) {
+    std::cout << "nodes " << usage.nodes << ", bounds " << usage.bounds
+              << ", buckets " << usage.buckets << ", slack " << usage.slack
+              << ", total " << usage.total() << std::endl;
+  };
+  auto queries = [&] {
+    auto tic = std::chrono::high_resolution_clock::now();
+    for (size_t q = 0; q < Q.cols(); q++) {
+      tree.searchKnn(Q.col(q), 5);
+    }
+    return time_since_s(tic);
+  };
+  print(tree.memoryUsage());
+  std::cout << "searchKnn: " << queries() << "s" << std::endl;
+  auto tic = std::chrono::high_resolution_clock::now();
+  size_t freed = tree.compact();
+  std::cout << "compact: " << time_since_s(tic) << "s, " << freed
+            << " bytes freed" << std::endl;
+  print(tree.memoryUsage());
+  std::cout << "searchKnn: " << queries() << "s" << std::endl;
+}